@@ -1,18 +1,1597 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Range mode (--range=START:END). The range is handed out to threads in
+// chunks from an atomic counter and each thread keeps its own aggregates,
+// which are summed at the end. Stopping times of starts below memo_size are
+// kept in a table shared by all threads; a trajectory that drops below its
+// start is finished from the table when its value has already been computed.
+// Entries are written once with the same value by whoever gets there, so
+// relaxed atomics are enough.
+#define RANGE_CHUNK 4096
+#define HIST_WIDTH 32
+#define HIST_BUCKETS 64
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_steps;
+    uint32_t max_steps;
+    uint64_t max_n;
+    uint64_t hist[HIST_BUCKETS];
+} RangeStats;
+
+typedef struct {
+    uint64_t n;
+    uint32_t glide;
+} Record;
+
+typedef struct {
+    uint64_t to128, to_big;
+} Promotions;
+
+typedef struct {
+    RangeStats stats;
+    uint64_t promoted;
+    Promotions promotions;
+    Record *records;
+    size_t nrecords, records_cap;
+    uint64_t sieved;
+} __attribute__((aligned(64))) RangeWorker;
+
+static uint64_t range_start, range_end;
+static atomic_uint_fast64_t range_next_local;
+static atomic_uint_fast64_t *range_next = &range_next_local;
+static _Atomic uint16_t *memo = NULL;
+static uint64_t memo_size = 1u << 22;
+static int num_threads = 0;
+static int num_procs = 0;
+
+static void range_add(RangeStats *s, uint64_t n, uint32_t steps) {
+    s->count++;
+    s->total_steps += steps;
+    if (steps > s->max_steps || (steps == s->max_steps && n < s->max_n) || s->count == 1) {
+        s->max_steps = steps;
+        s->max_n = n;
+    }
+    uint32_t b = steps / HIST_WIDTH;
+    s->hist[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+}
+
+static inline int memo_lookup(uint64_t n, int64_t *steps) {
+    if (n >= memo_size) return 0;
+    uint16_t known = atomic_load_explicit(&memo[n], memory_order_relaxed);
+    if (known == 0) return 0;
+    *steps += known;
+    return 1;
+}
+
+static inline void memo_store(uint64_t start, int64_t steps) {
+    if (start < memo_size && steps <= UINT16_MAX) {
+        atomic_store_explicit(&memo[start], (uint16_t)steps, memory_order_relaxed);
+    }
+}
+
+// Kernels. Each returns the total stopping time of n (steps to reach 1), or
+// -1 if the trajectory leaves 64 bits, in which case the caller redoes it on
+// the wide path. They finish from the memo table once the trajectory drops
+// below its start.
+//
+// The jump kernel works on T(n) = n/2 or (3n+1)/2. For n = a*2^k + b, k
+// applications of T give a*3^c + d, where c is the number of odd steps among
+// the first k steps of b and d = T^k(b); in ordinary steps that is k + c.
+// jump_odd holds c and jump_pair holds 3^c and d in one word. Values below
+// 2^k take their remaining steps from a table, so a trajectory costs two
+// lookups, a multiply and an add per k bits.
+#define JUMP_BITS_MIN 4
+#define JUMP_BITS_MAX 20
+
+static int jump_bits = 16;
+static uint64_t jump_size;
+static uint8_t *jump_odd;
+static uint64_t *jump_pair;
+static uint16_t *small_steps;
+
+static int64_t steps_naive(uint64_t n) {
+    uint64_t start = n;
+    int64_t steps = 0;
+    while (n != 1) {
+        if (n < start && memo_lookup(n, &steps)) break;
+        if (n % 2 == 0) {
+            n = n / 2;
+        } else {
+            if (n > (UINT64_MAX - 1) / 3) return -1;
+            n = 3 * n + 1;
+        }
+        steps++;
+    }
+    memo_store(start, steps);
+    return steps;
+}
+
+static int64_t steps_ctz(uint64_t n) {
+    uint64_t start = n;
+    int z = __builtin_ctzll(n);
+    int64_t steps = z;
+    n >>= z;
+    while (n != 1) {
+        if (n < start && memo_lookup(n, &steps)) break;
+        if (n > (UINT64_MAX - 1) / 3) return -1;
+        n = 3 * n + 1;
+        z = __builtin_ctzll(n);
+        n >>= z;
+        steps += 1 + z;
+    }
+    memo_store(start, steps);
+    return steps;
+}
+
+// Continues the trajectory of start, which is at n after steps steps.
+static int64_t steps_jump_from(uint64_t n, uint64_t start, int64_t steps) {
+    while (n >= jump_size) {
+        if (n < start && memo_lookup(n, &steps)) {
+            memo_store(start, steps);
+            return steps;
+        }
+        uint64_t b = n & (jump_size - 1);
+        uint64_t next;
+        if (__builtin_mul_overflow(n >> jump_bits, jump_pair[b] >> 32, &next) ||
+            __builtin_add_overflow(next, jump_pair[b] & 0xffffffffu, &next)) {
+            return -1;
+        }
+        steps += jump_bits + jump_odd[b];
+        n = next;
+    }
+    steps += small_steps[n];
+    memo_store(start, steps);
+    return steps;
+}
+
+static int64_t steps_jump(uint64_t n) {
+    return steps_jump_from(n, n, 0);
+}
+
+// Glide of n >= 2: steps until the trajectory first drops below n.
+static int64_t glide(uint64_t n) {
+    uint64_t x = n;
+    int64_t steps = 0;
+    while (x >= n) {
+        if (x % 2 == 0) {
+            x = x / 2;
+        } else {
+            if (x > (UINT64_MAX - 1) / 3) return -1;
+            x = 3 * x + 1;
+        }
+        steps++;
+    }
+    return steps;
+}
+
+// Mod 2^k sieve for glide records. If the first j <= k steps of T on a
+// residue b contain c odd steps with 3^c < 2^j, every n = b (mod 2^k) above
+// some threshold drops below itself within j + c steps, so it cannot beat a
+// glide of at least that many.
+static uint8_t *sieve_bound;
+static uint64_t sieve_min;
+
+static int jump_init(void) {
+    uint32_t pow3[JUMP_BITS_MAX + 1];
+    jump_size = 1ull << jump_bits;
+    pow3[0] = 1;
+    for (int i = 1; i <= JUMP_BITS_MAX; i++) pow3[i] = pow3[i - 1] * 3;
+    // Padded so a 32-bit gather at the last index stays inside the table.
+    jump_odd = (uint8_t *)calloc(jump_size + 4, 1);
+    small_steps = (uint16_t *)malloc(jump_size * sizeof(uint16_t));
+    jump_pair = (uint64_t *)malloc(jump_size * sizeof(uint64_t));
+    sieve_bound = (uint8_t *)malloc(jump_size);
+    if (jump_odd == NULL || jump_pair == NULL || small_steps == NULL || sieve_bound == NULL) {
+        return 0;
+    }
+
+    sieve_min = jump_size;
+    for (uint64_t b = 0; b < jump_size; b++) {
+        uint64_t y = b;
+        int odd = 0;
+        sieve_bound[b] = 0;
+        for (int j = 1; j <= jump_bits; j++) {
+            if (y & 1) {
+                y = (3 * y + 1) / 2;
+                odd++;
+            } else {
+                y /= 2;
+            }
+            if (sieve_bound[b] == 0 && pow3[odd] < (1ull << j)) {
+                sieve_bound[b] = (uint8_t)(j + odd);
+                // T^j(n) = 3^c (n - b) / 2^j + T^j(b) < n once
+                // n (2^j - 3^c) > 2^j T^j(b) - 3^c b.
+                __int128 num = ((__int128)y << j) - (__int128)pow3[odd] * b;
+                uint64_t den = (1ull << j) - pow3[odd];
+                if (num >= 0 && (uint64_t)(num / den) + 1 > sieve_min) sieve_min = (uint64_t)(num / den) + 1;
+            }
+        }
+        jump_odd[b] = (uint8_t)odd;
+        jump_pair[b] = (uint64_t)pow3[odd] << 32 | (uint32_t)y;
+    }
+
+    small_steps[0] = 0;
+    for (uint64_t n = 1; n < jump_size; n++) {
+        uint64_t x = n;
+        uint16_t steps = 0;
+        while (x != 1) {
+            if (x < n) {
+                steps += small_steps[x];
+                break;
+            }
+            x = x % 2 == 0 ? x / 2 : 3 * x + 1;
+            steps++;
+        }
+        small_steps[n] = steps;
+    }
+    return 1;
+}
+
+// Wide path. A trajectory that leaves 64 bits continues in unsigned __int128
+// and, past that, in a little-endian array of 64-bit limbs; it drops back to
+// the narrower form as soon as the value fits again, so only the excursion
+// itself runs at the slower width.
+typedef struct {
+    uint64_t *limb;
+    size_t len, cap;
+} BigNum;
+
+#define U64_STEP_MAX ((UINT64_MAX - 1) / 3)
+#define U128_MAX (~(unsigned __int128)0)
+#define U128_STEP_MAX ((U128_MAX - 1) / 3)
+
+static void big_reserve(BigNum *b, size_t cap) {
+    if (cap <= b->cap) return;
+    size_t grown = b->cap ? 2 * b->cap : 4;
+    if (grown < cap) grown = cap;
+    b->limb = (uint64_t *)realloc(b->limb, grown * sizeof(uint64_t));
+    if (b->limb == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    b->cap = grown;
+}
+
+static void big_trim(BigNum *b) {
+    while (b->len > 0 && b->limb[b->len - 1] == 0) b->len--;
+}
+
+static void big_set_u128(BigNum *b, unsigned __int128 v) {
+    big_reserve(b, 2);
+    b->limb[0] = (uint64_t)v;
+    b->limb[1] = (uint64_t)(v >> 64);
+    b->len = 2;
+    big_trim(b);
+}
+
+// b = b * m + add.
+static void big_mul_add(BigNum *b, uint64_t m, uint64_t add) {
+    unsigned __int128 carry = add;
+    for (size_t i = 0; i < b->len; i++) {
+        carry += (unsigned __int128)b->limb[i] * m;
+        b->limb[i] = (uint64_t)carry;
+        carry >>= 64;
+    }
+    if (carry != 0) {
+        big_reserve(b, b->len + 1);
+        b->limb[b->len++] = (uint64_t)carry;
+    }
+}
+
+static void big_shr1(BigNum *b) {
+    for (size_t i = 0; i + 1 < b->len; i++) b->limb[i] = b->limb[i] >> 1 | b->limb[i + 1] << 63;
+    b->limb[b->len - 1] >>= 1;
+    big_trim(b);
+}
+
+// Parses a positive decimal number of any length.
+static int big_parse(const char *s, BigNum *b) {
+    b->len = 0;
+    if (*s == '\0') return 0;
+    for (; *s != '\0'; s++) {
+        if (*s < '0' || *s > '9') return 0;
+        big_mul_add(b, 10, (uint64_t)(*s - '0'));
+    }
+    big_trim(b);
+    return b->len > 0;
+}
+
+// Decimal form of b in a buffer owned by the caller, which is grown as needed.
+static const char *big_to_dec(const BigNum *b, char **buf, size_t *size) {
+    size_t need = 20 * b->len + 2;
+    if (need > *size) {
+        *buf = (char *)realloc(*buf, need);
+        *size = need;
+    }
+    uint64_t *tmp = (uint64_t *)malloc((b->len ? b->len : 1) * sizeof(uint64_t));
+    memcpy(tmp, b->limb, b->len * sizeof(uint64_t));
+    size_t len = b->len;
+    char *p = *buf + need;
+    *--p = '\0';
+    while (len > 0) {
+        // Peel off 19 decimal digits at a time.
+        unsigned __int128 rem = 0;
+        for (size_t i = len; i-- > 0;) {
+            unsigned __int128 cur = rem << 64 | tmp[i];
+            tmp[i] = (uint64_t)(cur / 10000000000000000000ull);
+            rem = cur % 10000000000000000000ull;
+        }
+        while (len > 0 && tmp[len - 1] == 0) len--;
+        uint64_t digits = (uint64_t)rem;
+        for (int d = 0; d < 19 && (len > 0 || digits != 0); d++) {
+            *--p = (char)('0' + digits % 10);
+            digits /= 10;
+        }
+    }
+    if (*p == '\0') *--p = '0';
+    free(tmp);
+    return p;
+}
+
+// Sequence output. Values are formatted straight into a large buffer that
+// goes out with write(2) when it fills up. Text is "a, b, c\n" as before,
+// with decimal conversion done by hand two digits at a time. The binary
+// format is the magic "CLZ1" followed by every value as an unsigned LEB128
+// varint (7 bits per byte, low bits first, high bit set on all but the last
+// byte), with a 0 byte after each sequence; 0 never occurs in a trajectory.
+#define OUT_BUFFER (1 << 20)
+#define BINARY_MAGIC "CLZ1"
+
+typedef enum { FORMAT_TEXT, FORMAT_BINARY, FORMAT_COUNT } OutFormat;
+
+static OutFormat out_format = FORMAT_TEXT;
+
+typedef struct {
+    int fd;
+    OutFormat format;
+    int first;
+    char *buf;
+    size_t len;
+    uint64_t written;
+    char *dec;
+    size_t dec_size;
+} SeqWriter;
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void out_flush(SeqWriter *w) {
+    size_t done = 0;
+    while (done < w->len) {
+        ssize_t r = write(w->fd, w->buf + done, w->len - done);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: write failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        done += (size_t)r;
+    }
+    w->written += w->len;
+    w->len = 0;
+}
+
+static void out_init(SeqWriter *w, int fd, OutFormat format) {
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->format = format;
+    w->first = 1;
+    w->buf = (char *)malloc(OUT_BUFFER);
+    if (w->buf == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (format == FORMAT_BINARY) {
+        memcpy(w->buf, BINARY_MAGIC, 4);
+        w->len = 4;
+    }
+}
+
+static void out_close(SeqWriter *w) {
+    out_flush(w);
+    free(w->buf);
+    free(w->dec);
+}
+
+// Room for n more bytes; n is at most OUT_BUFFER.
+static inline char *out_reserve(SeqWriter *w, size_t n) {
+    if (w->len + n > OUT_BUFFER) out_flush(w);
+    return w->buf + w->len;
+}
+
+static inline void out_separator(SeqWriter *w) {
+    if (!w->first) {
+        w->buf[w->len++] = ',';
+        w->buf[w->len++] = ' ';
+    }
+    w->first = 0;
+}
+
+static inline void out_u64(SeqWriter *w, uint64_t v) {
+    char *p = out_reserve(w, 22);
+    if (w->format == FORMAT_BINARY) {
+        size_t k = 0;
+        while (v >= 0x80) {
+            p[k++] = (char)(v | 0x80);
+            v >>= 7;
+        }
+        p[k++] = (char)v;
+        w->len += k;
+        return;
+    }
+    out_separator(w);
+    char tmp[20];
+    char *end = tmp + sizeof(tmp), *q = end;
+    while (v >= 100) {
+        q -= 2;
+        memcpy(q, digit_pairs + 2 * (v % 100), 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        q -= 2;
+        memcpy(q, digit_pairs + 2 * v, 2);
+    } else {
+        *--q = (char)('0' + v);
+    }
+    memcpy(w->buf + w->len, q, (size_t)(end - q));
+    w->len += (size_t)(end - q);
+}
+
+static void out_big(SeqWriter *w, const BigNum *b) {
+    if (w->format == FORMAT_BINARY) {
+        size_t bits = 64 * b->len - (size_t)__builtin_clzll(b->limb[b->len - 1]);
+        char *p = out_reserve(w, bits / 7 + 1);
+        for (size_t bit = 0; bit < bits; bit += 7) {
+            size_t i = bit / 64, s = bit % 64;
+            uint64_t v = b->limb[i] >> s;
+            if (s > 57 && i + 1 < b->len) v |= b->limb[i + 1] << (64 - s);
+            *p++ = (char)((v & 0x7f) | (bit + 7 < bits ? 0x80 : 0));
+        }
+        w->len += bits / 7 + (bits % 7 != 0);
+        return;
+    }
+    const char *dec = big_to_dec(b, &w->dec, &w->dec_size);
+    size_t len = strlen(dec);
+    out_reserve(w, len + 2);
+    out_separator(w);
+    memcpy(w->buf + w->len, dec, len);
+    w->len += len;
+}
+
+static void out_u128(SeqWriter *w, unsigned __int128 v) {
+    if (v >> 64 == 0) {
+        out_u64(w, (uint64_t)v);
+        return;
+    }
+    uint64_t limbs[2] = {(uint64_t)v, (uint64_t)(v >> 64)};
+    BigNum b = {limbs, 2, 2};
+    out_big(w, &b);
+}
+
+static inline void out_end(SeqWriter *w) {
+    char *p = out_reserve(w, 1);
+    *p = w->format == FORMAT_BINARY ? '\0' : '\n';
+    w->len++;
+    w->first = 1;
+}
+
+// Steps from the value in x until it drops below `below` (2 for the stopping
+// time); x holds the final value afterwards. With out set, every value after
+// the first is written to it.
+static uint64_t collatz_wide(BigNum *x, uint64_t below, SeqWriter *out, Promotions *p) {
+    uint64_t steps = 0;
+    uint64_t n = 0;
+    unsigned __int128 w = 0;
+    int tier = x->len <= 1 ? 0 : x->len == 2 ? 1 : 2;
+    if (tier == 0) n = x->len ? x->limb[0] : 0;
+    if (tier == 1) w = (unsigned __int128)x->limb[1] << 64 | x->limb[0];
+
+    for (;;) {
+        if (tier == 0) {
+            // The common case: a select instead of a branch on parity, with
+            // the overflow test taken only near the top of the range.
+            while (n >= below) {
+                uint64_t odd = n & 1;
+                if (__builtin_expect(n > U64_STEP_MAX, 0) && odd) break;
+                n = odd ? 3 * n + 1 : n >> 1;
+                steps++;
+                if (out != NULL) out_u64(out, n);
+            }
+            if (n < below) {
+                big_set_u128(x, n);
+                break;
+            }
+            p->to128++;
+            w = 3 * (unsigned __int128)n + 1;
+            steps++;
+            if (out != NULL) out_u128(out, w);
+            tier = 1;
+        } else if (tier == 1) {
+            while (w >> 64 != 0) {
+                if (w & 1) {
+                    if (w > U128_STEP_MAX) break;
+                    w = 3 * w + 1;
+                } else {
+                    w >>= 1;
+                }
+                steps++;
+                if (out != NULL) out_u128(out, w);
+            }
+            if (w >> 64 == 0) {
+                n = (uint64_t)w;
+                tier = 0;
+                continue;
+            }
+            p->to_big++;
+            big_set_u128(x, w);
+            big_mul_add(x, 3, 1);
+            steps++;
+            if (out != NULL) out_big(out, x);
+            tier = 2;
+        } else {
+            while (x->len > 2) {
+                if (x->limb[0] & 1) {
+                    big_mul_add(x, 3, 1);
+                } else {
+                    big_shr1(x);
+                }
+                steps++;
+                if (out != NULL) out_big(out, x);
+            }
+            w = (unsigned __int128)(x->len > 1 ? x->limb[1] : 0) << 64 | (x->len > 0 ? x->limb[0] : 0);
+            tier = 1;
+        }
+    }
+    return steps;
+}
+
+static int64_t steps_wide(uint64_t n, uint64_t below, RangeWorker *w) {
+    BigNum x = {NULL, 0, 0};
+    big_set_u128(&x, n);
+    uint64_t steps = collatz_wide(&x, below, NULL, &w->promotions);
+    free(x.limb);
+    w->promoted++;
+    return (int64_t)steps;
+}
+
+// Writes the trajectory of x as one sequence, or only counts it when out is
+// NULL. x is used up.
+static uint64_t sequence_write(SeqWriter *out, BigNum *x, Promotions *p) {
+    if (out == NULL) return collatz_wide(x, 2, NULL, p);
+    if (x->len == 1) {
+        out_u64(out, x->limb[0]);
+    } else {
+        out_big(out, x);
+    }
+    uint64_t steps = collatz_wide(x, 2, out, p);
+    out_end(out);
+    return steps;
+}
+
+typedef struct {
+    const char *name;
+    int64_t (*steps)(uint64_t n);
+    void (*chunk)(uint64_t lo, uint64_t hi, RangeWorker *w);
+    int (*supported)(void);
+} CollatzKernel;
+
+static const CollatzKernel *kernel;
+
+static void chunk_scalar(uint64_t lo, uint64_t hi, RangeWorker *w) {
+    for (uint64_t n = lo;; n++) {
+        int64_t steps = kernel->steps(n);
+        if (steps < 0) steps = steps_wide(n, 2, w);
+        range_add(&w->stats, n, (uint32_t)steps);
+        if (n == hi) break;
+    }
+}
+
+static int always_supported(void) {
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static int avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+// Jump kernel with four consecutive starts per vector, one in each 64-bit
+// lane. A batch runs until every lane is below 2^k; finished lanes are kept
+// as they are by blending. AVX2 has no 64x64 multiply, so a * 3^c is put
+// together from the 32-bit halves of a; if any product or sum would carry
+// out of its lane the batch is redone with the scalar kernel. Lanes only
+// store into the memo table; the 2^k table does the job of the lookups.
+__attribute__((target("avx2")))
+static void chunk_avx2(uint64_t lo, uint64_t hi, RangeWorker *w) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i mask = _mm256_set1_epi64x((long long)(jump_size - 1));
+    const __m256i bits = _mm256_set1_epi64x(jump_bits);
+    const __m256i small = _mm256_xor_si256(_mm256_set1_epi64x((long long)jump_size), sign);
+    const __m128i byte = _mm_set1_epi32(0xff);
+    const __m256i low32 = _mm256_set1_epi64x(0xffffffffll);
+    const __m128i shift = _mm_cvtsi32_si128(jump_bits);
+    uint64_t lane_n[4];
+    int64_t lane_steps[4];
+
+    uint64_t first = lo;
+    while (hi - first >= 3) {
+        __m256i n = _mm256_add_epi64(_mm256_set1_epi64x((long long)first), _mm256_set_epi64x(3, 2, 1, 0));
+        __m256i steps = _mm256_setzero_si256();
+        int overflow = 0;
+        for (;;) {
+            __m256i active = _mm256_andnot_si256(_mm256_cmpgt_epi64(small, _mm256_xor_si256(n, sign)),
+                                                 _mm256_set1_epi64x(-1));
+            if (_mm256_testz_si256(active, active)) break;
+            __m256i b = _mm256_and_si256(n, mask);
+            __m256i a = _mm256_srl_epi64(n, shift);
+            __m128i c = _mm_and_si128(_mm256_i64gather_epi32((const int *)(const void *)jump_odd, b, 1), byte);
+            __m256i pd = _mm256_i64gather_epi64((const long long *)(const void *)jump_pair, b, 8);
+            __m256i p = _mm256_srli_epi64(pd, 32);
+            __m256i d = _mm256_and_si256(pd, low32);
+            __m256i lo_part = _mm256_mul_epu32(a, p);
+            __m256i hi_part = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), p);
+            __m256i t = _mm256_add_epi64(lo_part, _mm256_slli_epi64(hi_part, 32));
+            __m256i r = _mm256_add_epi64(t, d);
+            __m256i bad = _mm256_srli_epi64(hi_part, 32);
+            bad = _mm256_or_si256(bad, _mm256_cmpgt_epi64(_mm256_xor_si256(lo_part, sign), _mm256_xor_si256(t, sign)));
+            bad = _mm256_or_si256(bad, _mm256_cmpgt_epi64(_mm256_xor_si256(t, sign), _mm256_xor_si256(r, sign)));
+            if (!_mm256_testz_si256(bad, bad)) {
+                overflow = 1;
+                break;
+            }
+            n = _mm256_blendv_epi8(n, r, active);
+            steps = _mm256_add_epi64(steps, _mm256_and_si256(active, _mm256_add_epi64(bits, _mm256_cvtepu32_epi64(c))));
+        }
+        _mm256_storeu_si256((__m256i *)lane_n, n);
+        _mm256_storeu_si256((__m256i *)lane_steps, steps);
+        for (int i = 0; i < 4; i++) {
+            uint64_t start = first + (uint64_t)i;
+            int64_t total = overflow ? steps_jump(start) : lane_steps[i] + small_steps[lane_n[i]];
+            if (total < 0) total = steps_wide(start, 2, w);
+            if (!overflow) memo_store(start, total);
+            range_add(&w->stats, start, (uint32_t)total);
+        }
+        if (hi - first == 3) return;
+        first += 4;
+    }
+    chunk_scalar(first, hi, w);
+}
+#endif
+
+static const CollatzKernel kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", steps_jump, chunk_avx2, avx2_supported},
+#endif
+    {"jump", steps_jump, chunk_scalar, always_supported},
+    {"ctz", steps_ctz, chunk_scalar, always_supported},
+    {"naive", steps_naive, chunk_scalar, always_supported},
+};
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static const CollatzKernel *kernel_find(const char *name) {
+    for (size_t i = 0; i < KERNEL_COUNT; i++) {
+        if (strcmp(kernels[i].name, name) == 0) return &kernels[i];
+    }
+    return NULL;
+}
+
+// Glide records (--records): n is a record if its glide is longer than that
+// of every smaller n >= 2. A chunk keeps every n that beats the best glide
+// seen earlier in the same chunk; that is a superset of the records in it,
+// and the lists are merged in order at the end. Sieved residues are skipped
+// once the chunk has already seen a glide at least as long as their bound.
+static int records_sieve = 1;
+
+static void records_chunk(uint64_t lo, uint64_t hi, RangeWorker *w) {
+    uint32_t best = 0;
+    for (uint64_t n = lo < 2 ? 2 : lo; n <= hi; n++) {
+        if (records_sieve && n >= sieve_min) {
+            uint8_t bound = sieve_bound[n & (jump_size - 1)];
+            if (bound != 0 && best >= bound) {
+                w->sieved++;
+                if (n == hi) break;
+                continue;
+            }
+        }
+        int64_t g = glide(n);
+        if (g < 0) g = steps_wide(n, n, w);
+        w->stats.count++;
+        if ((uint32_t)g > best) {
+            best = (uint32_t)g;
+            if (w->nrecords == w->records_cap) {
+                w->records_cap = w->records_cap ? 2 * w->records_cap : 64;
+                w->records = (Record *)realloc(w->records, w->records_cap * sizeof(Record));
+                if (w->records == NULL) {
+                    fprintf(stderr, "Error: out of memory.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            w->records[w->nrecords].n = n;
+            w->records[w->nrecords].glide = best;
+            w->nrecords++;
+        }
+        if (n == hi) break;
+    }
+}
+
+static int records_mode = 0;
+
+static void *range_thread(void *arg) {
+    RangeWorker *w = (RangeWorker *)arg;
+    for (;;) {
+        uint64_t lo = atomic_fetch_add(range_next, RANGE_CHUNK);
+        if (lo > range_end || lo < range_start) break;
+        uint64_t hi = range_end - lo < RANGE_CHUNK - 1 ? range_end : lo + RANGE_CHUNK - 1;
+        if (records_mode) {
+            records_chunk(lo, hi, w);
+        } else {
+            kernel->chunk(lo, hi, w);
+        }
+    }
+    return NULL;
+}
+
+static int parse_u64(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || s[0] == '-') return 0;
+    *out = v;
+    return 1;
+}
+
+static int parse_range(const char *s, uint64_t *start, uint64_t *end) {
+    const char *colon = strchr(s, ':');
+    if (colon == NULL) return 0;
+    char first[32];
+    size_t len = (size_t)(colon - s);
+    if (len == 0 || len >= sizeof(first)) return 0;
+    memcpy(first, s, len);
+    first[len] = '\0';
+    return parse_u64(first, start) && parse_u64(colon + 1, end) && *start >= 1 && *start <= *end;
+}
+
+static int cpu_count(void) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void promotions_print(const RangeWorker *total) {
+    if (total->promoted == 0) return;
+    printf("%llu starts left 64 bits: %llu promotions to 128 bits, %llu to bignum\n",
+           (unsigned long long)total->promoted, (unsigned long long)total->promotions.to128,
+           (unsigned long long)total->promotions.to_big);
+}
+
+static void throughput_print(double secs, uint64_t numbers) {
+    fprintf(stderr, "%.3f s, %.0f numbers/s, %d %s", secs, secs > 0 ? (double)numbers / secs : 0.0,
+            num_procs ? num_procs : num_threads, num_procs ? "processes" : "threads");
+    if (!records_mode) fprintf(stderr, ", %s kernel", kernel->name);
+    fprintf(stderr, "\n");
+}
+
+static void range_print(const RangeWorker *total, double secs) {
+    const RangeStats *s = &total->stats;
+    printf("range %llu..%llu: %llu numbers, %llu total steps\n",
+           (unsigned long long)range_start, (unsigned long long)range_end,
+           (unsigned long long)s->count, (unsigned long long)s->total_steps);
+    printf("max stopping time %u at n = %llu\n", s->max_steps, (unsigned long long)s->max_n);
+    printf("histogram (stopping time: numbers):\n");
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (s->hist[b] == 0) continue;
+        if (b == HIST_BUCKETS - 1) {
+            printf("  %5d+     : %llu\n", b * HIST_WIDTH, (unsigned long long)s->hist[b]);
+        } else {
+            printf("  %5d-%-5d: %llu\n", b * HIST_WIDTH, (b + 1) * HIST_WIDTH - 1, (unsigned long long)s->hist[b]);
+        }
+    }
+    promotions_print(total);
+    throughput_print(secs, s->count);
+}
+
+static double range_run(RangeWorker *workers) {
+    atomic_store(range_next, range_start);
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+    double start = now_seconds();
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&tids[i], NULL, range_thread, &workers[i]) != 0) {
+            fprintf(stderr, "Error: pthread_create() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    return now_seconds() - start;
+}
+
+static int record_cmp(const void *a, const void *b) {
+    uint64_t x = ((const Record *)a)->n, y = ((const Record *)b)->n;
+    return x < y ? -1 : x > y;
+}
+
+// Merges the per-chunk candidates of all workers into the record list.
+static Record *records_merge(RangeWorker *workers, int count, size_t *out) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) total += workers[i].nrecords;
+    Record *all = (Record *)malloc((total ? total : 1) * sizeof(Record));
+    size_t k = 0;
+    for (int i = 0; i < count; i++) {
+        if (workers[i].nrecords == 0) continue;
+        memcpy(all + k, workers[i].records, workers[i].nrecords * sizeof(Record));
+        k += workers[i].nrecords;
+    }
+    qsort(all, total, sizeof(Record), record_cmp);
+    size_t kept = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (kept == 0 || all[i].glide > all[kept - 1].glide) all[kept++] = all[i];
+    }
+    *out = kept;
+    return all;
+}
+
+// Forked pool (--procs=N): the chunk loop runs in N child processes instead
+// of threads. The work counter, the memo table and one result slot per child
+// are MAP_SHARED anonymous mappings made before fork(), so all children use
+// the same memory. A child leaves its totals and its record candidates in its
+// slot and exits; the parent reduces the slots once it has reaped everyone.
+#define PROC_RECORDS_MAX 4096
+
+typedef struct {
+    RangeWorker worker;
+    int done;
+    size_t nrecords;
+    Record records[PROC_RECORDS_MAX];
+} ProcSlot;
+
+static void proc_worker(ProcSlot *slot) {
+    RangeWorker w;
+    memset(&w, 0, sizeof(w));
+    range_thread(&w);
+    size_t count;
+    Record *records = records_merge(&w, 1, &count);
+    if (count > PROC_RECORDS_MAX) {
+        fprintf(stderr, "Error: more than %d record candidates in one process.\n", PROC_RECORDS_MAX);
+        _exit(EXIT_FAILURE);
+    }
+    memcpy(slot->records, records, count * sizeof(Record));
+    slot->nrecords = count;
+    slot->worker = w;
+    slot->worker.records = NULL;
+    slot->worker.nrecords = slot->worker.records_cap = 0;
+    slot->done = 1;
+    _exit(EXIT_SUCCESS);
+}
+
+static double range_run_procs(RangeWorker *workers) {
+    size_t size = 64 + sizeof(ProcSlot) * (size_t)num_procs;
+    char *shared = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map the shared results: %s\n", strerror(errno));
+        return -1.0;
+    }
+    range_next = (atomic_uint_fast64_t *)(void *)shared;
+    atomic_store(range_next, range_start);
+    ProcSlot *slots = (ProcSlot *)(void *)(shared + 64);
+    pid_t *pids = (pid_t *)malloc(sizeof(pid_t) * num_procs);
+
+    fflush(stdout);
+    fflush(stderr);
+    double start = now_seconds();
+    for (int i = 0; i < num_procs; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            fprintf(stderr, "Error: fork() failed\n");
+            exit(EXIT_FAILURE);
+        } else if (pids[i] == 0) {
+            proc_worker(&slots[i]);
+        }
+    }
+    int ok = 1;
+    for (int i = 0; i < num_procs; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS ||
+            !slots[i].done) {
+            fprintf(stderr, "Error: worker process %d failed.\n", (int)pids[i]);
+            ok = 0;
+        }
+    }
+    double secs = now_seconds() - start;
+
+    for (int i = 0; i < num_procs && ok; i++) {
+        workers[i] = slots[i].worker;
+        workers[i].nrecords = workers[i].records_cap = slots[i].nrecords;
+        workers[i].records = (Record *)malloc((slots[i].nrecords ? slots[i].nrecords : 1) * sizeof(Record));
+        memcpy(workers[i].records, slots[i].records, slots[i].nrecords * sizeof(Record));
+    }
+    free(pids);
+    munmap(shared, size);
+    range_next = &range_next_local;
+    return ok ? secs : -1.0;
+}
+
+static void records_print(RangeWorker *workers, int count, const RangeWorker *total, double secs) {
+    size_t nrecords;
+    Record *records = records_merge(workers, count, &nrecords);
+    printf("glide records in %llu..%llu:\n", (unsigned long long)range_start, (unsigned long long)range_end);
+    for (size_t i = 0; i < nrecords; i++) {
+        printf("  %llu: %u\n", (unsigned long long)records[i].n, records[i].glide);
+    }
+    printf("%llu numbers tested, %llu skipped by the mod 2^%d sieve\n",
+           (unsigned long long)total->stats.count, (unsigned long long)total->sieved, jump_bits);
+    promotions_print(total);
+    throughput_print(secs, total->stats.count + total->sieved);
+    free(records);
+}
+
+// --dump: the trajectory of every start in the range, in order, from one
+// thread. With --format=count the trajectories are walked but not written,
+// which separates the cost of the walk from the cost of the output.
+static int dump_main(void) {
+    SeqWriter out;
+    out_init(&out, STDOUT_FILENO, out_format);
+    SeqWriter *sink = out_format == FORMAT_COUNT ? NULL : &out;
+    Promotions promotions = {0, 0};
+    BigNum x = {NULL, 0, 0};
+    uint64_t steps = 0, count = 0;
+    double start = now_seconds();
+    for (uint64_t n = range_start;; n++) {
+        big_set_u128(&x, n);
+        steps += sequence_write(sink, &x, &promotions);
+        count++;
+        if (n == range_end) break;
+    }
+    out_flush(&out);
+    double secs = now_seconds() - start;
+    if (sink == NULL) {
+        printf("range %llu..%llu: %llu numbers, %llu total steps\n", (unsigned long long)range_start,
+               (unsigned long long)range_end, (unsigned long long)count, (unsigned long long)steps);
+    }
+    fprintf(stderr, "%.3f s, %llu values, %.0f values/s, %llu bytes written\n", secs,
+            (unsigned long long)(steps + count), secs > 0 ? (double)(steps + count) / secs : 0.0,
+            (unsigned long long)out.written);
+    if (promotions.to128 != 0 || promotions.to_big != 0) {
+        fprintf(stderr, "promotions: %llu to 128 bits, %llu to bignum\n", (unsigned long long)promotions.to128,
+                (unsigned long long)promotions.to_big);
+    }
+    out_close(&out);
+    free(x.limb);
+    return EXIT_SUCCESS;
+}
+
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t pos, len;
+} ByteReader;
+
+static int read_byte(ByteReader *r) {
+    if (r->pos == r->len) {
+        ssize_t n;
+        do {
+            n = read(r->fd, r->buf, OUT_BUFFER);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            fprintf(stderr, "Error: read failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) return -1;
+        r->pos = 0;
+        r->len = (size_t)n;
+    }
+    return r->buf[r->pos++];
+}
+
+static void big_or_bits(BigNum *b, uint64_t bits, size_t shift) {
+    size_t i = shift / 64, s = shift % 64;
+    big_reserve(b, i + 2);
+    while (b->len < i + 2) b->limb[b->len++] = 0;
+    b->limb[i] |= bits << s;
+    if (s > 57) b->limb[i + 1] |= bits >> (64 - s);
+}
+
+// --decode: the binary format on stdin back to text on stdout. Varints of up
+// to 64 bits are assembled in a register, longer ones in a bignum.
+static int decode_main(void) {
+    ByteReader in = {STDIN_FILENO, (unsigned char *)malloc(OUT_BUFFER), 0, 0};
+    SeqWriter out;
+    out_init(&out, STDOUT_FILENO, FORMAT_TEXT);
+    BigNum big = {NULL, 0, 0};
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < 4; i++) {
+        if (read_byte(&in) != BINARY_MAGIC[i]) {
+            fprintf(stderr, "Error: input is not a binary Collatz stream.\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    int open = 0, c;
+    while (status == EXIT_SUCCESS && (c = read_byte(&in)) >= 0) {
+        uint64_t v = 0;
+        size_t shift = 0;
+        int wide = 0;
+        for (;;) {
+            uint64_t bits = (uint64_t)(c & 0x7f);
+            if (!wide && shift <= 57) {
+                v |= bits << shift;
+            } else {
+                if (!wide) big_set_u128(&big, v);
+                wide = 1;
+                big_or_bits(&big, bits, shift);
+            }
+            if ((c & 0x80) == 0) break;
+            shift += 7;
+            if ((c = read_byte(&in)) < 0) break;
+        }
+        if (c < 0) {
+            open = 1;
+            break;
+        }
+        if (wide) big_trim(&big);
+        if (wide ? big.len == 0 : v == 0) {
+            out_end(&out);
+            open = 0;
+        } else {
+            if (wide) {
+                out_big(&out, &big);
+            } else {
+                out_u64(&out, v);
+            }
+            open = 1;
+        }
+    }
+    if (status == EXIT_SUCCESS && open) {
+        fprintf(stderr, "Error: binary stream ends in the middle of a sequence.\n");
+        status = EXIT_FAILURE;
+    }
+    out_close(&out);
+    free(in.buf);
+    free(big.limb);
+    return status;
+}
+
+// The memo table is a shared mapping so that the forked pool can use it too.
+static int memo_alloc(uint64_t size) {
+    memo_size = size;
+    void *p = mmap(NULL, (size ? size : 1) * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memo = p == MAP_FAILED ? NULL : (_Atomic uint16_t *)p;
+    return memo != NULL;
+}
+
+static void memo_free(void) {
+    munmap((void *)memo, (memo_size ? memo_size : 1) * sizeof(uint16_t));
+    memo = NULL;
+}
+
+// Sums the per-worker results into *total; records are left in the workers.
+static void range_reduce(const RangeWorker *workers, int count, RangeWorker *total) {
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < count; i++) {
+        const RangeStats *s = &workers[i].stats;
+        total->promoted += workers[i].promoted;
+        total->promotions.to128 += workers[i].promotions.to128;
+        total->promotions.to_big += workers[i].promotions.to_big;
+        total->sieved += workers[i].sieved;
+        if (s->count == 0) continue;
+        if (total->stats.count == 0 || s->max_steps > total->stats.max_steps ||
+            (s->max_steps == total->stats.max_steps && s->max_n < total->stats.max_n)) {
+            total->stats.max_steps = s->max_steps;
+            total->stats.max_n = s->max_n;
+        }
+        total->stats.count += s->count;
+        total->stats.total_steps += s->total_steps;
+        for (int b = 0; b < HIST_BUCKETS; b++) total->stats.hist[b] += s->hist[b];
+    }
+}
+
+static int range_main(void) {
+    if (!memo_alloc(memo_size)) {
+        fprintf(stderr, "Error: cannot allocate the memo table.\n");
+        return EXIT_FAILURE;
+    }
+
+    int count = num_procs ? num_procs : num_threads;
+    RangeWorker *workers = (RangeWorker *)aligned_alloc(64, sizeof(RangeWorker) * count);
+    memset(workers, 0, sizeof(RangeWorker) * count);
+    double secs = num_procs ? range_run_procs(workers) : range_run(workers);
+    if (secs < 0) {
+        free(workers);
+        memo_free();
+        return EXIT_FAILURE;
+    }
+
+    RangeWorker total;
+    range_reduce(workers, count, &total);
+    if (records_mode) {
+        records_print(workers, count, &total, secs);
+    } else {
+        range_print(&total, secs);
+    }
+
+    for (int i = 0; i < count; i++) free(workers[i].records);
+    free(workers);
+    memo_free();
+    return EXIT_SUCCESS;
+}
+
+static void kernel_stats(const CollatzKernel *k, uint64_t lo, uint64_t hi, RangeStats *out) {
+    RangeWorker w;
+    memset(&w, 0, sizeof(w));
+    kernel = k;
+    for (uint64_t n = lo;; n += RANGE_CHUNK) {
+        uint64_t end = hi - n < RANGE_CHUNK - 1 ? hi : n + RANGE_CHUNK - 1;
+        k->chunk(n, end, &w);
+        if (end == hi) break;
+    }
+    *out = w.stats;
+}
+
+// Plain bignum walk to 1, as the reference for the tiers of collatz_wide().
+static uint64_t steps_big_ref(BigNum *x) {
+    uint64_t steps = 0;
+    while (x->len > 1 || x->limb[0] != 1) {
+        if (x->limb[0] & 1) {
+            big_mul_add(x, 3, 1);
+        } else {
+            big_shr1(x);
+        }
+        steps++;
+    }
+    return steps;
+}
+
+static int wide_selftest(const uint64_t *bases, int count) {
+    int bad = 0;
+    BigNum x = {NULL, 0, 0}, y = {NULL, 0, 0};
+    Promotions p = {0, 0};
+    for (uint64_t n = 1; n <= 1u << 16 && !bad; n++) {
+        big_set_u128(&x, n);
+        bad = collatz_wide(&x, 2, NULL, &p) != (uint64_t)steps_naive(n);
+    }
+    // n * 2^j takes exactly j more steps than n, starting in any tier.
+    static const unsigned shifts[] = {60, 64, 100, 130, 300};
+    for (int i = 0; i < count && !bad; i++) {
+        for (size_t j = 0; j < sizeof(shifts) / sizeof(shifts[0]) && !bad; j++) {
+            big_set_u128(&x, bases[i]);
+            for (unsigned k = 0; k < shifts[j]; k++) big_mul_add(&x, 2, 0);
+            bad = collatz_wide(&x, 2, NULL, &p) != (uint64_t)steps_naive(bases[i]) + shifts[j];
+        }
+    }
+    // Starts whose trajectories leave 64 and 128 bits.
+    static const char *starts[] = {"1000004829031", "170141183460469231731687303715884105727",
+                                   "295147905179352825857", "515377520732011331036461129765621272702107522001"};
+    uint64_t before = p.to128, before_big = p.to_big;
+    for (size_t i = 0; i < sizeof(starts) / sizeof(starts[0]) && !bad; i++) {
+        big_parse(starts[i], &x);
+        big_parse(starts[i], &y);
+        uint64_t got = collatz_wide(&x, 2, NULL, &p);
+        uint64_t want = steps_big_ref(&y);
+        if (got != want) {
+            fprintf(stderr, "wide: %s: %llu steps, expected %llu\n", starts[i], (unsigned long long)got,
+                    (unsigned long long)want);
+            bad = 1;
+        }
+    }
+    bad |= p.to128 == before || p.to_big == before_big;
+    free(x.limb);
+    free(y.limb);
+    printf("wide: %s\n", bad ? "FAILED" : "OK");
+    return bad;
+}
+
+// Checks every kernel against the naive loop, with and without the memo
+// table, the wide path against plain bignum arithmetic, and the sieved record
+// search against an unsieved one.
+static int collatz_selftest(void) {
+    const uint64_t limit = 1u << 20;
+    const CollatzKernel *naive = kernel_find("naive");
+    uint64_t bases[64];
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    for (int i = 0; i < 64; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        bases[i] = (seed & ((1ull << 40) - 1)) | 1;
+    }
+    // Its trajectory leaves 64 bits.
+    bases[63] = 1000004829031ull - RANGE_CHUNK;
+
+    int failures = 0;
+    for (size_t i = 0; i < KERNEL_COUNT; i++) {
+        const CollatzKernel *k = &kernels[i];
+        if (!k->supported()) {
+            printf("%s: not supported by this CPU\n", k->name);
+            continue;
+        }
+        int bad = 0;
+        memo_size = 0;
+        for (uint64_t n = 1; n <= limit && !bad; n++) {
+            if (k->steps(n) != steps_naive(n)) {
+                fprintf(stderr, "%s: n = %llu: %lld steps, expected %lld\n", k->name, (unsigned long long)n,
+                        (long long)k->steps(n), (long long)steps_naive(n));
+                bad = 1;
+            }
+        }
+        for (int b = 0; b < 64 && !bad; b++) {
+            RangeStats got, want;
+            kernel_stats(k, bases[b], bases[b] + 3 * RANGE_CHUNK, &got);
+            kernel_stats(naive, bases[b], bases[b] + 3 * RANGE_CHUNK, &want);
+            if (memcmp(&got, &want, sizeof(got)) != 0) {
+                fprintf(stderr, "%s: statistics differ from %llu\n", k->name, (unsigned long long)bases[b]);
+                bad = 1;
+            }
+        }
+        RangeStats want;
+        kernel_stats(naive, 1, limit, &want);
+        for (uint64_t size = 0; size <= limit && !bad; size += limit) {
+            RangeStats got;
+            memo_alloc(size);
+            kernel_stats(k, 1, limit, &got);
+            if (memcmp(&got, &want, sizeof(got)) != 0) {
+                fprintf(stderr, "%s: statistics for 1..%llu differ (memo %llu)\n", k->name,
+                        (unsigned long long)limit, (unsigned long long)size);
+                bad = 1;
+            }
+            memo_free();
+        }
+        memo_size = 0;
+        printf("%s: %s\n", k->name, bad ? "FAILED" : "OK");
+        failures += bad;
+    }
+
+    failures += wide_selftest(bases, 16);
+
+    RangeWorker runs[2];
+    Record *lists[2];
+    size_t counts[2];
+    memset(runs, 0, sizeof(runs));
+    for (int s = 0; s < 2; s++) {
+        records_sieve = s;
+        for (uint64_t n = 1; n <= 4 * limit; n += RANGE_CHUNK) records_chunk(n, n + RANGE_CHUNK - 1, &runs[s]);
+        lists[s] = records_merge(&runs[s], 1, &counts[s]);
+    }
+    int bad = counts[0] != counts[1] || memcmp(lists[0], lists[1], counts[0] * sizeof(Record)) != 0 ||
+              runs[1].sieved == 0;
+    printf("records sieve: %s\n", bad ? "FAILED" : "OK");
+    failures += bad;
+    for (int s = 0; s < 2; s++) {
+        free(lists[s]);
+        free(runs[s].records);
+    }
+    records_sieve = 1;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Benchmark (--bench[=kernels|models]). The kernel part times every kernel,
+// and the 64-bit tier of the wide path, with the memo table off on fixed
+// windows of starts; the wide path is also timed on starts above 2^68, where
+// it runs in 128 bits and bignums. The model part runs the range (default
+// 1..10^8) with the jump kernel in one thread, in 1..N threads and in a
+// forked pool of 1..N processes, and times today's one-fork-per-number model
+// and a bare fork/exit/wait on a sample. Results go to stdout as JSON.
+#define BENCH_FORK_SAMPLE 2000
+
+typedef struct {
+    const char *name;
+    uint64_t lo, hi;
+} BenchWindow;
+
+static const BenchWindow bench_windows[] = {
+    {"1..2^20", 1, 1u << 20},
+    {"2^40..2^40+2^18", 1ull << 40, (1ull << 40) + (1u << 18)},
+};
+#define BENCH_WINDOW_COUNT (sizeof(bench_windows) / sizeof(bench_windows[0]))
+
+static void bench_kernel_result(int *first, const char *name, const char *window, uint64_t numbers,
+                                uint64_t steps, double secs) {
+    printf("%s\n    {\"kernel\": \"%s\", \"window\": \"%s\", \"numbers\": %llu, \"steps\": %llu, "
+           "\"seconds\": %.4f, \"steps_per_s\": %.0f}",
+           *first ? "" : ",", name, window, (unsigned long long)numbers, (unsigned long long)steps, secs,
+           secs > 0 ? (double)steps / secs : 0.0);
+    fflush(stdout);
+    *first = 0;
+}
+
+static void bench_wide(int *first, const char *window, unsigned __int128 lo, uint64_t count) {
+    fprintf(stderr, "bench: wide path on %s\n", window);
+    BigNum x = {NULL, 0, 0};
+    Promotions p = {0, 0};
+    uint64_t steps = 0;
+    double start = now_seconds();
+    for (uint64_t i = 0; i < count; i++) {
+        big_set_u128(&x, lo + i);
+        steps += collatz_wide(&x, 2, NULL, &p);
+    }
+    bench_kernel_result(first, "wide", window, count, steps, now_seconds() - start);
+    free(x.limb);
+}
+
+static void bench_kernels(void) {
+    int first = 1;
+    printf("  \"kernels\": [");
+    memo_size = 0;
+    for (size_t w = 0; w < BENCH_WINDOW_COUNT; w++) {
+        const BenchWindow *win = &bench_windows[w];
+        for (size_t i = 0; i < KERNEL_COUNT; i++) {
+            if (!kernels[i].supported()) continue;
+            fprintf(stderr, "bench: %s kernel on %s\n", kernels[i].name, win->name);
+            RangeStats s;
+            double start = now_seconds();
+            kernel_stats(&kernels[i], win->lo, win->hi, &s);
+            bench_kernel_result(&first, kernels[i].name, win->name, s.count, s.total_steps, now_seconds() - start);
+        }
+        bench_wide(&first, win->name, win->lo, win->hi - win->lo + 1);
+    }
+    bench_wide(&first, "2^68..2^68+2^14", (unsigned __int128)1 << 68, 1u << 14);
+    printf("\n  ]");
+}
+
+static double bench_range(int threads, int procs, uint64_t memo_entries, RangeWorker *total) {
+    num_threads = threads;
+    num_procs = procs;
+    if (!memo_alloc(memo_entries)) return -1.0;
+    int count = procs ? procs : threads;
+    RangeWorker *workers = (RangeWorker *)aligned_alloc(64, sizeof(RangeWorker) * count);
+    memset(workers, 0, sizeof(RangeWorker) * count);
+    double secs = procs ? range_run_procs(workers) : range_run(workers);
+    range_reduce(workers, count, total);
+    for (int i = 0; i < count; i++) free(workers[i].records);
+    free(workers);
+    memo_free();
+    return secs;
+}
+
+// One child per number that walks it and exits, with the parent waiting for
+// each before starting the next. With walk unset the child exits at once,
+// which leaves the bare cost of fork, exit and wait.
+static double bench_fork_each(uint64_t lo, uint64_t count, int walk) {
+    double start = now_seconds();
+    for (uint64_t n = lo; n < lo + count; n++) {
+        pid_t pid = fork();
+        if (pid < 0) return -1.0;
+        if (pid == 0) _exit(walk && kernel->steps(n) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        int status;
+        if (waitpid(pid, &status, 0) < 0) return -1.0;
+    }
+    return now_seconds() - start;
+}
+
+// Speedup is relative to base, the single-thread rate in numbers per second.
+static void bench_model_result(int *first, const char *model, int workers, uint64_t numbers, uint64_t steps,
+                               double secs, double base) {
+    double rate = secs > 0 ? (double)numbers / secs : 0.0;
+    printf("%s\n    {\"model\": \"%s\", \"workers\": %d, \"numbers\": %llu, \"steps\": %llu, \"seconds\": %.4f, "
+           "\"numbers_per_s\": %.0f, \"steps_per_s\": %.0f, \"speedup\": %.4g}",
+           *first ? "" : ",", model, workers, (unsigned long long)numbers, (unsigned long long)steps, secs, rate,
+           secs > 0 ? (double)steps / secs : 0.0, base > 0 ? rate / base : 0.0);
+    fflush(stdout);
+    *first = 0;
+}
+
+static void bench_models(int max_workers, uint64_t memo_entries) {
+    RangeWorker total;
+    fprintf(stderr, "bench: single thread on %llu..%llu\n", (unsigned long long)range_start,
+            (unsigned long long)range_end);
+    double single = bench_range(1, 0, memo_entries, &total);
+    double base = single > 0 ? (double)total.stats.count / single : 0.0;
+    int first = 1;
+    printf("  \"models\": [");
+    bench_model_result(&first, "single", 1, total.stats.count, total.stats.total_steps, single, base);
+
+    for (int procs = 0; procs < 2; procs++) {
+        for (int n = procs ? 1 : 2;; n = n * 2 < max_workers ? n * 2 : max_workers) {
+            if (n > max_workers) break;
+            fprintf(stderr, "bench: %d %s\n", n, procs ? "processes" : "threads");
+            double secs = bench_range(procs ? 1 : n, procs ? n : 0, memo_entries, &total);
+            bench_model_result(&first, procs ? "procs" : "threads", n, total.stats.count, total.stats.total_steps, secs,
+                               base);
+            if (n == max_workers) break;
+        }
+    }
+    num_procs = 0;
+
+    fprintf(stderr, "bench: fork per number on %d starts\n", BENCH_FORK_SAMPLE);
+    memo_size = 0;
+    RangeStats sample;
+    kernel_stats(kernel, range_start, range_start + BENCH_FORK_SAMPLE - 1, &sample);
+    double each = bench_fork_each(range_start, BENCH_FORK_SAMPLE, 1);
+    bench_model_result(&first, "fork-per-request", 1, BENCH_FORK_SAMPLE, sample.total_steps, each, base);
+    double bare = bench_fork_each(range_start, BENCH_FORK_SAMPLE, 0);
+    printf("\n  ],\n  \"fork_wait_us\": %.2f", bare > 0 ? bare / BENCH_FORK_SAMPLE * 1e6 : 0.0);
+}
+
+static int bench_main(const char *what, int have_range) {
+    int do_kernels = strcmp(what, "all") == 0 || strcmp(what, "kernels") == 0;
+    int do_models = strcmp(what, "all") == 0 || strcmp(what, "models") == 0;
+    if (!do_kernels && !do_models) {
+        fprintf(stderr, "Error: unknown benchmark: %s\n", what);
+        return EXIT_FAILURE;
+    }
+    if (!have_range) {
+        range_start = 1;
+        range_end = 100000000;
+    }
+    if (range_end - range_start + 1 < BENCH_FORK_SAMPLE) range_end = range_start + BENCH_FORK_SAMPLE - 1;
+    int max_workers = num_threads ? num_threads : num_procs ? num_procs : cpu_count();
+    uint64_t memo_entries = memo_size;
+
+    printf("{\n  \"range\": \"%llu..%llu\",\n  \"cpus\": %d,\n  \"kernel\": \"%s\",\n  \"jump_bits\": %d",
+           (unsigned long long)range_start, (unsigned long long)range_end, cpu_count(), kernel->name, jump_bits);
+    const CollatzKernel *chosen = kernel;
+    if (do_kernels) {
+        printf(",\n");
+        bench_kernels();
+        kernel = chosen;
+    }
+    if (do_models) {
+        printf(",\n");
+        bench_models(max_workers, memo_entries);
+    }
+    printf("\n}\n");
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <positive_integer>   (any number of digits)\n", prog);
+    fprintf(stderr, "       %s --range=START:END [--threads=N | --procs=N] [--memo=N] [--kernel=NAME] [--jump=K]\n"
+                    "           [--records]\n", prog);
+    fprintf(stderr, "       %s [--format=text|binary|count] <positive_integer>\n", prog);
+    fprintf(stderr, "       %s --range=START:END --dump [--format=text|binary|count]\n", prog);
+    fprintf(stderr, "       %s --decode < sequences.bin\n", prog);
+    fprintf(stderr, "       %s --selftest [--jump=K]\n", prog);
+    fprintf(stderr, "       %s --bench[=kernels|models] [--range=START:END] [--threads=N] > bench.json\n", prog);
+    fprintf(stderr, "  --range=START:END  stopping-time statistics for every n in START..END\n");
+    fprintf(stderr, "  --threads=N        worker threads (default: CPUs in the affinity mask)\n");
+    fprintf(stderr, "  --procs=N          fork N worker processes that share results through mmap instead\n");
+    fprintf(stderr, "  --memo=N           cache stopping times of starts below N (default: 4194304)\n");
+    fprintf(stderr, "  --kernel=NAME      jump, avx2, ctz or naive (default: jump)\n");
+    fprintf(stderr, "  --jump=K           advance K steps per table lookup, %d..%d (default: 16)\n", JUMP_BITS_MIN,
+            JUMP_BITS_MAX);
+    fprintf(stderr, "  --records          list glide records in the range instead of statistics\n");
+    fprintf(stderr, "  --format=FORMAT    sequence output: text (default), binary varints, or count only\n");
+    fprintf(stderr, "  --dump             write the sequence of every start in the range\n");
+    fprintf(stderr, "  --decode           convert binary sequences on stdin to text\n");
+    fprintf(stderr, "  --selftest         check every kernel against the naive loop\n");
+    fprintf(stderr, "  --bench[=WHAT]     time kernels and execution models, JSON on stdout\n");
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    const char *number = NULL;
+    if (argc >= 2 && strncmp(argv[1], "--", 2) == 0) {
+        int have_range = 0, selftest = 0, dump = 0, decode = 0;
+        const char *bench = NULL;
+        for (int i = 1; i < argc; i++) {
+            const char *arg = argv[i];
+            if (strncmp(arg, "--range=", 8) == 0) {
+                if (!parse_range(arg + 8, &range_start, &range_end)) {
+                    fprintf(stderr, "Error: invalid range: %s\n", arg + 8);
+                    exit(EXIT_FAILURE);
+                }
+                have_range = 1;
+            } else if (strncmp(arg, "--threads=", 10) == 0) {
+                num_threads = atoi(arg + 10);
+                if (num_threads <= 0) {
+                    fprintf(stderr, "Error: thread count must be positive.\n");
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strncmp(arg, "--procs=", 8) == 0) {
+                num_procs = atoi(arg + 8);
+                if (num_procs <= 0) {
+                    fprintf(stderr, "Error: process count must be positive.\n");
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strncmp(arg, "--memo=", 7) == 0) {
+                if (!parse_u64(arg + 7, &memo_size)) {
+                    fprintf(stderr, "Error: invalid memo size: %s\n", arg + 7);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strncmp(arg, "--kernel=", 9) == 0) {
+                kernel = kernel_find(arg + 9);
+                if (kernel == NULL) {
+                    fprintf(stderr, "Error: unknown kernel: %s\n", arg + 9);
+                    exit(EXIT_FAILURE);
+                }
+                if (!kernel->supported()) {
+                    fprintf(stderr, "Error: kernel %s is not supported by this CPU.\n", kernel->name);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strncmp(arg, "--jump=", 7) == 0) {
+                jump_bits = atoi(arg + 7);
+                if (jump_bits < JUMP_BITS_MIN || jump_bits > JUMP_BITS_MAX) {
+                    fprintf(stderr, "Error: --jump must be between %d and %d.\n", JUMP_BITS_MIN, JUMP_BITS_MAX);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strncmp(arg, "--format=", 9) == 0) {
+                if (strcmp(arg + 9, "text") == 0) {
+                    out_format = FORMAT_TEXT;
+                } else if (strcmp(arg + 9, "binary") == 0) {
+                    out_format = FORMAT_BINARY;
+                } else if (strcmp(arg + 9, "count") == 0) {
+                    out_format = FORMAT_COUNT;
+                } else {
+                    fprintf(stderr, "Error: unknown format: %s\n", arg + 9);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(arg, "--dump") == 0) {
+                dump = 1;
+            } else if (strcmp(arg, "--decode") == 0) {
+                decode = 1;
+            } else if (arg[0] != '-' && number == NULL) {
+                number = arg;
+            } else if (strcmp(arg, "--records") == 0) {
+                records_mode = 1;
+            } else if (strcmp(arg, "--bench") == 0 || strncmp(arg, "--bench=", 8) == 0) {
+                bench = arg[7] == '=' ? arg + 8 : "all";
+            } else if (strcmp(arg, "--selftest") == 0) {
+                selftest = 1;
+            } else {
+                fprintf(stderr, "Error: unknown option: %s\n", arg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (decode) return decode_main();
+        if (bench == NULL && have_range + selftest + (number != NULL) != 1) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (!jump_init()) {
+            fprintf(stderr, "Error: cannot allocate the jump tables.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (selftest) return collatz_selftest();
+        if (kernel == NULL) kernel = kernel_find("jump");
+        if (num_threads != 0 && num_procs != 0) {
+            fprintf(stderr, "Error: --threads and --procs cannot be combined.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (bench != NULL) return bench_main(bench, have_range);
+        if (num_threads == 0 && num_procs == 0) num_threads = cpu_count();
+        if (have_range) return dump ? dump_main() : range_main();
+    } else if (argc == 2) {
+        number = argv[1];
+    }
+
+    if (number == NULL) {
         fprintf(stderr, "Error: Please provide a positive integer as an argument.\n");
-        fprintf(stderr, "Usage: %s <positive_integer>\n", argv[0]);
+        usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int n = atoi(argv[1]);
-    if (n <= 0) {
+    BigNum n = {NULL, 0, 0};
+    if (!big_parse(number, &n)) {
         fprintf(stderr, "Error: Please provide a positive integer.\n");
         exit(EXIT_FAILURE);
     }
@@ -23,17 +1602,18 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: fork() failed\n");
         exit(EXIT_FAILURE);
     } else if (pid == 0) {
-        printf("%d", n);
+        SeqWriter out;
+        out_init(&out, STDOUT_FILENO, out_format);
         
-        while (n != 1) {
-            if (n % 2 == 0) {
-                n = n / 2;
-            } else {
-                n = 3 * n + 1;
-            }
-            printf(", %d", n);
+        Promotions promotions = {0, 0};
+        uint64_t steps = sequence_write(out_format == FORMAT_COUNT ? NULL : &out, &n, &promotions);
+        out_close(&out);
+        if (out_format == FORMAT_COUNT) printf("%llu steps\n", (unsigned long long)steps);
+        if (promotions.to128 != 0 || promotions.to_big != 0) {
+            fprintf(stderr, "promotions: %llu to 128 bits, %llu to bignum\n",
+                    (unsigned long long)promotions.to128, (unsigned long long)promotions.to_big);
         }
-        printf("\n");
+        free(n.limb);
         
         exit(EXIT_SUCCESS);
     } else {
@@ -51,5 +1631,6 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    free(n.limb);
     return EXIT_SUCCESS;
 }
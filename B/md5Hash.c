@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,89 +9,432 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <libgen.h>
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
 
-#define NUM_THREADS 8
 #define MAX_PATH 4096
+#define PATH_BLOCK_SIZE (64 * 1024)
+#define QUEUE_BATCH 32
+#define QUEUE_SPIN 128
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// Paths live in blocks owned by the thread that enqueued them. A block is
+// freed when the producer has moved on and every task pointing into it has
+// been released by its consumer.
 typedef struct {
-    char path[MAX_PATH];
+    atomic_long refs;
+    size_t used;
+    char data[];
+} PathBlock;
+
+// owner is free for modes that need a result routed back to the code that
+// queued the task; plain hashing leaves it NULL. Owners that share the hash
+// workers with plain tasks start with a TaskOwner so workers can tell them
+// apart.
+typedef struct {
+    const char *path;
+    PathBlock *block;
+    void *owner;
 } FileTask;
 
+enum {
+    OWNER_TREE = 1,
+    OWNER_REQUEST,
+    OWNER_CHECK,
+    OWNER_BATCH,
+    OWNER_DUPE
+};
+
 typedef struct {
-    FileTask *tasks;
-    int front;
-    int rear;
-    int size;
-    int capacity;
-    pthread_mutex_t lock;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
+    int kind;
+} TaskOwner;
+
+static inline int task_owner_kind(const FileTask *task) {
+    return task->owner != NULL ? ((const TaskOwner *)task->owner)->kind : 0;
+}
+
+typedef struct {
+    atomic_size_t seq;
+    FileTask task;
+} QueueSlot;
+
+// Bounded MPMC ring after Dmitry Vyukov: each slot's sequence number says
+// whether it is free for the producer at position pos (seq == pos) or holds
+// an item for the consumer at pos (seq == pos + 1). Threads only sleep, on a
+// futex, once the ring has stayed empty or full for a short spin.
+typedef struct {
+    QueueSlot *slots;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+    _Alignas(64) atomic_uint not_empty;
+    atomic_int empty_waiters;
+    atomic_uint not_full;
+    atomic_int full_waiters;
+    atomic_int closed;
 } TaskQueue;
 
 TaskQueue *queue = NULL;
-pthread_t threads[NUM_THREADS];
-int should_exit = 0;
+pthread_t *threads = NULL;
+int num_threads = 0;
 pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static __thread PathBlock *path_block = NULL;
+
+static void path_block_release(PathBlock *b) {
+    if (b != NULL && atomic_fetch_sub(&b->refs, 1) == 1) {
+        free(b);
+    }
+}
+
+static FileTask path_store(const char *path) {
+    size_t len = strlen(path) + 1;
+    PathBlock *b = path_block;
+    if (b == NULL || b->used + len > PATH_BLOCK_SIZE) {
+        path_block_release(b);
+        b = (PathBlock *)malloc(sizeof(PathBlock) + (len > PATH_BLOCK_SIZE ? len : PATH_BLOCK_SIZE));
+        atomic_init(&b->refs, 1);
+        b->used = 0;
+        path_block = b;
+    }
+    FileTask task = {b->data + b->used, b, NULL};
+    memcpy(b->data + b->used, path, len);
+    b->used += len;
+    atomic_fetch_add(&b->refs, 1);
+    return task;
+}
+
+// Drops the calling producer's hold on its current path block; call before
+// a producer thread exits.
+void path_store_flush(void) {
+    path_block_release(path_block);
+    path_block = NULL;
+}
+
+void task_release(FileTask *task) {
+    path_block_release(task->block);
+}
+
+// Instrumentation. Every thread owns a ThreadStats that only it writes, with
+// relaxed loads and stores rather than read-modify-writes, so counting adds
+// no shared cache-line traffic. Readers sum all of them for the progress
+// line, SIGUSR1 dumps and the final report. Records are kept until exit so
+// threads that have finished still count.
+#define STATS_BUCKETS 40
+
+typedef atomic_uint_fast64_t Counter;
+
+typedef struct ThreadStats {
+    const char *role;
+    int index;
+    Counter files;
+    Counter bytes;
+    Counter dequeue_wait_ns;
+    Counter enqueue_wait_ns;
+    Counter reads;
+    Counter read_ns;
+    Counter hash_ns;
+    Counter read_hist[STATS_BUCKETS];
+    Counter wait_hist[STATS_BUCKETS];
+    struct ThreadStats *next;
+} ThreadStats;
+
+static __thread ThreadStats *stats_local = NULL;
+static _Atomic(ThreadStats *) stats_threads = NULL;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void counter_add(Counter *c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(Counter *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) ns.
+static inline int stats_bucket(uint64_t ns) {
+    int b = 63 - __builtin_clzll(ns | 1);
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+void stats_register(const char *role, int index) {
+    ThreadStats *s = (ThreadStats *)calloc(1, sizeof(ThreadStats));
+    s->role = role;
+    s->index = index;
+    s->next = atomic_load(&stats_threads);
+    while (!atomic_compare_exchange_weak(&stats_threads, &s->next, s)) {
+    }
+    stats_local = s;
+}
+
+static inline ThreadStats *stats_self(void) {
+    if (stats_local == NULL) {
+        stats_register("main", 0);
+    }
+    return stats_local;
+}
+
+static void stats_dequeue_wait(uint64_t ns) {
+    ThreadStats *s = stats_self();
+    counter_add(&s->dequeue_wait_ns, ns);
+    counter_add(&s->wait_hist[stats_bucket(ns)], 1);
+}
+
+static void stats_enqueue_wait(uint64_t ns) {
+    counter_add(&stats_self()->enqueue_wait_ns, ns);
+}
+
+static void stats_read(uint64_t ns) {
+    ThreadStats *s = stats_self();
+    counter_add(&s->reads, 1);
+    counter_add(&s->read_ns, ns);
+    counter_add(&s->read_hist[stats_bucket(ns)], 1);
+}
+
+static void stats_hashed(uint64_t ns, size_t bytes) {
+    ThreadStats *s = stats_self();
+    counter_add(&s->hash_ns, ns);
+    counter_add(&s->bytes, bytes);
+}
+
+static void futex_wait(atomic_uint *addr, unsigned val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void queue_notify(atomic_uint *seq, atomic_int *waiters) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add(seq, 1);
+        futex_wake(seq, INT32_MAX);
+    }
+}
+
 TaskQueue* queue_init(int capacity) {
-    TaskQueue *q = (TaskQueue *)malloc(sizeof(TaskQueue));
-    q->tasks = (FileTask *)malloc(sizeof(FileTask) * capacity);
-    q->front = 0;
-    q->rear = -1;
-    q->size = 0;
-    q->capacity = capacity;
-    pthread_mutex_init(&q->lock, NULL);
-    pthread_cond_init(&q->not_empty, NULL);
-    pthread_cond_init(&q->not_full, NULL);
+    size_t size = 2;
+    while (size < (size_t)capacity) size <<= 1;
+
+    TaskQueue *q = (TaskQueue *)aligned_alloc(64, sizeof(TaskQueue));
+    memset(q, 0, sizeof(*q));
+    q->slots = (QueueSlot *)malloc(sizeof(QueueSlot) * size);
+    q->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->slots[i].seq, i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
     return q;
 }
 
-void queue_enqueue(TaskQueue *q, const char *path) {
-    pthread_mutex_lock(&q->lock);
-    
-    while (q->size == q->capacity) {
-        pthread_cond_wait(&q->not_full, &q->lock);
+// Claims up to max consecutive slots at the head (consumer) or tail
+// (producer) of the ring. Returns the first position and sets *count.
+static int queue_claim(TaskQueue *q, atomic_size_t *posp, size_t ready, size_t max, size_t *first, size_t *count) {
+    size_t pos = atomic_load_explicit(posp, memory_order_relaxed);
+    for (;;) {
+        size_t n = 0;
+        while (n < max) {
+            QueueSlot *slot = &q->slots[(pos + n) & q->mask];
+            size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq != pos + n + ready) break;
+            n++;
+        }
+        if (n == 0) {
+            size_t now = atomic_load_explicit(posp, memory_order_relaxed);
+            if (now == pos) return 0;
+            pos = now;
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(posp, &pos, pos + n,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            *first = pos;
+            *count = n;
+            return 1;
+        }
     }
-    
-    q->rear = (q->rear + 1) % q->capacity;
-    strncpy(q->tasks[q->rear].path, path, MAX_PATH - 1);
-    q->tasks[q->rear].path[MAX_PATH - 1] = '\0';
-    q->size++;
-    
-    pthread_cond_signal(&q->not_empty);
-    pthread_mutex_unlock(&q->lock);
 }
 
-int queue_dequeue(TaskQueue *q, FileTask *task) {
-    pthread_mutex_lock(&q->lock);
-    
-    while (q->size == 0 && !should_exit) {
-        pthread_cond_wait(&q->not_empty, &q->lock);
+static size_t queue_try_enqueue_tasks(TaskQueue *q, const FileTask *tasks, size_t n) {
+    size_t first, count;
+    if (!queue_claim(q, &q->enqueue_pos, 0, n, &first, &count)) {
+        return 0;
     }
-    
-    if (q->size == 0) {
-        pthread_mutex_unlock(&q->lock);
+    for (size_t i = 0; i < count; i++) {
+        QueueSlot *slot = &q->slots[(first + i) & q->mask];
+        slot->task = tasks[i];
+        atomic_store_explicit(&slot->seq, first + i + 1, memory_order_release);
+    }
+    queue_notify(&q->not_empty, &q->empty_waiters);
+    return count;
+}
+
+// Enqueues n tasks, blocking while the ring is full.
+void queue_enqueue_tasks(TaskQueue *q, const FileTask *tasks, int n) {
+    for (int i = 0; i < n;) {
+        size_t put = queue_try_enqueue_tasks(q, tasks + i, (size_t)(n - i));
+        uint64_t start = put == 0 ? now_ns() : 0;
+        for (int spin = 0; put == 0 && spin < QUEUE_SPIN; spin++) {
+            cpu_relax();
+            put = queue_try_enqueue_tasks(q, tasks + i, (size_t)(n - i));
+        }
+        if (put == 0) {
+            unsigned seq = atomic_load(&q->not_full);
+            atomic_fetch_add(&q->full_waiters, 1);
+            put = queue_try_enqueue_tasks(q, tasks + i, (size_t)(n - i));
+            if (put == 0) futex_wait(&q->not_full, seq);
+            atomic_fetch_sub(&q->full_waiters, 1);
+        }
+        if (start) stats_enqueue_wait(now_ns() - start);
+        i += (int)put;
+    }
+}
+
+void queue_enqueue(TaskQueue *q, const char *path) {
+    FileTask task = path_store(path);
+    queue_enqueue_tasks(q, &task, 1);
+}
+
+// Number of tasks currently waiting; only a hint under concurrency.
+size_t queue_backlog(TaskQueue *q) {
+    size_t head = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+// Takes up to max tasks without blocking. Each task must be handed back
+// with task_release once its path is no longer needed.
+int queue_try_dequeue_batch(TaskQueue *q, FileTask *tasks, int max) {
+    size_t first, count;
+    if (!queue_claim(q, &q->dequeue_pos, 1, (size_t)max, &first, &count)) {
         return 0;
     }
-    
-    *task = q->tasks[q->front];
-    q->front = (q->front + 1) % q->capacity;
-    q->size--;
-    
-    pthread_cond_signal(&q->not_full);
-    pthread_mutex_unlock(&q->lock);
-    return 1;
+    for (size_t i = 0; i < count; i++) {
+        QueueSlot *slot = &q->slots[(first + i) & q->mask];
+        tasks[i] = slot->task;
+        atomic_store_explicit(&slot->seq, first + i + q->mask + 1, memory_order_release);
+    }
+    queue_notify(&q->not_full, &q->full_waiters);
+    return (int)count;
+}
+
+int queue_try_dequeue(TaskQueue *q, FileTask *task) {
+    return queue_try_dequeue_batch(q, task, 1);
+}
+
+// Called by a consumer that found the queue empty, before it waits.
+static void (*queue_idle_hook)(void) = NULL;
+
+// Blocks until at least one task is available; returns 0 once the queue has
+// been closed and drained. Only time spent after a failed first attempt
+// counts as waiting.
+int queue_dequeue_batch(TaskQueue *q, FileTask *tasks, int max) {
+    int got = queue_try_dequeue_batch(q, tasks, max);
+    if (got) return got;
+    if (queue_idle_hook != NULL) queue_idle_hook();
+
+    uint64_t start = now_ns();
+    for (;;) {
+        for (int spin = 0; spin < QUEUE_SPIN && got == 0; spin++) {
+            cpu_relax();
+            got = queue_try_dequeue_batch(q, tasks, max);
+        }
+        if (got) break;
+
+        unsigned seq = atomic_load(&q->not_empty);
+        atomic_fetch_add(&q->empty_waiters, 1);
+        got = queue_try_dequeue_batch(q, tasks, max);
+        if (got == 0 && atomic_load(&q->closed)) {
+            atomic_fetch_sub(&q->empty_waiters, 1);
+            got = queue_try_dequeue_batch(q, tasks, max);
+            break;
+        }
+        if (got == 0) futex_wait(&q->not_empty, seq);
+        atomic_fetch_sub(&q->empty_waiters, 1);
+        if (got) break;
+    }
+    stats_dequeue_wait(now_ns() - start);
+    return got;
+}
+
+int queue_dequeue(TaskQueue *q, FileTask *task) {
+    return queue_dequeue_batch(q, task, 1);
+}
+
+// Wakes every blocked consumer; dequeues fail once the ring is empty.
+void queue_close(TaskQueue *q) {
+    atomic_store(&q->closed, 1);
+    atomic_fetch_add(&q->not_empty, 1);
+    futex_wake(&q->not_empty, INT32_MAX);
 }
 
 void queue_free(TaskQueue *q) {
-    pthread_mutex_destroy(&q->lock);
-    pthread_cond_destroy(&q->not_empty);
-    pthread_cond_destroy(&q->not_full);
-    free(q->tasks);
+    free(q->slots);
     free(q);
 }
 
+// CPUs in this process's affinity mask. Pool sizes default to their count,
+// so a container or taskset limit is honoured, and --pin spreads the hash
+// workers over them in order.
+static int *allowed_cpus = NULL;
+static int allowed_cpu_count = 0;
+int pin_threads = 0;
+
+static void cpus_detect(void) {
+    cpu_set_t set;
+    allowed_cpus = (int *)malloc(sizeof(int) * CPU_SETSIZE);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) allowed_cpus[allowed_cpu_count++] = c;
+        }
+    }
+    if (allowed_cpu_count == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int c = 0; c < (n > 0 ? n : 1) && c < CPU_SETSIZE; c++) {
+            allowed_cpus[allowed_cpu_count++] = c;
+        }
+    }
+}
+
+// Pins the calling thread to the i-th allowed CPU. Buffers it allocates
+// afterwards are first touched there, so they land on that CPU's NUMA node.
+static void pin_self(int i) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(allowed_cpus[i % allowed_cpu_count], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
 #define S11 7
 #define S12 12
 #define S13 17
@@ -278,138 +622,5278 @@ static void md5_final(unsigned char digest[16], MD5_CTX *ctx) {
             digest[i*4+j] = (ctx->state[i] >> (j * 8)) & 0xff;
 }
 
-char* calculate_md5(const char *filepath) {
-    unsigned char digest[16];
-    char *md5str = (char *)malloc(33);
-    
-    FILE *f = fopen(filepath, "rb");
-    if (f == NULL) {
-        snprintf(md5str, 33, "00000000000000000000000000000000");
-        return md5str;
-    }
-    
-    MD5_CTX ctx;
-    md5_init(&ctx);
-    
-    unsigned char buffer[1024];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), f)) != 0) {
-        md5_update(&ctx, buffer, bytes);
+#define MB_MAX_LANES 16
+
+typedef void (*md5_mb_fn)(uint32_t state[4][MB_MAX_LANES], const unsigned char *blocks[MB_MAX_LANES]);
+
+static inline uint32_t load_le32(const unsigned char *p) {
+    return ((uint32_t)p[0]) | (((uint32_t)p[1]) << 8) |
+           (((uint32_t)p[2]) << 16) | (((uint32_t)p[3]) << 24);
+}
+
+// Multi-buffer MD5: each vector lane carries an independent stream, so one
+// pass over the 64 steps advances LANES files by one block each.
+#define MD5_MB_ROUNDS(STEP) \
+    STEP(MB_F, a, b, c, d, 0, S11, 0xd76aa478) \
+    STEP(MB_F, d, a, b, c, 1, S12, 0xe8c7b756) \
+    STEP(MB_F, c, d, a, b, 2, S13, 0x242070db) \
+    STEP(MB_F, b, c, d, a, 3, S14, 0xc1bdceee) \
+    STEP(MB_F, a, b, c, d, 4, S11, 0xf57c0faf) \
+    STEP(MB_F, d, a, b, c, 5, S12, 0x4787c62a) \
+    STEP(MB_F, c, d, a, b, 6, S13, 0xa8304613) \
+    STEP(MB_F, b, c, d, a, 7, S14, 0xfd469501) \
+    STEP(MB_F, a, b, c, d, 8, S11, 0x698098d8) \
+    STEP(MB_F, d, a, b, c, 9, S12, 0x8b44f7af) \
+    STEP(MB_F, c, d, a, b, 10, S13, 0xffff5bb1) \
+    STEP(MB_F, b, c, d, a, 11, S14, 0x895cd7be) \
+    STEP(MB_F, a, b, c, d, 12, S11, 0x6b901122) \
+    STEP(MB_F, d, a, b, c, 13, S12, 0xfd987193) \
+    STEP(MB_F, c, d, a, b, 14, S13, 0xa679438e) \
+    STEP(MB_F, b, c, d, a, 15, S14, 0x49b40821) \
+    STEP(MB_G, a, b, c, d, 1, S21, 0xf61e2562) \
+    STEP(MB_G, d, a, b, c, 6, S22, 0xc040b340) \
+    STEP(MB_G, c, d, a, b, 11, S23, 0x265e5a51) \
+    STEP(MB_G, b, c, d, a, 0, S24, 0xe9b6c7aa) \
+    STEP(MB_G, a, b, c, d, 5, S21, 0xd62f105d) \
+    STEP(MB_G, d, a, b, c, 10, S22, 0x2441453) \
+    STEP(MB_G, c, d, a, b, 15, S23, 0xd8a1e681) \
+    STEP(MB_G, b, c, d, a, 4, S24, 0xe7d3fbc8) \
+    STEP(MB_G, a, b, c, d, 9, S21, 0x21e1cde6) \
+    STEP(MB_G, d, a, b, c, 14, S22, 0xc33707d6) \
+    STEP(MB_G, c, d, a, b, 3, S23, 0xf4d50d87) \
+    STEP(MB_G, b, c, d, a, 8, S24, 0x455a14ed) \
+    STEP(MB_G, a, b, c, d, 13, S21, 0xa9e3e905) \
+    STEP(MB_G, d, a, b, c, 2, S22, 0xfcefa3f8) \
+    STEP(MB_G, c, d, a, b, 7, S23, 0x676f02d9) \
+    STEP(MB_G, b, c, d, a, 12, S24, 0x8d2a4c8a) \
+    STEP(MB_H, a, b, c, d, 5, S31, 0xfffa3942) \
+    STEP(MB_H, d, a, b, c, 8, S32, 0x8771f681) \
+    STEP(MB_H, c, d, a, b, 11, S33, 0x6d9d6122) \
+    STEP(MB_H, b, c, d, a, 14, S34, 0xfde5380c) \
+    STEP(MB_H, a, b, c, d, 1, S31, 0xa4beea44) \
+    STEP(MB_H, d, a, b, c, 4, S32, 0x4bdecfa9) \
+    STEP(MB_H, c, d, a, b, 7, S33, 0xf6bb4b60) \
+    STEP(MB_H, b, c, d, a, 10, S34, 0xbebfbc70) \
+    STEP(MB_H, a, b, c, d, 13, S31, 0x289b7ec6) \
+    STEP(MB_H, d, a, b, c, 0, S32, 0xeaa127fa) \
+    STEP(MB_H, c, d, a, b, 3, S33, 0xd4ef3085) \
+    STEP(MB_H, b, c, d, a, 6, S34, 0x4881d05) \
+    STEP(MB_H, a, b, c, d, 9, S31, 0xd9d4d039) \
+    STEP(MB_H, d, a, b, c, 12, S32, 0xe6db99e5) \
+    STEP(MB_H, c, d, a, b, 15, S33, 0x1fa27cf8) \
+    STEP(MB_H, b, c, d, a, 2, S34, 0xc4ac5665) \
+    STEP(MB_I, a, b, c, d, 0, S41, 0xf4292244) \
+    STEP(MB_I, d, a, b, c, 7, S42, 0x432aff97) \
+    STEP(MB_I, c, d, a, b, 14, S43, 0xab9423a7) \
+    STEP(MB_I, b, c, d, a, 5, S44, 0xfc93a039) \
+    STEP(MB_I, a, b, c, d, 12, S41, 0x655b59c3) \
+    STEP(MB_I, d, a, b, c, 3, S42, 0x8f0ccc92) \
+    STEP(MB_I, c, d, a, b, 10, S43, 0xffeff47d) \
+    STEP(MB_I, b, c, d, a, 1, S44, 0x85845dd1) \
+    STEP(MB_I, a, b, c, d, 8, S41, 0x6fa87e4f) \
+    STEP(MB_I, d, a, b, c, 15, S42, 0xfe2ce6e0) \
+    STEP(MB_I, c, d, a, b, 6, S43, 0xa3014314) \
+    STEP(MB_I, b, c, d, a, 13, S44, 0x4e0811a1) \
+    STEP(MB_I, a, b, c, d, 4, S41, 0xf7537e82) \
+    STEP(MB_I, d, a, b, c, 11, S42, 0xbd3af235) \
+    STEP(MB_I, c, d, a, b, 2, S43, 0x2ad7d2bb) \
+    STEP(MB_I, b, c, d, a, 9, S44, 0xeb86d391)
+
+#define MB_F(x, y, z) VOR(VAND((x), (y)), VANDNOT((x), (z)))
+#define MB_G(x, y, z) VOR(VAND((x), (z)), VANDNOT((z), (y)))
+#define MB_H(x, y, z) VXOR(VXOR((x), (y)), (z))
+#define MB_I(x, y, z) VXOR((y), VOR((x), VXOR((z), VSET1(-1))))
+
+#define MB_STEP(FN, a, b, c, d, k, s, ac) \
+    (a) = VADD((a), VADD(VADD(FN((b), (c), (d)), x[k]), VSET1((int)(ac)))); \
+    (a) = VROTL((a), (s)); \
+    (a) = VADD((a), (b));
+
+#define MD5_MB_BODY(LANES) \
+    uint32_t w[16][LANES] __attribute__((aligned(64))); \
+    for (int l = 0; l < (LANES); l++) \
+        for (int i = 0; i < 16; i++) \
+            w[i][l] = load_le32(blocks[l] + i * 4); \
+    VEC x[16]; \
+    for (int i = 0; i < 16; i++) \
+        x[i] = VLOAD(w[i]); \
+    VEC a = VLOAD(state[0]), b = VLOAD(state[1]), c = VLOAD(state[2]), d = VLOAD(state[3]); \
+    VEC aa = a, bb = b, cc = c, dd = d; \
+    MD5_MB_ROUNDS(MB_STEP) \
+    VSTORE(state[0], VADD(a, aa)); \
+    VSTORE(state[1], VADD(b, bb)); \
+    VSTORE(state[2], VADD(c, cc)); \
+    VSTORE(state[3], VADD(d, dd));
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define VEC __m128i
+#define VLOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define VSET1 _mm_set1_epi32
+#define VADD _mm_add_epi32
+#define VAND _mm_and_si128
+#define VOR _mm_or_si128
+#define VXOR _mm_xor_si128
+#define VANDNOT _mm_andnot_si128
+#define VROTL(v, s) _mm_or_si128(_mm_slli_epi32((v), (s)), _mm_srli_epi32((v), 32 - (s)))
+
+__attribute__((target("sse2")))
+static void md5_mb_sse2(uint32_t state[4][MB_MAX_LANES], const unsigned char *blocks[MB_MAX_LANES]) {
+    MD5_MB_BODY(4)
+}
+
+#undef VEC
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VANDNOT
+#undef VROTL
+
+#define VEC __m256i
+#define VLOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define VSET1 _mm256_set1_epi32
+#define VADD _mm256_add_epi32
+#define VAND _mm256_and_si256
+#define VOR _mm256_or_si256
+#define VXOR _mm256_xor_si256
+#define VANDNOT _mm256_andnot_si256
+#define VROTL(v, s) _mm256_or_si256(_mm256_slli_epi32((v), (s)), _mm256_srli_epi32((v), 32 - (s)))
+
+__attribute__((target("avx2")))
+static void md5_mb_avx2(uint32_t state[4][MB_MAX_LANES], const unsigned char *blocks[MB_MAX_LANES]) {
+    MD5_MB_BODY(8)
+}
+
+#undef VEC
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VANDNOT
+#undef VROTL
+
+#define VEC __m512i
+#define VLOAD(p) _mm512_loadu_si512((const void *)(p))
+#define VSTORE(p, v) _mm512_storeu_si512((void *)(p), (v))
+#define VSET1 _mm512_set1_epi32
+#define VADD _mm512_add_epi32
+#define VAND _mm512_and_si512
+#define VOR _mm512_or_si512
+#define VXOR _mm512_xor_si512
+#define VANDNOT _mm512_andnot_si512
+#define VROTL(v, s) _mm512_rol_epi32((v), (s))
+
+__attribute__((target("avx512f")))
+static void md5_mb_avx512(uint32_t state[4][MB_MAX_LANES], const unsigned char *blocks[MB_MAX_LANES]) {
+    MD5_MB_BODY(16)
+}
+
+#undef VEC
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VANDNOT
+#undef VROTL
+#endif
+
+typedef struct {
+    const char *name;
+    int lanes;
+    md5_mb_fn fn;
+} MD5Kernel;
+
+static const MD5Kernel md5_kernels[] = {
+    {"scalar", 1, NULL},
+#if defined(__x86_64__) || defined(__i386__)
+    {"sse2", 4, md5_mb_sse2},
+    {"avx2", 8, md5_mb_avx2},
+    {"avx512", 16, md5_mb_avx512},
+#endif
+};
+#define MD5_KERNEL_COUNT ((int)(sizeof(md5_kernels) / sizeof(md5_kernels[0])))
+
+static const MD5Kernel *md5_kernel = &md5_kernels[0];
+
+static int md5_kernel_supported(const MD5Kernel *k) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (k->fn == md5_mb_avx512) return __builtin_cpu_supports("avx512f");
+    if (k->fn == md5_mb_avx2) return __builtin_cpu_supports("avx2");
+    if (k->fn == md5_mb_sse2) return __builtin_cpu_supports("sse2");
+#endif
+    return k->fn == NULL;
+}
+
+static const MD5Kernel *md5_kernel_find(const char *name) {
+    for (int i = 0; i < MD5_KERNEL_COUNT; i++) {
+        if (strcmp(md5_kernels[i].name, name) == 0) return &md5_kernels[i];
     }
-    
-    fclose(f);
-    md5_final(digest, &ctx);
-    
-    for (int i = 0; i < 16; i++) {
-        sprintf(md5str + (i * 2), "%02x", (unsigned int)digest[i]);
+    return NULL;
+}
+
+static const MD5Kernel *md5_kernel_detect(void) {
+    for (int i = MD5_KERNEL_COUNT - 1; i > 0; i--) {
+        if (md5_kernel_supported(&md5_kernels[i])) return &md5_kernels[i];
     }
-    md5str[32] = '\0';
-    
-    return md5str;
+    return &md5_kernels[0];
 }
 
-void add_files_from_directory(const char *dir_path) {
-    DIR *dir = opendir(dir_path);
-    if (dir == NULL) {
-        return;
+// Advances n contexts by nblocks full blocks each. Every context must have an
+// empty partial-block buffer, i.e. all bytes seen so far are a multiple of 64.
+static void md5_mb_update(const MD5Kernel *k, MD5_CTX *ctx[], const unsigned char *data[],
+                          int n, size_t nblocks) {
+    static const unsigned char zero_block[64];
+    uint32_t state[4][MB_MAX_LANES] __attribute__((aligned(64)));
+    const unsigned char *blocks[MB_MAX_LANES];
+
+    for (int l = 0; l < k->lanes; l++) {
+        for (int s = 0; s < 4; s++)
+            state[s][l] = l < n ? ctx[l]->state[s] : 0;
+        blocks[l] = zero_block;
     }
-    
-    struct dirent *entry;
-    char full_path[MAX_PATH];
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+
+    for (size_t blk = 0; blk < nblocks; blk++) {
+        for (int l = 0; l < n; l++)
+            blocks[l] = data[l] + blk * 64;
+        k->fn(state, blocks);
+    }
+
+    uint32_t bits = (uint32_t)(nblocks << 9);
+    for (int l = 0; l < n; l++) {
+        for (int s = 0; s < 4; s++)
+            ctx[l]->state[s] = state[s][l];
+        ctx[l]->count[0] += bits;
+        if (ctx[l]->count[0] < bits)
+            ctx[l]->count[1]++;
+        ctx[l]->count[1] += (uint32_t)((uint64_t)nblocks >> 23);
+    }
+}
+
+// SHA-256 (FIPS 180-4). Whole blocks go through sha256_blocks, which is the
+// SHA-NI kernel when the CPU has it and the portable one otherwise.
+typedef struct {
+    uint32_t state[8];
+    uint64_t count;
+    unsigned char buffer[64];
+} SHA256_CTX;
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_portable(uint32_t state[8], const unsigned char *data, size_t nblocks) {
+    for (size_t blk = 0; blk < nblocks; blk++, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+                   ((uint32_t)data[i * 4 + 2] << 8) | (uint32_t)data[i * 4 + 3];
         }
-        
-        snprintf(full_path, MAX_PATH, "%s/%s", dir_path, entry->d_name);
-        
-        struct stat st;
-        if (stat(full_path, &st) == -1) {
-            continue;
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
         }
-        
-        if (S_ISREG(st.st_mode)) {
-            queue_enqueue(queue, full_path);
-        } else if (S_ISDIR(st.st_mode)) {
-            add_files_from_directory(full_path);
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
         }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
     }
-    
-    closedir(dir);
 }
 
-void* worker_thread(__attribute__((unused)) void *arg) {
-    FileTask task;
-    
-    while (queue_dequeue(queue, &task)) {
-        char *md5 = calculate_md5(task.path);
-        
-        char tmp[MAX_PATH];
-        strncpy(tmp, task.path, sizeof(tmp) - 1);
-        tmp[sizeof(tmp) - 1] = '\0';
-        char *base = basename(tmp);
+#if defined(__x86_64__) || defined(__i386__)
+// The SHA extensions keep the state as ABEF/CDGH halves and run two rounds
+// per sha256rnds2; sha256msg1/msg2 extend the message schedule four words at
+// a time.
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char *data, size_t nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);
 
-        for (char *p = md5; *p; ++p) {
-            *p = (char)toupper((unsigned char)*p);
+    for (size_t blk = 0; blk < nblocks; blk++, data += 64) {
+        __m128i abef = st0, cdgh = st1;
+        __m128i w[4];
+        #pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), bswap);
+            } else {
+                __m128i m = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                m = _mm_add_epi32(m, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(m, w[(i + 3) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(w[i & 3], _mm_load_si128((const __m128i *)&sha256_k[i * 4]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0E));
         }
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+    }
 
-        pthread_mutex_lock(&output_lock);
-        printf("%s %s\n", base, md5);
-        fflush(stdout);
-        pthread_mutex_unlock(&output_lock);
-        
-        free(md5);
+    tmp = _mm_shuffle_epi32(st0, 0x1B);
+    st1 = _mm_shuffle_epi32(st1, 0xB1);
+    st0 = _mm_blend_epi16(tmp, st1, 0xF0);
+    st1 = _mm_alignr_epi8(st1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&state[0], st0);
+    _mm_storeu_si128((__m128i *)&state[4], st1);
+}
+#endif
+
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const unsigned char *data, size_t nblocks);
+
+static sha256_blocks_fn sha256_blocks = sha256_blocks_portable;
+
+static int sha256_shani_supported(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#else
+    return 0;
+#endif
+}
+
+static void sha256_init(SHA256_CTX *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->count = 0;
+}
+
+static void sha256_update(SHA256_CTX *ctx, const unsigned char *input, size_t len) {
+    size_t index = ctx->count % 64;
+    ctx->count += len;
+    if (index > 0) {
+        size_t fill = 64 - index;
+        if (len < fill) {
+            memcpy(ctx->buffer + index, input, len);
+            return;
+        }
+        memcpy(ctx->buffer + index, input, fill);
+        sha256_blocks(ctx->state, ctx->buffer, 1);
+        input += fill;
+        len -= fill;
     }
-    
-    pthread_exit(NULL);
+    if (len >= 64) {
+        sha256_blocks(ctx->state, input, len / 64);
+        input += len & ~(size_t)63;
+        len %= 64;
+    }
+    memcpy(ctx->buffer, input, len);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        char prog_buf[MAX_PATH];
-        strncpy(prog_buf, argv[0] ? argv[0] : "md5hash", sizeof(prog_buf)-1);
-        prog_buf[sizeof(prog_buf)-1] = '\0';
-        char *prog = basename(prog_buf);
-        fprintf(stderr, "USAGE: %s <directory/file> [more directories/files]\n", prog);
-        return 1;
+static void sha256_final(unsigned char digest[32], SHA256_CTX *ctx) {
+    uint64_t bits = ctx->count * 8;
+    unsigned char padding[72] = {0x80};
+    size_t index = ctx->count % 64;
+    size_t padLen = (index < 56) ? (56 - index) : (120 - index);
+    for (int i = 0; i < 8; i++)
+        padding[padLen + i] = (unsigned char)(bits >> (56 - i * 8));
+    sha256_update(ctx, padding, padLen + 8);
+
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++)
+            digest[i * 4 + j] = (unsigned char)(ctx->state[i] >> (24 - j * 8));
+}
+
+// XXH64. Not cryptographic; meant for change detection, where it runs at
+// memory bandwidth. The digest is the canonical big-endian form xxhsum prints.
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+} XXH64_CTX;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh64_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(XXH64_CTX *ctx) {
+    ctx->v[0] = XXH_P1 + XXH_P2;
+    ctx->v[1] = XXH_P2;
+    ctx->v[2] = 0;
+    ctx->v[3] = -XXH_P1;
+    ctx->total = 0;
+    ctx->buffered = 0;
+}
+
+static void xxh64_stripes(uint64_t v[4], const unsigned char *p, size_t nstripes) {
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    for (size_t i = 0; i < nstripes; i++, p += 32) {
+        v0 = xxh64_round(v0, load_le64(p));
+        v1 = xxh64_round(v1, load_le64(p + 8));
+        v2 = xxh64_round(v2, load_le64(p + 16));
+        v3 = xxh64_round(v3, load_le64(p + 24));
     }
-    
-    queue = queue_init(1000);
+    v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+}
 
-    for (int i = 0; i < NUM_THREADS; i++) {
-        if (pthread_create(&threads[i], NULL, worker_thread, NULL) != 0) {
-            fprintf(stderr, "Failed to create thread %d\n", i);
-            return 1;
+static void xxh64_update(XXH64_CTX *ctx, const unsigned char *input, size_t len) {
+    ctx->total += len;
+    if (ctx->buffered > 0) {
+        size_t fill = 32 - ctx->buffered;
+        if (len < fill) {
+            memcpy(ctx->buffer + ctx->buffered, input, len);
+            ctx->buffered += len;
+            return;
         }
+        memcpy(ctx->buffer + ctx->buffered, input, fill);
+        xxh64_stripes(ctx->v, ctx->buffer, 1);
+        input += fill;
+        len -= fill;
     }
+    xxh64_stripes(ctx->v, input, len / 32);
+    memcpy(ctx->buffer, input + (len & ~(size_t)31), len % 32);
+    ctx->buffered = len % 32;
+}
 
-    for (int i = 1; i < argc; i++) {
-        struct stat st;
-        if (stat(argv[i], &st) == -1) {
-            fprintf(stderr, "Cannot access: %s\n", argv[i]);
-            continue;
-        }
-        
-        if (S_ISREG(st.st_mode)) {
-            queue_enqueue(queue, argv[i]);
-        } else if (S_ISDIR(st.st_mode)) {
-            add_files_from_directory(argv[i]);
-        }
+static void xxh64_final(unsigned char digest[8], XXH64_CTX *ctx) {
+    uint64_t h;
+    if (ctx->total >= 32) {
+        h = rotl64(ctx->v[0], 1) + rotl64(ctx->v[1], 7) + rotl64(ctx->v[2], 12) + rotl64(ctx->v[3], 18);
+        for (int i = 0; i < 4; i++) h = xxh64_merge(h, ctx->v[i]);
+    } else {
+        h = ctx->v[2] + XXH_P5;
     }
+    h += ctx->total;
 
-    should_exit = 1;
-    pthread_cond_broadcast(&queue->not_empty);
-    
-    for (int i = 0; i < NUM_THREADS; i++) {
-        if (pthread_join(threads[i], NULL) != 0) {
-            fprintf(stderr, "Failed to join thread %d\n", i);
-            return 1;
-        }
+    const unsigned char *p = ctx->buffer;
+    size_t len = ctx->buffered;
+    for (; len >= 8; len -= 8, p += 8) {
+        h ^= xxh64_round(0, load_le64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
     }
-    
-    queue_free(queue);
-    pthread_mutex_destroy(&output_lock);
-    
-    return 0;
+    if (len >= 4) {
+        h ^= (uint64_t)load_le32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        len -= 4;
+        p += 4;
+    }
+    for (; len > 0; len--, p++) {
+        h ^= (*p) * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    for (int i = 0; i < 8; i++)
+        digest[i] = (unsigned char)(h >> (56 - i * 8));
+}
+
+// Hash engines. Everything past this point hashes through hash_engine and
+// sizes digests by its digest_len; only MD5 has multi-buffer kernels.
+#define HASH_MAX_DIGEST 32
+
+typedef union {
+    MD5_CTX md5;
+    SHA256_CTX sha256;
+    XXH64_CTX xxh64;
+} HashCtx;
+
+typedef struct {
+    const char *name;
+    uint32_t id;
+    int digest_len;
+    void (*init)(HashCtx *ctx);
+    void (*update)(HashCtx *ctx, const unsigned char *data, size_t len);
+    void (*final)(HashCtx *ctx, unsigned char *digest);
+} HashEngine;
+
+static void engine_md5_init(HashCtx *ctx) { md5_init(&ctx->md5); }
+static void engine_md5_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    md5_update(&ctx->md5, data, (unsigned int)len);
+}
+static void engine_md5_final(HashCtx *ctx, unsigned char *digest) { md5_final(digest, &ctx->md5); }
+
+static void engine_sha256_init(HashCtx *ctx) { sha256_init(&ctx->sha256); }
+static void engine_sha256_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    sha256_update(&ctx->sha256, data, len);
+}
+static void engine_sha256_final(HashCtx *ctx, unsigned char *digest) { sha256_final(digest, &ctx->sha256); }
+
+static void engine_xxh64_init(HashCtx *ctx) { xxh64_init(&ctx->xxh64); }
+static void engine_xxh64_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    xxh64_update(&ctx->xxh64, data, len);
+}
+static void engine_xxh64_final(HashCtx *ctx, unsigned char *digest) { xxh64_final(digest, &ctx->xxh64); }
+
+static const HashEngine hash_engines[] = {
+    {"md5", 1, 16, engine_md5_init, engine_md5_update, engine_md5_final},
+    {"sha256", 2, 32, engine_sha256_init, engine_sha256_update, engine_sha256_final},
+    {"xxh64", 3, 8, engine_xxh64_init, engine_xxh64_update, engine_xxh64_final},
+};
+#define HASH_ENGINE_COUNT ((int)(sizeof(hash_engines) / sizeof(hash_engines[0])))
+
+static const HashEngine *hash_engine = &hash_engines[0];
+
+static const HashEngine *hash_engine_find(const char *name) {
+    for (int i = 0; i < HASH_ENGINE_COUNT; i++) {
+        if (strcmp(hash_engines[i].name, name) == 0) return &hash_engines[i];
+    }
+    return NULL;
+}
+
+// hash_engine->update, accounted to the calling thread's hash time.
+static void hash_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    uint64_t start = now_ns();
+    hash_engine->update(ctx, data, len);
+    stats_hashed(now_ns() - start, len);
+}
+
+enum {
+    IO_STDIO,
+    IO_READ,
+    IO_MMAP,
+    IO_DIRECT,
+    IO_AUTO,
+    IO_URING,
+    IO_THREADS
+};
+
+static const char *io_backend_names[] = {"stdio", "read", "mmap", "direct", "auto", "uring", "threads"};
+
+#define IO_ALIGN 4096
+#define MMAP_WINDOW (8u << 20)
+
+int io_backend = IO_AUTO;
+size_t io_block_size = 256u << 10;
+off_t io_direct_above = 0;
+int io_drop_cache = 0;
+
+typedef struct {
+    int backend;
+    int fd;
+    FILE *f;
+    off_t size;
+    off_t offset;
+    unsigned char *buf;
+    size_t buf_size;
+    unsigned char *map;
+    off_t end;
+    struct stat st;
+} FileReader;
+
+// buf must be IO_ALIGN-aligned and a multiple of IO_ALIGN in size so the
+// same buffer can serve O_DIRECT reads. The pages are touched here, by the
+// thread that will use them, so first-touch places them on its NUMA node.
+unsigned char *io_buffer_alloc(size_t size) {
+    void *p = NULL;
+    if (posix_memalign(&p, IO_ALIGN, size) != 0) {
+        return NULL;
+    }
+    memset(p, 0, size);
+    return (unsigned char *)p;
+}
+
+// auto never picks mmap: a file truncated by another process while mapped
+// raises SIGBUS and takes down the whole run (or --serve/--watch), where
+// pread just returns a short read.
+static int pick_backend(off_t size) {
+    if (io_direct_above > 0 && size >= io_direct_above) return IO_DIRECT;
+    return IO_READ;
+}
+
+int reader_open(FileReader *r, const char *path, unsigned char *buf, size_t buf_size) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->end = -1;
+    r->buf = buf;
+    r->buf_size = buf_size;
+    r->backend = io_backend;
+
+    if (r->backend == IO_STDIO) {
+        r->f = fopen(path, "rb");
+        if (r->f == NULL) {
+            return 0;
+        }
+        if (fstat(fileno(r->f), &r->st) == -1) {
+            fclose(r->f);
+            return 0;
+        }
+        return 1;
+    }
+
+    r->fd = open(path, O_RDONLY);
+    if (r->fd == -1) {
+        return 0;
+    }
+
+    if (fstat(r->fd, &r->st) == -1) {
+        close(r->fd);
+        return 0;
+    }
+    r->size = r->st.st_size;
+
+    if (r->backend == IO_AUTO) {
+        r->backend = pick_backend(r->size);
+    }
+
+    // The mapping itself is made on the first reader_next, so files answered
+    // from the cache are never mapped.
+    if (r->backend == IO_MMAP) {
+        return 1;
+    }
+
+    if (r->backend == IO_DIRECT) {
+        int flags = fcntl(r->fd, F_GETFL);
+        if (flags == -1 || fcntl(r->fd, F_SETFL, flags | O_DIRECT) == -1) {
+            r->backend = IO_READ;
+        }
+    }
+
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 1;
+}
+
+// Bytes the next read may return: a full buffer, or less at the end of a
+// range set by reader_range.
+static size_t reader_want(FileReader *r) {
+    if (r->end >= 0 && r->end - r->offset < (off_t)r->buf_size) {
+        return r->end > r->offset ? (size_t)(r->end - r->offset) : 0;
+    }
+    return r->buf_size;
+}
+
+static ssize_t read_full(FileReader *r) {
+    size_t want = reader_want(r);
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = pread(r->fd, r->buf + got, want - got, r->offset + (off_t)got);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            // Some filesystems refuse O_DIRECT only at read time.
+            if (errno == EINVAL && r->backend == IO_DIRECT) {
+                fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+                r->backend = IO_READ;
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) break;
+        got += (size_t)n;
+        // O_DIRECT needs aligned offsets; a short read there means EOF.
+        if (r->backend == IO_DIRECT && (got % IO_ALIGN) != 0) break;
+    }
+    return (ssize_t)got;
+}
+
+static ssize_t reader_fill(FileReader *r, const unsigned char **data) {
+    if (r->backend == IO_STDIO) {
+        size_t n = fread(r->buf, 1, reader_want(r), r->f);
+        r->offset += (off_t)n;
+        *data = r->buf;
+        return ferror(r->f) ? -1 : (ssize_t)n;
+    }
+
+    if (r->backend == IO_MMAP && r->map == NULL && r->size > 0) {
+        void *map = mmap(NULL, (size_t)r->size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+        if (map == MAP_FAILED) {
+            r->backend = IO_READ;
+            posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        } else {
+            r->map = (unsigned char *)map;
+            madvise(r->map, (size_t)r->size, MADV_SEQUENTIAL);
+        }
+    }
+
+    if (r->backend == IO_MMAP) {
+        off_t left = (r->end >= 0 && r->end < r->size ? r->end : r->size) - r->offset;
+        size_t n = left > (off_t)MMAP_WINDOW ? MMAP_WINDOW : (size_t)left;
+        *data = r->map + r->offset;
+        r->offset += (off_t)n;
+        return (ssize_t)n;
+    }
+
+    ssize_t n = read_full(r);
+    if (n > 0) {
+        if (io_drop_cache) {
+            posix_fadvise(r->fd, r->offset, n, POSIX_FADV_DONTNEED);
+        }
+        r->offset += n;
+    }
+    *data = r->buf;
+    return n;
+}
+
+// Limits r to len bytes from start; reader_next then returns 0 at the end of
+// the range instead of at EOF.
+void reader_range(FileReader *r, off_t start, off_t len) {
+    r->offset = start;
+    r->end = start + len;
+    if (r->f != NULL) {
+        fseeko(r->f, start, SEEK_SET);
+    }
+}
+
+// Returns the next chunk of the file in *data: a window of the mapping for
+// mmap, r->buf otherwise. 0 means EOF, -1 a read error. With mmap the page
+// faults land in the hash time instead of the read time.
+ssize_t reader_next(FileReader *r, const unsigned char **data) {
+    uint64_t start = now_ns();
+    ssize_t n = reader_fill(r, data);
+    stats_read(now_ns() - start);
+    return n;
+}
+
+void reader_close(FileReader *r) {
+    if (r->f != NULL) {
+        fclose(r->f);
+        return;
+    }
+    if (r->map != NULL) {
+        munmap(r->map, (size_t)r->size);
+    }
+    if (io_drop_cache && r->backend == IO_MMAP) {
+        posix_fadvise(r->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(r->fd);
+}
+
+// Accepts plain byte counts or a K/M/G suffix.
+static long long parse_size(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        default: break;
+    }
+    return (*end == '\0' && v >= 0) ? v : -1;
+}
+
+// Tree digests (--tree=CHUNK). A file larger than one chunk is cut into
+// CHUNK-sized pieces that are hashed in parallel, and its digest is the hash
+// of the concatenated chunk digests. The worker that dequeued the file
+// offers helper tasks to the queue behind the files already waiting, so
+// idle workers join in without starving whole-file tasks. Every holder
+// claims chunks until none are left. Helpers are only offered with a
+// non-blocking enqueue; if the ring is full the owner does the chunks itself.
+off_t tree_chunk = 0;
+
+typedef struct {
+    TaskOwner base;
+    const char *path;
+    off_t size;
+    size_t nchunks;
+    atomic_size_t next;
+    atomic_size_t done;
+    atomic_int refs;
+    atomic_int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t all_done;
+    unsigned char digests[];
+} TreeFile;
+
+static int tree_splits(off_t size) {
+    return tree_chunk > 0 && size > tree_chunk;
+}
+
+static void tree_release(TreeFile *tf) {
+    if (atomic_fetch_sub(&tf->refs, 1) == 1) {
+        pthread_mutex_destroy(&tf->lock);
+        pthread_cond_destroy(&tf->all_done);
+        free(tf);
+    }
+}
+
+static void tree_work(TreeFile *tf, unsigned char *buf, size_t buf_size) {
+    int dlen = hash_engine->digest_len;
+    size_t i;
+    while ((i = atomic_fetch_add(&tf->next, 1)) < tf->nchunks) {
+        off_t start = (off_t)i * tree_chunk;
+        off_t len = tf->size - start < tree_chunk ? tf->size - start : tree_chunk;
+        HashCtx ctx;
+        hash_engine->init(&ctx);
+        ssize_t bytes = -1;
+        FileReader r;
+        if (reader_open(&r, tf->path, buf, buf_size)) {
+            const unsigned char *data;
+            reader_range(&r, start, len);
+            while ((bytes = reader_next(&r, &data)) > 0) {
+                hash_update(&ctx, data, (size_t)bytes);
+            }
+            reader_close(&r);
+        }
+        if (bytes < 0) {
+            atomic_store(&tf->failed, 1);
+        }
+        hash_engine->final(&ctx, tf->digests + i * dlen);
+
+        if (atomic_fetch_add(&tf->done, 1) + 1 == tf->nchunks) {
+            pthread_mutex_lock(&tf->lock);
+            pthread_cond_broadcast(&tf->all_done);
+            pthread_mutex_unlock(&tf->lock);
+        }
+    }
+}
+
+// Runs a helper task taken from the queue.
+void tree_help(FileTask *task, unsigned char *buf, size_t buf_size) {
+    TreeFile *tf = (TreeFile *)task->owner;
+    tree_work(tf, buf, buf_size);
+    tree_release(tf);
+}
+
+// Tree digest of a file of the given size. Returns 0, or -1 if a chunk
+// could not be read.
+static int tree_hash(const char *path, off_t size, unsigned char *buf, size_t buf_size,
+                     unsigned char *digest) {
+    int dlen = hash_engine->digest_len;
+    size_t nchunks = (size_t)((size + tree_chunk - 1) / tree_chunk);
+    TreeFile *tf = (TreeFile *)malloc(sizeof(TreeFile) + nchunks * dlen);
+    tf->base.kind = OWNER_TREE;
+    tf->path = path;
+    tf->size = size;
+    tf->nchunks = nchunks;
+    atomic_init(&tf->next, 0);
+    atomic_init(&tf->done, 0);
+    atomic_init(&tf->failed, 0);
+    pthread_mutex_init(&tf->lock, NULL);
+    pthread_cond_init(&tf->all_done, NULL);
+
+    size_t max_helpers = num_threads > 1 ? (size_t)num_threads - 1 : 0;
+    size_t nhelpers = nchunks - 1 < max_helpers ? nchunks - 1 : max_helpers;
+    FileTask *helpers = (FileTask *)malloc(sizeof(FileTask) * (nhelpers + 1));
+    for (size_t h = 0; h < nhelpers; h++) {
+        helpers[h] = (FileTask){path, NULL, tf};
+    }
+    atomic_init(&tf->refs, 1 + (int)nhelpers);
+    size_t put = nhelpers ? queue_try_enqueue_tasks(queue, helpers, nhelpers) : 0;
+    atomic_fetch_sub(&tf->refs, (int)(nhelpers - put));
+    free(helpers);
+
+    tree_work(tf, buf, buf_size);
+    pthread_mutex_lock(&tf->lock);
+    while (atomic_load(&tf->done) < nchunks) {
+        pthread_cond_wait(&tf->all_done, &tf->lock);
+    }
+    pthread_mutex_unlock(&tf->lock);
+
+    HashCtx ctx;
+    hash_engine->init(&ctx);
+    hash_engine->update(&ctx, tf->digests, nchunks * dlen);
+    hash_engine->final(&ctx, digest);
+    int failed = atomic_load(&tf->failed);
+    tree_release(tf);
+    return failed ? -1 : 0;
+}
+
+// Persistent digest cache. The file is a header followed by fixed-size
+// records, only ever appended to; a record is valid while the file's inode,
+// size, mtime and ctime all still match. Records are kept per inode and
+// algorithm; the newest one wins and compaction drops the superseded ones.
+#define CACHE_MAGIC "MD5HCACH"
+#define CACHE_VERSION 2
+#define CACHE_FLUSH_EVERY 4096
+#define CACHE_RACY_SECONDS 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    unsigned char reserved[48];
+} CacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t algo;
+    uint32_t reserved;
+    unsigned char digest[HASH_MAX_DIGEST];
+} CacheRecord;
+
+typedef struct {
+    char *path;
+    int fd;
+    CacheRecord *mapped;
+    size_t mapped_count;
+    size_t map_len;
+    CacheRecord *added;
+    size_t added_count;
+    size_t added_capacity;
+    size_t flushed;
+    uint32_t *index;
+    size_t index_mask;
+    size_t index_used;
+    time_t started;
+    atomic_long hits;
+    atomic_long misses;
+    pthread_rwlock_t lock;
+} HashCache;
+
+HashCache *cache = NULL;
+
+static const CacheRecord *cache_record(HashCache *c, uint32_t i) {
+    return i < c->mapped_count ? &c->mapped[i] : &c->added[i - c->mapped_count];
+}
+
+static size_t cache_slot(HashCache *c, uint64_t dev, uint64_t ino, uint32_t algo) {
+    uint64_t h = (ino * 0x9E3779B97F4A7C15ull) ^ (dev * 0xC2B2AE3D27D4EB4Full) ^ algo;
+    return (size_t)(h ^ (h >> 29)) & c->index_mask;
+}
+
+// Points the index entry for r's inode and algorithm at record i, replacing
+// older ones.
+static void cache_index_put(HashCache *c, uint32_t i) {
+    if (2 * (c->index_used + 1) > c->index_mask + 1) {
+        size_t old_size = c->index_mask + 1;
+        uint32_t *old = c->index;
+        c->index_mask = old_size * 2 - 1;
+        c->index = (uint32_t *)calloc(c->index_mask + 1, sizeof(uint32_t));
+        c->index_used = 0;
+        for (size_t s = 0; s < old_size; s++) {
+            if (old[s]) cache_index_put(c, old[s] - 1);
+        }
+        free(old);
+    }
+
+    const CacheRecord *r = cache_record(c, i);
+    size_t s = cache_slot(c, r->dev, r->ino, r->algo);
+    while (c->index[s]) {
+        const CacheRecord *o = cache_record(c, c->index[s] - 1);
+        if (o->dev == r->dev && o->ino == r->ino && o->algo == r->algo) {
+            c->index[s] = i + 1;
+            return;
+        }
+        s = (s + 1) & c->index_mask;
+    }
+    c->index[s] = i + 1;
+    c->index_used++;
+}
+
+// Tree digests of split files are kept apart from plain digests, and from
+// tree digests with another chunk size.
+static uint32_t cache_algo(const struct stat *st) {
+    uint32_t algo = hash_engine->id;
+    if (tree_splits(st->st_size)) {
+        algo |= (uint32_t)(tree_chunk >> 20) << 8;
+    }
+    return algo;
+}
+
+static int cache_record_matches(const CacheRecord *r, const struct stat *st) {
+    return r->dev == (uint64_t)st->st_dev && r->ino == (uint64_t)st->st_ino &&
+           r->size == (uint64_t)st->st_size &&
+           r->mtime_sec == (int64_t)st->st_mtim.tv_sec && r->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+           r->ctime_sec == (int64_t)st->st_ctim.tv_sec && r->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec;
+}
+
+static int cache_open_file(HashCache *c) {
+    c->fd = open(c->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (c->fd == -1) {
+        return 0;
+    }
+    flock(c->fd, LOCK_EX);
+
+    struct stat st;
+    CacheHeader h;
+    if (fstat(c->fd, &st) == -1) {
+        flock(c->fd, LOCK_UN);
+        return 0;
+    }
+    if (st.st_size < (off_t)sizeof(h) || pread(c->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, CACHE_MAGIC, 8) != 0 || h.version != CACHE_VERSION ||
+        h.record_size != sizeof(CacheRecord)) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, CACHE_MAGIC, 8);
+        h.version = CACHE_VERSION;
+        h.record_size = sizeof(CacheRecord);
+        if (ftruncate(c->fd, 0) == -1 || pwrite(c->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+            flock(c->fd, LOCK_UN);
+            return 0;
+        }
+        st.st_size = sizeof(h);
+    }
+    flock(c->fd, LOCK_UN);
+
+    // A writer in another process may have left a partial record at the end.
+    c->mapped_count = ((size_t)st.st_size - sizeof(h)) / sizeof(CacheRecord);
+    if (c->mapped_count > 0) {
+        c->map_len = sizeof(h) + c->mapped_count * sizeof(CacheRecord);
+        void *map = mmap(NULL, c->map_len, PROT_READ, MAP_SHARED, c->fd, 0);
+        if (map == MAP_FAILED) {
+            return 0;
+        }
+        c->mapped = (CacheRecord *)((char *)map + sizeof(h));
+    }
+    return 1;
+}
+
+HashCache *cache_open(const char *path, int rebuild) {
+    HashCache *c = (HashCache *)calloc(1, sizeof(HashCache));
+    c->fd = -1;
+    c->path = strdup(path);
+    c->started = time(NULL);
+    pthread_rwlock_init(&c->lock, NULL);
+
+    // Replace rather than truncate, so other processes keep a valid mapping.
+    if (rebuild) {
+        unlink(path);
+    }
+
+    if (!cache_open_file(c)) {
+        fprintf(stderr, "Cannot open hash cache %s, continuing without it\n", path);
+        if (c->fd != -1) close(c->fd);
+        free(c->path);
+        free(c);
+        return NULL;
+    }
+
+    c->index_mask = 1023;
+    c->index = (uint32_t *)calloc(c->index_mask + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < c->mapped_count; i++) {
+        cache_index_put(c, (uint32_t)i);
+    }
+    return c;
+}
+
+int cache_lookup(HashCache *c, const struct stat *st, unsigned char *digest) {
+    int found = 0;
+    uint32_t algo = cache_algo(st);
+    pthread_rwlock_rdlock(&c->lock);
+    size_t s = cache_slot(c, (uint64_t)st->st_dev, (uint64_t)st->st_ino, algo);
+    while (c->index[s]) {
+        const CacheRecord *r = cache_record(c, c->index[s] - 1);
+        if (r->dev == (uint64_t)st->st_dev && r->ino == (uint64_t)st->st_ino && r->algo == algo) {
+            if (cache_record_matches(r, st)) {
+                memcpy(digest, r->digest, hash_engine->digest_len);
+                found = 1;
+            }
+            break;
+        }
+        s = (s + 1) & c->index_mask;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    atomic_fetch_add(found ? &c->hits : &c->misses, 1);
+    return found;
+}
+
+// Appends unflushed records under the file lock. If another process has
+// compacted or rebuilt the cache meanwhile, the records go to the new file.
+static void cache_flush_locked(HashCache *c) {
+    if (c->flushed == c->added_count) {
+        return;
+    }
+    int locked = 0;
+    for (int attempt = 0; attempt < 3; attempt++) {
+        struct stat cur, ours;
+        flock(c->fd, LOCK_EX);
+        if (stat(c->path, &cur) == -1 || fstat(c->fd, &ours) == -1 ||
+            (cur.st_dev == ours.st_dev && cur.st_ino == ours.st_ino)) {
+            locked = 1;
+            break;
+        }
+        flock(c->fd, LOCK_UN);
+        int fd = open(c->path, O_RDWR | O_CLOEXEC);
+        if (fd != -1) {
+            dup2(fd, c->fd);
+            close(fd);
+        }
+    }
+    // Still being replaced by a compactor: keep the records for the next flush
+    // rather than append without the lock.
+    if (!locked) {
+        return;
+    }
+
+    off_t end = lseek(c->fd, 0, SEEK_END);
+    off_t whole = end < (off_t)sizeof(CacheHeader) ? end :
+                  end - (end - (off_t)sizeof(CacheHeader)) % (off_t)sizeof(CacheRecord);
+    size_t bytes = (c->added_count - c->flushed) * sizeof(CacheRecord);
+    if (whole >= (off_t)sizeof(CacheHeader) &&
+        pwrite(c->fd, &c->added[c->flushed], bytes, whole) == (ssize_t)bytes) {
+        c->flushed = c->added_count;
+    }
+    flock(c->fd, LOCK_UN);
+}
+
+void cache_store(HashCache *c, const struct stat *st, const unsigned char *digest) {
+    // Skip files changed so recently that a later write could keep the same
+    // timestamps on filesystems with coarse time granularity.
+    if (st->st_mtim.tv_sec >= c->started - CACHE_RACY_SECONDS ||
+        st->st_ctim.tv_sec >= c->started - CACHE_RACY_SECONDS) {
+        return;
+    }
+
+    CacheRecord r;
+    memset(&r, 0, sizeof(r));
+    r.dev = (uint64_t)st->st_dev;
+    r.ino = (uint64_t)st->st_ino;
+    r.size = (uint64_t)st->st_size;
+    r.mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    r.mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+    r.ctime_sec = (int64_t)st->st_ctim.tv_sec;
+    r.ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+    r.algo = cache_algo(st);
+    memcpy(r.digest, digest, hash_engine->digest_len);
+
+    pthread_rwlock_wrlock(&c->lock);
+    if (c->added_count == c->added_capacity) {
+        c->added_capacity = c->added_capacity ? c->added_capacity * 2 : 1024;
+        c->added = (CacheRecord *)realloc(c->added, c->added_capacity * sizeof(CacheRecord));
+    }
+    c->added[c->added_count] = r;
+    cache_index_put(c, (uint32_t)(c->mapped_count + c->added_count));
+    c->added_count++;
+    if (c->added_count - c->flushed >= CACHE_FLUSH_EVERY) {
+        cache_flush_locked(c);
+    }
+    pthread_rwlock_unlock(&c->lock);
+}
+
+// Rewrites the file with only the newest record per inode. Runs under the
+// file lock on the file as it is now, including other processes' appends.
+static void cache_compact(HashCache *c) {
+    flock(c->fd, LOCK_EX);
+    struct stat st, cur;
+    if (fstat(c->fd, &st) == -1 || st.st_size <= (off_t)sizeof(CacheHeader) ||
+        stat(c->path, &cur) == -1 || cur.st_dev != st.st_dev || cur.st_ino != st.st_ino) {
+        flock(c->fd, LOCK_UN);
+        return;
+    }
+    size_t len = (size_t)st.st_size;
+    size_t count = (len - sizeof(CacheHeader)) / sizeof(CacheRecord);
+    char *map = (char *)mmap(NULL, len, PROT_READ, MAP_SHARED, c->fd, 0);
+    if (map == MAP_FAILED) {
+        flock(c->fd, LOCK_UN);
+        return;
+    }
+
+    HashCache tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.mapped = (CacheRecord *)(map + sizeof(CacheHeader));
+    tmp.mapped_count = count;
+    tmp.index_mask = 1023;
+    tmp.index = (uint32_t *)calloc(tmp.index_mask + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        cache_index_put(&tmp, (uint32_t)i);
+    }
+
+    size_t tmp_len = strlen(c->path) + 32;
+    char *tmp_path = (char *)malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.%d.tmp", c->path, (int)getpid());
+    FILE *out = fopen(tmp_path, "wb");
+    int ok = out != NULL && fwrite(map, sizeof(CacheHeader), 1, out) == 1;
+    for (size_t s = 0; ok && s <= tmp.index_mask; s++) {
+        if (tmp.index[s]) {
+            ok = fwrite(&tmp.mapped[tmp.index[s] - 1], sizeof(CacheRecord), 1, out) == 1;
+        }
+    }
+    if (out != NULL && fclose(out) != 0) ok = 0;
+    if (!ok || rename(tmp_path, c->path) != 0) {
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(tmp.index);
+    munmap(map, len);
+    flock(c->fd, LOCK_UN);
+}
+
+void cache_close(HashCache *c) {
+    pthread_rwlock_wrlock(&c->lock);
+    cache_flush_locked(c);
+    pthread_rwlock_unlock(&c->lock);
+
+    size_t records = c->mapped_count + c->added_count;
+    if (records > 1024 && records > 2 * c->index_used) {
+        cache_compact(c);
+    }
+
+    if (c->mapped) munmap((char *)c->mapped - sizeof(CacheHeader), c->map_len);
+    close(c->fd);
+    pthread_rwlock_destroy(&c->lock);
+    free(c->added);
+    free(c->index);
+    free(c->path);
+    free(c);
+}
+
+// $XDG_CACHE_HOME/md5hash/cache.db, falling back to ~/.cache.
+static char *cache_default_path(void) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    char dir[MAX_PATH];
+    if (base != NULL && base[0] != '\0') {
+        mkdir(base, 0755);
+        snprintf(dir, sizeof(dir), "%s/md5hash", base);
+    } else if ((base = getenv("HOME")) != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache", base);
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/md5hash", base);
+    } else {
+        return NULL;
+    }
+    mkdir(dir, 0755);
+    size_t len = strlen(dir) + sizeof("/cache.db");
+    char *path = (char *)malloc(len);
+    snprintf(path, len, "%s/cache.db", dir);
+    return path;
+}
+
+// Digest of a whole file, answered from the cache when possible. Returns 0
+// if the file cannot be opened.
+int hash_file(const char *filepath, unsigned char *buf, size_t buf_size, unsigned char *digest) {
+    FileReader r;
+    if (!reader_open(&r, filepath, buf, buf_size)) {
+        return 0;
+    }
+    
+    if (cache == NULL || !cache_lookup(cache, &r.st, digest)) {
+        ssize_t bytes;
+        if (tree_splits(r.st.st_size)) {
+            bytes = tree_hash(filepath, r.st.st_size, buf, buf_size, digest);
+        } else {
+            HashCtx ctx;
+            hash_engine->init(&ctx);
+
+            const unsigned char *data;
+            while ((bytes = reader_next(&r, &data)) > 0) {
+                hash_update(&ctx, data, (size_t)bytes);
+            }
+            hash_engine->final(&ctx, digest);
+        }
+        if (cache != NULL && bytes == 0) {
+            cache_store(cache, &r.st, digest);
+        }
+    }
+    
+    reader_close(&r);
+    return 1;
+}
+
+typedef struct {
+    MD5_CTX ctx;
+    FileReader r;
+    FileTask task;
+    unsigned char *buf;
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    int failed;
+    int active;
+} MD5Lane;
+
+// Output. Every thread formats results into its own buffer and writes it out
+// in OUT_BUF_SIZE chunks, so output_lock is taken once per chunk rather than
+// once per file. With --sorted the threads keep records instead and
+// output_finish merges them by path.
+#define OUT_BUF_SIZE (64 * 1024)
+#define OUT_BIN_MAGIC "MD5HBIN1"
+
+enum {
+    OUT_TEXT,
+    OUT_NUL,
+    OUT_BIN
+};
+
+int out_format = OUT_TEXT;
+int out_sorted = 0;
+
+typedef struct {
+    char *path;
+    unsigned char digest[HASH_MAX_DIGEST];
+} OutRecord;
+
+typedef struct OutBuf {
+    char data[OUT_BUF_SIZE];
+    size_t len;
+    OutRecord *records;
+    size_t count;
+    size_t capacity;
+    struct OutBuf *next;
+} OutBuf;
+
+static __thread OutBuf *out_local = NULL;
+static OutBuf *out_buffers = NULL;
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static void format_hex(const unsigned char *digest, int len, char *out) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (int i = 0; i < len; i++) {
+        out[i * 2] = hex[digest[i] >> 4];
+        out[i * 2 + 1] = hex[digest[i] & 0x0f];
+    }
+    out[len * 2] = '\0';
+}
+
+static void out_flush(OutBuf *b) {
+    if (b->len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&output_lock);
+    write_all(STDOUT_FILENO, b->data, b->len);
+    pthread_mutex_unlock(&output_lock);
+    b->len = 0;
+}
+
+// Text and NUL records are "path HEX" ended by '\n' or '\0'; binary records
+// are a little-endian u16 path length, a u8 digest length, the path and the
+// raw digest.
+static void out_append(OutBuf *b, const char *path, const unsigned char *digest) {
+    size_t plen = strlen(path);
+    int dlen = hash_engine->digest_len;
+    size_t need = plen + 3 + 2 * HASH_MAX_DIGEST;
+    if (b->len + need > OUT_BUF_SIZE) {
+        out_flush(b);
+    }
+    char *p = b->data + b->len;
+    if (out_format == OUT_BIN) {
+        p[0] = (char)(plen & 0xff);
+        p[1] = (char)(plen >> 8);
+        p[2] = (char)dlen;
+        memcpy(p + 3, path, plen);
+        memcpy(p + 3 + plen, digest, dlen);
+        b->len += 3 + plen + dlen;
+    } else {
+        memcpy(p, path, plen);
+        p[plen] = ' ';
+        format_hex(digest, dlen, p + plen + 1);
+        p[plen + 1 + 2 * dlen] = out_format == OUT_NUL ? '\0' : '\n';
+        b->len += plen + 2 + 2 * dlen;
+    }
+}
+
+static OutBuf *out_thread_buffer(void) {
+    if (out_local == NULL) {
+        out_local = (OutBuf *)calloc(1, sizeof(OutBuf));
+        pthread_mutex_lock(&output_lock);
+        out_local->next = out_buffers;
+        out_buffers = out_local;
+        pthread_mutex_unlock(&output_lock);
+    }
+    return out_local;
+}
+
+// Writes out the calling thread's pending lines. --watch installs it as the
+// queue's idle hook so that results show up as soon as a burst is hashed.
+static void out_flush_local(void) {
+    if (out_local != NULL) {
+        out_flush(out_local);
+    }
+}
+
+static void print_digest(const char *path, const unsigned char *digest) {
+    OutBuf *b = out_thread_buffer();
+    if (!out_sorted) {
+        out_append(b, path, digest);
+        return;
+    }
+    if (b->count == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 1024;
+        b->records = (OutRecord *)realloc(b->records, b->capacity * sizeof(OutRecord));
+    }
+    b->records[b->count].path = strdup(path);
+    memcpy(b->records[b->count].digest, digest, hash_engine->digest_len);
+    b->count++;
+}
+
+// Appends a preformatted line to the calling thread's output.
+static void print_line(const char *line, size_t len) {
+    OutBuf *b = out_thread_buffer();
+    if (b->len + len > OUT_BUF_SIZE) {
+        out_flush(b);
+    }
+    memcpy(b->data + b->len, line, len);
+    b->len += len;
+}
+
+static void serve_result(const FileTask *task, const unsigned char *digest);
+static void check_result(const FileTask *task, const unsigned char *digest);
+
+// Set by -c --fail-fast at the first mismatch. From then on check tasks are
+// dropped unhashed and main reports the failure once the pool has drained.
+static atomic_int check_stop;
+
+static int task_cancelled(FileTask *task) {
+    if (task_owner_kind(task) != OWNER_CHECK || !atomic_load_explicit(&check_stop, memory_order_relaxed)) {
+        return 0;
+    }
+    task_release(task);
+    return 1;
+}
+
+// Sends a finished task's digest to whoever asked for it: the connection of
+// a --serve request, the -c verifier, or the output.
+static void deliver_digest(const FileTask *task, const unsigned char *digest) {
+    counter_add(&stats_self()->files, 1);
+    int kind = task_owner_kind(task);
+    if (kind == OWNER_REQUEST) {
+        serve_result(task, digest);
+    } else if (kind == OWNER_CHECK) {
+        check_result(task, digest);
+    } else {
+        print_digest(task->path, digest);
+    }
+}
+
+static int cmp_out_record(const void *a, const void *b) {
+    return strcmp(((const OutRecord *)a)->path, ((const OutRecord *)b)->path);
+}
+
+void output_start(void) {
+    if (out_format == OUT_BIN) {
+        write_all(STDOUT_FILENO, OUT_BIN_MAGIC, 8);
+    }
+}
+
+// Writes out whatever the threads still hold; call after they have exited.
+// In sorted mode each thread's records are sorted and then k-way merged.
+void output_finish(void) {
+    int nbufs = 0;
+    for (OutBuf *b = out_buffers; b != NULL; b = b->next) {
+        out_flush(b);
+        qsort(b->records, b->count, sizeof(OutRecord), cmp_out_record);
+        nbufs++;
+    }
+
+    if (out_sorted && nbufs > 0) {
+        OutBuf **heads = (OutBuf **)malloc(sizeof(OutBuf *) * nbufs);
+        size_t *pos = (size_t *)calloc(nbufs, sizeof(size_t));
+        int n = 0;
+        for (OutBuf *b = out_buffers; b != NULL; b = b->next) {
+            heads[n++] = b;
+        }
+        OutBuf *w = out_thread_buffer();
+        for (;;) {
+            int best = -1;
+            for (int i = 0; i < nbufs; i++) {
+                if (pos[i] == heads[i]->count) continue;
+                if (best == -1 || strcmp(heads[i]->records[pos[i]].path,
+                                         heads[best]->records[pos[best]].path) < 0) {
+                    best = i;
+                }
+            }
+            if (best == -1) break;
+            OutRecord *r = &heads[best]->records[pos[best]++];
+            out_append(w, r->path, r->digest);
+            free(r->path);
+        }
+        out_flush(w);
+        free(heads);
+        free(pos);
+    }
+
+    while (out_buffers != NULL) {
+        OutBuf *b = out_buffers;
+        out_buffers = b->next;
+        free(b->records);
+        free(b);
+    }
+    out_local = NULL;
+}
+
+// Small-file batches. Walkers pack the regular files of a directory into one
+// task, so a file costs no queue slot and no path copy. A worker opens the
+// directory once and reads each file of up to small_max bytes with a single
+// openat/fstat/read/close into its own buffer, and hashes up to one file per
+// MD5 vector lane at a time. Larger files go back on the queue as ordinary
+// tasks.
+#define SMALL_BATCH 64
+#define SMALL_BATCH_BYTES 8192
+
+size_t small_max = 16u << 10;
+
+typedef struct {
+    TaskOwner base;
+    int count;
+    size_t used;
+    uint16_t name_off[SMALL_BATCH];
+    char data[SMALL_BATCH_BYTES];
+} SmallBatch;
+
+typedef struct {
+    const char *name;
+    unsigned char *data;
+    size_t len;
+    struct stat st;
+} SmallFile;
+
+// Returns 1 once f->data holds the file, 0 if it cannot be read, and -1 if
+// it is larger than small_max.
+static int small_read(int dirfd, SmallFile *f) {
+    int fd = openat(dirfd, f->name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    if (fstat(fd, &f->st) == -1) {
+        close(fd);
+        return 0;
+    }
+    if (f->st.st_size > (off_t)small_max) {
+        close(fd);
+        return -1;
+    }
+    // Some special files claim size 0 yet have contents; they get one read.
+    size_t want = f->st.st_size > 0 ? (size_t)f->st.st_size : small_max;
+    uint64_t start = now_ns();
+    f->len = 0;
+    while (f->len < want) {
+        ssize_t n = read(fd, f->data + f->len, want - f->len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        f->len += (size_t)n;
+        if (f->st.st_size == 0) break;
+    }
+    stats_read(now_ns() - start);
+    if (io_drop_cache) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+    return f->st.st_size == 0 && f->len == small_max ? -1 : 1;
+}
+
+static void small_deliver(const char *dir, const char *name, const unsigned char *digest) {
+    // Walkers only batch names whose full path fits.
+    char path[MAX_PATH];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+        return;
+    }
+    FileTask task = {path, NULL, NULL};
+    deliver_digest(&task, digest);
+}
+
+// Hashes n files held in memory: side by side in the vector lanes for as
+// many whole blocks as they share, and the tails through the scalar path.
+static void small_hash_group(const char *dir, SmallFile *files, int n) {
+    unsigned char digest[MB_MAX_LANES][HASH_MAX_DIGEST];
+    uint64_t start = now_ns();
+    size_t bytes = 0;
+    if (n >= 2 && hash_engine == &hash_engines[0] && md5_kernel->lanes > 1) {
+        MD5_CTX ctx[MB_MAX_LANES];
+        size_t pos[MB_MAX_LANES];
+        for (int i = 0; i < n; i++) {
+            md5_init(&ctx[i]);
+            pos[i] = 0;
+        }
+        for (;;) {
+            MD5_CTX *lane_ctx[MB_MAX_LANES];
+            const unsigned char *data[MB_MAX_LANES];
+            int lane_file[MB_MAX_LANES];
+            int m = 0;
+            size_t nblocks = 0;
+            for (int i = 0; i < n; i++) {
+                size_t avail = (files[i].len - pos[i]) / 64;
+                if (avail == 0) continue;
+                if (m == 0 || avail < nblocks) nblocks = avail;
+                lane_ctx[m] = &ctx[i];
+                data[m] = files[i].data + pos[i];
+                lane_file[m++] = i;
+            }
+            if (m < 2) break;
+            md5_mb_update(md5_kernel, lane_ctx, data, m, nblocks);
+            for (int j = 0; j < m; j++) {
+                pos[lane_file[j]] += nblocks * 64;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            md5_update(&ctx[i], files[i].data + pos[i], (unsigned int)(files[i].len - pos[i]));
+            md5_final(digest[i], &ctx[i]);
+            bytes += files[i].len;
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            HashCtx ctx;
+            hash_engine->init(&ctx);
+            hash_engine->update(&ctx, files[i].data, files[i].len);
+            hash_engine->final(&ctx, digest[i]);
+            bytes += files[i].len;
+        }
+    }
+    stats_hashed(now_ns() - start, bytes);
+
+    for (int i = 0; i < n; i++) {
+        if (cache != NULL) {
+            cache_store(cache, &files[i].st, digest[i]);
+        }
+        small_deliver(dir, files[i].name, digest[i]);
+    }
+}
+
+// Hashes every file of a batch task and frees it. buf is the worker's read
+// buffer, carved into small_max slots.
+static void small_batch_hash(const FileTask *task, unsigned char *buf, size_t buf_size) {
+    SmallBatch *b = (SmallBatch *)task->owner;
+    const char *dir = b->data;
+    int slots = (int)(buf_size / small_max);
+    int lanes = hash_engine == &hash_engines[0] ? md5_kernel->lanes : 1;
+    if (slots > lanes) slots = lanes;
+
+    SmallFile group[MB_MAX_LANES];
+    FileTask spill[SMALL_BATCH];
+    int n = 0, nspill = 0;
+    int dirfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    for (int i = 0; i < b->count; i++) {
+        SmallFile *f = &group[n];
+        f->name = b->data + b->name_off[i];
+        f->data = buf + (size_t)n * small_max;
+        int got = dirfd == -1 ? 0 : small_read(dirfd, f);
+        unsigned char digest[HASH_MAX_DIGEST];
+        if (got < 0) {
+            char path[MAX_PATH];
+            if (snprintf(path, sizeof(path), "%s/%s", dir, f->name) < (int)sizeof(path)) {
+                spill[nspill++] = path_store(path);
+            }
+        } else if (got == 0) {
+            memset(digest, 0, sizeof(digest));
+            small_deliver(dir, f->name, digest);
+        } else if (cache != NULL && cache_lookup(cache, &f->st, digest)) {
+            small_deliver(dir, f->name, digest);
+        } else if (++n == slots) {
+            small_hash_group(dir, group, n);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        small_hash_group(dir, group, n);
+    }
+    if (dirfd != -1) {
+        close(dirfd);
+    }
+
+    // The caller keeps dequeuing, so nothing spilled is stranded; whatever
+    // does not fit in the ring is hashed here.
+    if (nspill > 0) {
+        size_t put = queue_try_enqueue_tasks(queue, spill, (size_t)nspill);
+        for (int i = (int)put; i < nspill; i++) {
+            unsigned char digest[HASH_MAX_DIGEST];
+            if (!hash_file(spill[i].path, buf, buf_size, digest)) {
+                memset(digest, 0, sizeof(digest));
+            }
+            deliver_digest(&spill[i], digest);
+            task_release(&spill[i]);
+        }
+        path_store_flush();
+    }
+    free(b);
+}
+
+static int lane_open(MD5Lane *lane, int block) {
+    FileTask task;
+    while (block ? queue_dequeue(queue, &task) : queue_try_dequeue(queue, &task)) {
+        if (task_cancelled(&task)) continue;
+        if (task_owner_kind(&task) == OWNER_TREE) {
+            tree_help(&task, lane->buf, io_block_size);
+            continue;
+        }
+        if (task_owner_kind(&task) == OWNER_BATCH) {
+            small_batch_hash(&task, lane->buf, io_block_size);
+            continue;
+        }
+        if (!reader_open(&lane->r, task.path, lane->buf, io_block_size)) {
+            static const unsigned char zero[HASH_MAX_DIGEST];
+            deliver_digest(&task, zero);
+            task_release(&task);
+            continue;
+        }
+        unsigned char digest[HASH_MAX_DIGEST];
+        if (cache != NULL && cache_lookup(cache, &lane->r.st, digest)) {
+            reader_close(&lane->r);
+            deliver_digest(&task, digest);
+            task_release(&task);
+            continue;
+        }
+        if (tree_splits(lane->r.st.st_size)) {
+            reader_close(&lane->r);
+            if (!hash_file(task.path, lane->buf, io_block_size, digest)) {
+                memset(digest, 0, sizeof(digest));
+            }
+            deliver_digest(&task, digest);
+            task_release(&task);
+            continue;
+        }
+        lane->task = task;
+        lane->failed = 0;
+        md5_init(&lane->ctx);
+        lane->len = lane->pos = 0;
+        lane->active = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static void lane_finish(MD5Lane *lane) {
+    unsigned char digest[HASH_MAX_DIGEST];
+    reader_close(&lane->r);
+    md5_final(digest, &lane->ctx);
+    if (cache != NULL && !lane->failed) {
+        cache_store(cache, &lane->r.st, digest);
+    }
+    deliver_digest(&lane->task, digest);
+    task_release(&lane->task);
+    lane->active = 0;
+}
+
+// Keeps up to k->lanes files open and hashes their blocks side by side. Lanes
+// that run dry are refilled from the queue without waiting while others still
+// have data, so the vector stays as full as the queue allows.
+static void md5_mb_worker(const MD5Kernel *k) {
+    MD5Lane *lanes = (MD5Lane *)calloc(k->lanes, sizeof(MD5Lane));
+    for (int l = 0; l < k->lanes; l++) {
+        lanes[l].buf = io_buffer_alloc(io_block_size);
+    }
+
+    for (;;) {
+        int active = 0;
+        for (int l = 0; l < k->lanes; l++) {
+            if (lanes[l].active) active++;
+        }
+        for (int l = 0; l < k->lanes; l++) {
+            if (!lanes[l].active && lane_open(&lanes[l], active == 0)) active++;
+        }
+        if (active == 0) break;
+
+        MD5_CTX *ctx[MB_MAX_LANES];
+        const unsigned char *data[MB_MAX_LANES];
+        int ready[MB_MAX_LANES];
+        int n = 0;
+        size_t nblocks = 0;
+
+        for (int l = 0; l < k->lanes; l++) {
+            MD5Lane *lane = &lanes[l];
+            if (!lane->active) continue;
+            if (lane->pos == lane->len) {
+                ssize_t got = reader_next(&lane->r, &lane->data);
+                lane->len = got > 0 ? (size_t)got : 0;
+                lane->failed = got < 0;
+                lane->pos = 0;
+                if (lane->len == 0) {
+                    lane_finish(lane);
+                    continue;
+                }
+            }
+            size_t avail = (lane->len - lane->pos) / 64;
+            if (avail > 0 && lane->ctx.count[0] / 8 % 64 == 0) {
+                if (n == 0 || avail < nblocks) nblocks = avail;
+                ready[n] = l;
+                ctx[n] = &lane->ctx;
+                data[n] = lane->data + lane->pos;
+                n++;
+            }
+        }
+
+        int vectored[MB_MAX_LANES] = {0};
+        if (n >= 2) {
+            uint64_t start = now_ns();
+            md5_mb_update(k, ctx, data, n, nblocks);
+            stats_hashed(now_ns() - start, (size_t)n * nblocks * 64);
+            for (int i = 0; i < n; i++) {
+                lanes[ready[i]].pos += nblocks * 64;
+                vectored[ready[i]] = 1;
+            }
+        }
+
+        // Lanes left out of the vector pass (tails, or a single ready lane)
+        // drain their buffers through the scalar path.
+        for (int l = 0; l < k->lanes; l++) {
+            MD5Lane *lane = &lanes[l];
+            if (!lane->active || vectored[l] || lane->pos == lane->len) continue;
+            uint64_t start = now_ns();
+            md5_update(&lane->ctx, lane->data + lane->pos, (unsigned int)(lane->len - lane->pos));
+            stats_hashed(now_ns() - start, lane->len - lane->pos);
+            lane->pos = lane->len;
+        }
+    }
+
+    for (int l = 0; l < k->lanes; l++) {
+        free(lanes[l].buf);
+    }
+    free(lanes);
+}
+
+static const char *md5_test_vectors[][2] = {
+    {"", "d41d8cd98f00b204e9800998ecf8427e"},
+    {"a", "0cc175b9c0f1b6a831c399e269772661"},
+    {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+    {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+    {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+    {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+     "d174ab98d277d9f5a5611c2c9f419d9f"},
+    {"12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+     "57edf4a22be3c955ac49da2e2107b67a"},
+};
+#define MD5_TEST_COUNT ((int)(sizeof(md5_test_vectors) / sizeof(md5_test_vectors[0])))
+
+static void digest_to_hex(const unsigned char *digest, int len, char *out) {
+    for (int i = 0; i < len; i++) {
+        sprintf(out + (i * 2), "%02x", (unsigned int)digest[i]);
+    }
+    out[len * 2] = '\0';
+}
+
+// Checks the scalar path against RFC 1321 and every supported multi-buffer
+// kernel against the scalar path, with lanes of unequal length. Returns the
+// number of failures.
+static int md5_selftest(void) {
+    int failures = 0;
+    unsigned char digest[HASH_MAX_DIGEST];
+    char hex[2 * HASH_MAX_DIGEST + 1];
+
+    for (int i = 0; i < MD5_TEST_COUNT; i++) {
+        MD5_CTX ctx;
+        md5_init(&ctx);
+        md5_update(&ctx, (const unsigned char *)md5_test_vectors[i][0],
+                   (unsigned int)strlen(md5_test_vectors[i][0]));
+        md5_final(digest, &ctx);
+        digest_to_hex(digest, 16, hex);
+        if (strcmp(hex, md5_test_vectors[i][1]) != 0) {
+            fprintf(stderr, "scalar: MD5(\"%s\") = %s, expected %s\n",
+                    md5_test_vectors[i][0], hex, md5_test_vectors[i][1]);
+            failures++;
+        }
+    }
+    printf("scalar: %s\n", failures ? "FAILED" : "OK");
+
+    for (int ki = 1; ki < MD5_KERNEL_COUNT; ki++) {
+        const MD5Kernel *k = &md5_kernels[ki];
+        if (!md5_kernel_supported(k)) {
+            printf("%s: not supported by this CPU\n", k->name);
+            continue;
+        }
+
+        int kfail = 0;
+        unsigned char *msg[MB_MAX_LANES];
+        size_t len[MB_MAX_LANES];
+        MD5_CTX ctxs[MB_MAX_LANES];
+        MD5_CTX *ctx[MB_MAX_LANES];
+        const unsigned char *data[MB_MAX_LANES];
+        size_t nblocks = 0;
+
+        for (int l = 0; l < k->lanes; l++) {
+            const char *v = md5_test_vectors[1 + l % (MD5_TEST_COUNT - 1)][0];
+            size_t vlen = strlen(v);
+            int reps = 64 + l * 3;
+            len[l] = vlen * reps + l;
+            msg[l] = (unsigned char *)malloc(len[l] + 1);
+            for (int r = 0; r < reps; r++) memcpy(msg[l] + r * vlen, v, vlen);
+            memset(msg[l] + vlen * reps, 'x', l);
+            md5_init(&ctxs[l]);
+            ctx[l] = &ctxs[l];
+            data[l] = msg[l];
+            if (l == 0 || len[l] / 64 < nblocks) nblocks = len[l] / 64;
+        }
+
+        md5_mb_update(k, ctx, data, k->lanes, nblocks);
+
+        for (int l = 0; l < k->lanes; l++) {
+            char expect[2 * HASH_MAX_DIGEST + 1];
+            MD5_CTX ref;
+            md5_update(&ctxs[l], msg[l] + nblocks * 64, (unsigned int)(len[l] - nblocks * 64));
+            md5_final(digest, &ctxs[l]);
+            digest_to_hex(digest, 16, hex);
+            md5_init(&ref);
+            md5_update(&ref, msg[l], (unsigned int)len[l]);
+            md5_final(digest, &ref);
+            digest_to_hex(digest, 16, expect);
+            if (strcmp(hex, expect) != 0) {
+                fprintf(stderr, "%s: lane %d = %s, expected %s\n", k->name, l, hex, expect);
+                kfail++;
+            }
+            free(msg[l]);
+        }
+        printf("%s: %s\n", k->name, kfail ? "FAILED" : "OK");
+        failures += kfail;
+    }
+
+    return failures;
+}
+
+static const char *sha256_test_vectors[][2] = {
+    {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+     "f371bc4a311f2b009eef952dd83ca80e2b60026c8e935592d0f9c308453c813e"},
+};
+#define SHA256_TEST_COUNT ((int)(sizeof(sha256_test_vectors) / sizeof(sha256_test_vectors[0])))
+
+static const char *xxh64_test_vectors[][2] = {
+    {"", "ef46db3751d8e999"},
+    {"a", "d24ec4f1a98c6e5b"},
+    {"abc", "44bc2cf5ad770999"},
+    {"message digest", "066ed728fceeb3be"},
+    {"abcdefghijklmnopqrstuvwxyz", "cfe1f278fa89835c"},
+    {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", "aaa46907d3047814"},
+    {"12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+     "e04a477f19ee145d"},
+};
+#define XXH64_TEST_COUNT ((int)(sizeof(xxh64_test_vectors) / sizeof(xxh64_test_vectors[0])))
+
+// Runs vectors through e, once in a single update and once a byte at a time
+// so the partial-block paths are covered too.
+static int engine_selftest(const HashEngine *e, const char *label, const char *vectors[][2], int count) {
+    int failures = 0;
+    unsigned char digest[HASH_MAX_DIGEST];
+    char hex[2 * HASH_MAX_DIGEST + 1];
+
+    for (int i = 0; i < count; i++) {
+        const unsigned char *msg = (const unsigned char *)vectors[i][0];
+        size_t len = strlen(vectors[i][0]);
+        for (int bytewise = 0; bytewise < 2; bytewise++) {
+            HashCtx ctx;
+            e->init(&ctx);
+            if (bytewise) {
+                for (size_t j = 0; j < len; j++) e->update(&ctx, msg + j, 1);
+            } else {
+                e->update(&ctx, msg, len);
+            }
+            e->final(&ctx, digest);
+            digest_to_hex(digest, e->digest_len, hex);
+            if (strcmp(hex, vectors[i][1]) != 0) {
+                fprintf(stderr, "%s: %s(\"%s\") = %s, expected %s\n",
+                        label, e->name, vectors[i][0], hex, vectors[i][1]);
+                failures++;
+            }
+        }
+    }
+    printf("%s: %s\n", label, failures ? "FAILED" : "OK");
+    return failures;
+}
+
+int hash_selftest(void) {
+    int failures = md5_selftest();
+
+    sha256_blocks_fn chosen = sha256_blocks;
+    sha256_blocks = sha256_blocks_portable;
+    failures += engine_selftest(hash_engine_find("sha256"), "sha256",
+                                sha256_test_vectors, SHA256_TEST_COUNT);
+#if defined(__x86_64__) || defined(__i386__)
+    if (sha256_shani_supported()) {
+        sha256_blocks = sha256_blocks_shani;
+        failures += engine_selftest(hash_engine_find("sha256"), "sha256-ni",
+                                    sha256_test_vectors, SHA256_TEST_COUNT);
+    } else {
+        printf("sha256-ni: not supported by this CPU\n");
+    }
+#endif
+    sha256_blocks = chosen;
+
+    failures += engine_selftest(hash_engine_find("xxh64"), "xxh64", xxh64_test_vectors, XXH64_TEST_COUNT);
+    return failures == 0 ? 0 : 1;
+}
+
+// Asynchronous read pipeline (--io=uring): one I/O thread keeps up to
+// io_depth files with a read in flight and hands completed buffers to the
+// hash workers, which return the file for its next read when done. Each file
+// has at most one read outstanding, so its chunks are hashed in order.
+typedef struct FileJob {
+    HashCtx ctx;
+    FileTask task;
+    int fd;
+    off_t offset;
+    unsigned char *buf;
+    struct iovec iov;
+    ssize_t len;
+    struct stat st;
+    int cacheable;
+    uint64_t issued;
+    struct FileJob *next;
+} FileJob;
+
+typedef struct {
+    FileJob *head;
+    FileJob *tail;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} JobList;
+
+static void joblist_init(JobList *l) {
+    l->head = l->tail = NULL;
+    l->closed = 0;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->not_empty, NULL);
+}
+
+static void joblist_destroy(JobList *l) {
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->not_empty);
+}
+
+static void joblist_push(JobList *l, FileJob *job) {
+    pthread_mutex_lock(&l->lock);
+    job->next = NULL;
+    if (l->tail) l->tail->next = job;
+    else l->head = job;
+    l->tail = job;
+    pthread_cond_signal(&l->not_empty);
+    pthread_mutex_unlock(&l->lock);
+}
+
+// Pops one job; blocks while the list is empty and open. Returns NULL once
+// the list is closed and drained, or immediately when block is 0.
+static FileJob *joblist_pop(JobList *l, int block) {
+    pthread_mutex_lock(&l->lock);
+    while (block && l->head == NULL && !l->closed) {
+        pthread_cond_wait(&l->not_empty, &l->lock);
+    }
+    FileJob *job = l->head;
+    if (job) {
+        l->head = job->next;
+        if (l->head == NULL) l->tail = NULL;
+    }
+    pthread_mutex_unlock(&l->lock);
+    return job;
+}
+
+static void joblist_close(JobList *l) {
+    pthread_mutex_lock(&l->lock);
+    l->closed = 1;
+    pthread_cond_broadcast(&l->not_empty);
+    pthread_mutex_unlock(&l->lock);
+}
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned to_submit;
+} Uring;
+
+static int uring_init(Uring *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        return 0;
+    }
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        close(u->fd);
+        return 0;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            munmap(u->sq_ptr, u->sq_len);
+            close(u->fd);
+            return 0;
+        }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_len);
+        munmap(u->sq_ptr, u->sq_len);
+        close(u->fd);
+        return 0;
+    }
+
+    char *sq = (char *)u->sq_ptr;
+    char *cq = (char *)u->cq_ptr;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+static void uring_free(Uring *u) {
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_len);
+    munmap(u->sq_ptr, u->sq_len);
+    close(u->fd);
+}
+
+static struct io_uring_sqe *uring_get_sqe(Uring *u) {
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    return sqe;
+}
+
+static void uring_prep_readv(Uring *u, FileJob *job) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    job->iov.iov_base = job->buf;
+    job->iov.iov_len = io_block_size;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = job->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&job->iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t)job->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)job;
+}
+
+static void uring_prep_poll(Uring *u, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = 0;
+}
+
+static int uring_submit_and_wait(Uring *u) {
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, u->fd, u->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret >= 0) u->to_submit = 0;
+    return ret;
+}
+
+int io_depth = 32;
+
+static JobList hash_jobs;
+static JobList returned_jobs;
+static JobList read_jobs;
+static int io_wake_fd = -1;
+static pthread_t io_thread;
+static pthread_t *io_pool = NULL;
+static int io_pool_size = 0;
+int io_threads = 0;
+
+static void return_job(FileJob *job) {
+    joblist_push(&returned_jobs, job);
+    if (io_wake_fd != -1) {
+        uint64_t one = 1;
+        ssize_t ignored = write(io_wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+static void read_completed(FileJob *job) {
+    stats_read(now_ns() - job->issued);
+    if (job->len > 0) {
+        if (io_drop_cache) {
+            posix_fadvise(job->fd, job->offset, job->len, POSIX_FADV_DONTNEED);
+        }
+        job->offset += job->len;
+    }
+    joblist_push(&hash_jobs, job);
+}
+
+static void *io_pool_thread(void *arg) {
+    FileJob *job;
+    stats_register("reader", (int)(intptr_t)arg);
+    while ((job = joblist_pop(&read_jobs, 1)) != NULL) {
+        do {
+            job->len = pread(job->fd, job->buf, io_block_size, job->offset);
+        } while (job->len == -1 && errno == EINTR);
+        read_completed(job);
+    }
+    return NULL;
+}
+
+// Hands a job's next read to io_uring or to the reader threads.
+static void job_submit(Uring *u, FileJob *job) {
+    job->issued = now_ns();
+    if (u) uring_prep_readv(u, job);
+    else joblist_push(&read_jobs, job);
+}
+
+static void *io_thread_main(void *arg) {
+    Uring *u = (Uring *)arg;
+    stats_register("io", 0);
+    FileJob *jobs = (FileJob *)calloc(io_depth, sizeof(FileJob));
+    FileJob *free_jobs = NULL;
+    for (int i = 0; i < io_depth; i++) {
+        jobs[i].buf = io_buffer_alloc(io_block_size);
+        jobs[i].next = free_jobs;
+        free_jobs = &jobs[i];
+    }
+
+    int active = 0;
+    int tasks_done = 0;
+    if (u) uring_prep_poll(u, io_wake_fd);
+
+    for (;;) {
+        FileJob *job;
+        while ((job = joblist_pop(&returned_jobs, 0)) != NULL) {
+            if (job->len <= 0) {
+                close(job->fd);
+                task_release(&job->task);
+                job->next = free_jobs;
+                free_jobs = job;
+                active--;
+            } else {
+                job_submit(u, job);
+            }
+        }
+
+        while (!tasks_done && free_jobs != NULL) {
+            FileTask task;
+            if (!(active == 0 ? queue_dequeue(queue, &task) : queue_try_dequeue(queue, &task))) {
+                if (active == 0) tasks_done = 1;
+                break;
+            }
+            if (task_cancelled(&task)) continue;
+            int fd = open(task.path, O_RDONLY);
+            if (fd == -1) {
+                static const unsigned char zero[HASH_MAX_DIGEST];
+                deliver_digest(&task, zero);
+                task_release(&task);
+                continue;
+            }
+            job = free_jobs;
+            job->cacheable = cache != NULL && fstat(fd, &job->st) == 0;
+            unsigned char digest[HASH_MAX_DIGEST];
+            if (job->cacheable && cache_lookup(cache, &job->st, digest)) {
+                close(fd);
+                deliver_digest(&task, digest);
+                task_release(&task);
+                continue;
+            }
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            free_jobs = job->next;
+            job->task = task;
+            job->fd = fd;
+            job->offset = 0;
+            hash_engine->init(&job->ctx);
+            active++;
+            job_submit(u, job);
+        }
+
+        if (tasks_done && active == 0) break;
+
+        if (u) {
+            if (uring_submit_and_wait(u) < 0) {
+                perror("io_uring_enter");
+                exit(1);
+            }
+            unsigned head = *u->cq_head;
+            while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+                job = (FileJob *)(uintptr_t)cqe->user_data;
+                if (job == NULL) {
+                    uint64_t count;
+                    ssize_t ignored = read(io_wake_fd, &count, sizeof(count));
+                    (void)ignored;
+                    uring_prep_poll(u, io_wake_fd);
+                } else {
+                    job->len = cqe->res;
+                    read_completed(job);
+                }
+                head++;
+            }
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        } else {
+            pthread_mutex_lock(&returned_jobs.lock);
+            while (returned_jobs.head == NULL) {
+                pthread_cond_wait(&returned_jobs.not_empty, &returned_jobs.lock);
+            }
+            pthread_mutex_unlock(&returned_jobs.lock);
+        }
+    }
+
+    joblist_close(&hash_jobs);
+    joblist_close(&read_jobs);
+    for (int i = 0; i < io_depth; i++) {
+        free(jobs[i].buf);
+    }
+    free(jobs);
+    if (u) {
+        uring_free(u);
+        free(u);
+    }
+    return NULL;
+}
+
+static void async_hash_worker(void) {
+    FileJob *job;
+    for (;;) {
+        job = joblist_pop(&hash_jobs, 0);
+        if (job == NULL) {
+            if (queue_idle_hook != NULL) queue_idle_hook();
+            job = joblist_pop(&hash_jobs, 1);
+            if (job == NULL) break;
+        }
+        if (job->len > 0) {
+            hash_update(&job->ctx, job->buf, (size_t)job->len);
+        } else {
+            unsigned char digest[HASH_MAX_DIGEST];
+            hash_engine->final(&job->ctx, digest);
+            if (job->cacheable && job->len == 0) {
+                cache_store(cache, &job->st, digest);
+            }
+            deliver_digest(&job->task, digest);
+        }
+        return_job(job);
+    }
+}
+
+// Starts the I/O side of the pipeline on io_uring, or on io_depth blocking
+// reader threads for --io=threads and kernels without io_uring.
+int async_io_start(void) {
+    joblist_init(&hash_jobs);
+    joblist_init(&returned_jobs);
+    joblist_init(&read_jobs);
+
+    Uring *u = NULL;
+    if (io_backend == IO_URING) {
+        u = (Uring *)malloc(sizeof(Uring));
+        if (!uring_init(u, (unsigned)io_depth + 1)) {
+            free(u);
+            u = NULL;
+        } else if ((io_wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+            uring_free(u);
+            free(u);
+            u = NULL;
+        }
+        if (u == NULL) {
+            fprintf(stderr, "io_uring unavailable, falling back to reader threads\n");
+        }
+    }
+    if (u == NULL) {
+        io_pool_size = io_threads > 0 ? io_threads : io_depth;
+        io_pool = (pthread_t *)malloc(sizeof(pthread_t) * io_pool_size);
+        for (int i = 0; i < io_pool_size; i++) {
+            if (pthread_create(&io_pool[i], NULL, io_pool_thread, (void *)(intptr_t)i) != 0) {
+                fprintf(stderr, "Failed to create reader thread %d\n", i);
+                return 0;
+            }
+        }
+    }
+
+    if (pthread_create(&io_thread, NULL, io_thread_main, u) != 0) {
+        fprintf(stderr, "Failed to create I/O thread\n");
+        return 0;
+    }
+    return 1;
+}
+
+void async_io_stop(void) {
+    pthread_join(io_thread, NULL);
+    for (int i = 0; i < io_pool_size; i++) {
+        pthread_join(io_pool[i], NULL);
+    }
+    free(io_pool);
+    if (io_wake_fd != -1) close(io_wake_fd);
+    joblist_destroy(&hash_jobs);
+    joblist_destroy(&returned_jobs);
+    joblist_destroy(&read_jobs);
+}
+
+// Duplicate finder (--dupes): files are grouped by size, then by an MD5 of
+// their first and last DUPES_EDGE bytes, and only files that still collide
+// are hashed in full.
+#define DUPES_EDGE 4096
+
+typedef struct {
+    TaskOwner base;
+    char *path;
+    off_t size;
+    int stage;
+    int ok;
+    int full;
+    unsigned char partial[HASH_MAX_DIGEST];
+    unsigned char digest[HASH_MAX_DIGEST];
+} DupeEntry;
+
+typedef struct {
+    DupeEntry *items;
+    size_t count;
+    size_t capacity;
+} DupeList;
+
+int dupes_mode = 0;
+static DupeList dupe_files;
+
+static void dupe_list_add(DupeList *l, const char *path, off_t size) {
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity ? l->capacity * 2 : 256;
+        l->items = (DupeEntry *)realloc(l->items, l->capacity * sizeof(DupeEntry));
+    }
+    DupeEntry *e = &l->items[l->count++];
+    memset(e, 0, sizeof(*e));
+    e->base.kind = OWNER_DUPE;
+    e->path = strdup(path);
+    e->size = size;
+}
+
+// Parallel directory traversal. Every directory is a work item on the deque
+// of the thread that found it; owners pop newest-first (depth-first, few open
+// fds) and idle threads steal oldest-first from others. Entries are resolved
+// relative to the directory fd and d_type saves the stat for most of them.
+#define WALK_MAX_OPEN_FDS 512
+#define DENTS_BUF_SIZE (64 * 1024)
+
+// Chain of directories from a root down to the one being listed, shared by
+// all work items below it. Used to spot symlinks back into an ancestor
+// (e.g. /usr/bin/X11 -> .), which would otherwise recurse until the path
+// overflows.
+typedef struct DirNode {
+    dev_t dev;
+    ino_t ino;
+    struct DirNode *parent;
+    atomic_int refs;
+} DirNode;
+
+typedef struct {
+    int fd;
+    int via_link;
+    char *path;
+    DirNode *parent;
+} DirWork;
+
+typedef struct {
+    DirWork *items;
+    int head;
+    int tail;
+    int capacity;
+    long dirs;
+    long files;
+    FileTask pending[QUEUE_BATCH];
+    int npending;
+    SmallBatch *batch;
+    DupeList found;
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) WorkDeque;
+
+int walk_threads = 0;
+int walk_only = 0;
+int walk_use_getdents = 0;
+int walk_batch_small = 0;
+
+// --watch with inotify: walkers add a watch on every directory they list.
+static int watch_inotify = -1;
+static void watch_add(const char *path, int is_dir);
+
+static WorkDeque *walk_deques;
+static atomic_long walk_pending;
+static atomic_long walk_queued;
+static atomic_int walk_open_fds;
+static int walk_idle = 0;
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+
+static void dir_node_release(DirNode *n) {
+    while (n != NULL && atomic_fetch_sub(&n->refs, 1) == 1) {
+        DirNode *parent = n->parent;
+        free(n);
+        n = parent;
+    }
+}
+
+static void deque_push(WorkDeque *d, DirWork w) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->capacity) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head, sizeof(DirWork) * (d->tail - d->head));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->capacity = d->capacity ? d->capacity * 2 : 64;
+            d->items = (DirWork *)realloc(d->items, sizeof(DirWork) * d->capacity);
+        }
+    }
+    d->items[d->tail++] = w;
+    pthread_mutex_unlock(&d->lock);
+
+    atomic_fetch_add(&walk_pending, 1);
+    atomic_fetch_add(&walk_queued, 1);
+    pthread_mutex_lock(&walk_lock);
+    if (walk_idle > 0) {
+        pthread_cond_signal(&walk_cond);
+    }
+    pthread_mutex_unlock(&walk_lock);
+}
+
+static int deque_pop(WorkDeque *d, DirWork *w, int steal) {
+    int got = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *w = steal ? d->items[d->head++] : d->items[--d->tail];
+        if (d->head == d->tail) d->head = d->tail = 0;
+        got = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (got) atomic_fetch_sub(&walk_queued, 1);
+    return got;
+}
+
+static int walk_next(int self, DirWork *w) {
+    for (;;) {
+        if (deque_pop(&walk_deques[self], w, 0)) return 1;
+        for (int i = 1; i < walk_threads; i++) {
+            if (deque_pop(&walk_deques[(self + i) % walk_threads], w, 1)) return 1;
+        }
+
+        pthread_mutex_lock(&walk_lock);
+        walk_idle++;
+        while (atomic_load(&walk_queued) == 0 && atomic_load(&walk_pending) > 0) {
+            pthread_cond_wait(&walk_cond, &walk_lock);
+        }
+        walk_idle--;
+        int done = atomic_load(&walk_pending) == 0;
+        pthread_mutex_unlock(&walk_lock);
+        if (done) return 0;
+    }
+}
+
+static void walk_flush_files(WorkDeque *self) {
+    queue_enqueue_tasks(queue, self->pending, self->npending);
+    self->npending = 0;
+}
+
+// Files are handed to the queue in batches of up to QUEUE_BATCH per
+// directory, so a walker touches the shared ring once per batch.
+static void walk_emit_file(WorkDeque *self, const char *path, const struct stat *st) {
+    self->files++;
+    if (dupes_mode) {
+        dupe_list_add(&self->found, path, st->st_size);
+    } else if (!walk_only) {
+        self->pending[self->npending++] = path_store(path);
+        if (self->npending == QUEUE_BATCH) {
+            walk_flush_files(self);
+        }
+    }
+}
+
+// Adds a file of the directory being listed to its batch, which goes on
+// the queue when full and when the directory is done.
+static void walk_flush_batch(WorkDeque *self) {
+    SmallBatch *b = self->batch;
+    if (b == NULL) {
+        return;
+    }
+    FileTask task = {b->data, NULL, b};
+    self->pending[self->npending++] = task;
+    self->batch = NULL;
+    if (self->npending == QUEUE_BATCH) {
+        walk_flush_files(self);
+    }
+}
+
+static void walk_emit_small(WorkDeque *self, const char *dir_path, const char *name) {
+    size_t len = strlen(name) + 1;
+    SmallBatch *b = self->batch;
+    self->files++;
+    if (b != NULL && (b->count == SMALL_BATCH || b->used + len > SMALL_BATCH_BYTES)) {
+        walk_flush_batch(self);
+        b = NULL;
+    }
+    if (b == NULL) {
+        b = (SmallBatch *)malloc(sizeof(SmallBatch));
+        b->base.kind = OWNER_BATCH;
+        b->count = 0;
+        b->used = strlen(dir_path) + 1;
+        memcpy(b->data, dir_path, b->used);
+        self->batch = b;
+    }
+    b->name_off[b->count++] = (uint16_t)b->used;
+    memcpy(b->data + b->used, name, len);
+    b->used += len;
+}
+
+static void walk_entry(WorkDeque *self, int dirfd, DirNode *node, const char *dir_path,
+                       const char *name, unsigned char type) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return;
+    }
+
+    // Symlinks are followed, as stat() on the full path used to do.
+    int via_link = (type == DT_LNK);
+    struct stat st;
+    st.st_size = 0;
+    if (type == DT_UNKNOWN || type == DT_LNK || (dupes_mode && type == DT_REG)) {
+        if (fstatat(dirfd, name, &st, 0) == -1) {
+            return;
+        }
+        type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+    }
+    if (type != DT_REG && type != DT_DIR) {
+        return;
+    }
+
+    char full_path[MAX_PATH];
+    if (snprintf(full_path, MAX_PATH, "%s/%s", dir_path, name) >= MAX_PATH) {
+        return;
+    }
+
+    if (type == DT_REG) {
+        if (walk_batch_small) walk_emit_small(self, dir_path, name);
+        else walk_emit_file(self, full_path, &st);
+        return;
+    }
+
+    DirWork child = {-1, via_link, strdup(full_path), node};
+    atomic_fetch_add(&node->refs, 1);
+    if (atomic_fetch_add(&walk_open_fds, 1) < WALK_MAX_OPEN_FDS) {
+        child.fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (child.fd == -1) {
+        atomic_fetch_sub(&walk_open_fds, 1);
+    }
+    deque_push(self, child);
+}
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static void walk_directory(WorkDeque *self, DirWork *w, char *dents) {
+    int fd = w->fd;
+    if (fd == -1) {
+        fd = open(w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            dir_node_release(w->parent);
+            return;
+        }
+        atomic_fetch_add(&walk_open_fds, 1);
+    }
+
+    // Only a directory reached through a symlink can close a cycle.
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        st.st_dev = 0;
+        st.st_ino = 0;
+    }
+    for (DirNode *a = w->parent; w->via_link && a != NULL; a = a->parent) {
+        if (a->dev == st.st_dev && a->ino == st.st_ino) {
+            close(fd);
+            atomic_fetch_sub(&walk_open_fds, 1);
+            dir_node_release(w->parent);
+            return;
+        }
+    }
+
+    if (watch_inotify != -1) {
+        watch_add(w->path, 1);
+    }
+
+    DirNode *node = (DirNode *)malloc(sizeof(DirNode));
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+    node->parent = w->parent;
+    atomic_init(&node->refs, 1);
+    self->dirs++;
+
+    if (walk_use_getdents) {
+        long n;
+        while ((n = syscall(SYS_getdents64, fd, dents, DENTS_BUF_SIZE)) > 0) {
+            for (long off = 0; off < n;) {
+                struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+                walk_entry(self, fd, node, w->path, d->d_name, d->d_type);
+                off += d->d_reclen;
+            }
+        }
+        close(fd);
+    } else {
+        DIR *dir = fdopendir(fd);
+        if (dir == NULL) {
+            close(fd);
+        } else {
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL) {
+                walk_entry(self, fd, node, w->path, entry->d_name, entry->d_type);
+            }
+            closedir(dir);
+        }
+    }
+    atomic_fetch_sub(&walk_open_fds, 1);
+    dir_node_release(node);
+    walk_flush_batch(self);
+    walk_flush_files(self);
+}
+
+static void *walk_thread(void *arg) {
+    int self = (int)(intptr_t)arg;
+    stats_register("walk", self);
+    char *dents = walk_use_getdents ? (char *)malloc(DENTS_BUF_SIZE) : NULL;
+    DirWork w;
+
+    while (walk_next(self, &w)) {
+        walk_directory(&walk_deques[self], &w, dents);
+        free(w.path);
+        if (atomic_fetch_sub(&walk_pending, 1) == 1) {
+            pthread_mutex_lock(&walk_lock);
+            pthread_cond_broadcast(&walk_cond);
+            pthread_mutex_unlock(&walk_lock);
+        }
+    }
+
+    free(dents);
+    path_store_flush();
+    return NULL;
+}
+
+// Walks all roots with walk_threads threads and returns once every directory
+// below them has been listed. Regular files are handed to walk_emit_file.
+void walk_directories(char **roots, int count, long *dirs, long *files) {
+    walk_deques = (WorkDeque *)aligned_alloc(64, sizeof(WorkDeque) * walk_threads);
+    memset(walk_deques, 0, sizeof(WorkDeque) * walk_threads);
+    for (int i = 0; i < walk_threads; i++) {
+        pthread_mutex_init(&walk_deques[i].lock, NULL);
+    }
+    atomic_store(&walk_pending, 0);
+    atomic_store(&walk_queued, 0);
+    atomic_store(&walk_open_fds, 0);
+
+    for (int i = 0; i < count; i++) {
+        DirWork root = {-1, 0, strdup(roots[i]), NULL};
+        deque_push(&walk_deques[i % walk_threads], root);
+    }
+
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * walk_threads);
+    for (int i = 0; i < walk_threads; i++) {
+        if (pthread_create(&tids[i], NULL, walk_thread, (void *)(intptr_t)i) != 0) {
+            fprintf(stderr, "Failed to create walker thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < walk_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < walk_threads; i++) {
+        *dirs += walk_deques[i].dirs;
+        *files += walk_deques[i].files;
+        for (size_t f = 0; f < walk_deques[i].found.count; f++) {
+            DupeEntry *e = &walk_deques[i].found.items[f];
+            dupe_list_add(&dupe_files, e->path, e->size);
+            free(e->path);
+        }
+        free(walk_deques[i].found.items);
+        free(walk_deques[i].items);
+        pthread_mutex_destroy(&walk_deques[i].lock);
+    }
+    free(walk_deques);
+    free(tids);
+}
+
+static atomic_long dupes_pending;
+static pthread_mutex_t dupes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dupes_done = PTHREAD_COND_INITIALIZER;
+
+// Digest of the first and last DUPES_EDGE bytes. Files no larger than two
+// edges are read whole, so their partial digest is already the full one.
+static int hash_file_edges(DupeEntry *e, unsigned char *buf) {
+    int fd = open(e->path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    size_t len = 0;
+    if (e->size <= 2 * DUPES_EDGE) {
+        ssize_t n = pread(fd, buf, (size_t)e->size, 0);
+        len = n > 0 ? (size_t)n : 0;
+        e->full = 1;
+    } else {
+        ssize_t a = pread(fd, buf, DUPES_EDGE, 0);
+        ssize_t b = pread(fd, buf + DUPES_EDGE, DUPES_EDGE, e->size - DUPES_EDGE);
+        len = (a == DUPES_EDGE && b == DUPES_EDGE) ? 2 * DUPES_EDGE : 0;
+    }
+    close(fd);
+    if (len != (e->full ? (size_t)e->size : 2 * DUPES_EDGE)) {
+        return 0;
+    }
+
+    HashCtx ctx;
+    hash_engine->init(&ctx);
+    hash_engine->update(&ctx, buf, len);
+    hash_engine->final(&ctx, e->partial);
+    if (e->full) {
+        memcpy(e->digest, e->partial, hash_engine->digest_len);
+    }
+    return 1;
+}
+
+static void dupes_worker(void) {
+    // hash_file_edges reads both edges into buf at once, whatever --block-size.
+    size_t size = io_block_size > 2 * DUPES_EDGE ? io_block_size : 2 * DUPES_EDGE;
+    unsigned char *buf = io_buffer_alloc(size);
+    FileTask task;
+    while (queue_dequeue(queue, &task)) {
+        DupeEntry *e = (DupeEntry *)task.owner;
+        if (e->stage == 1) {
+            e->ok = hash_file_edges(e, buf);
+        } else {
+            e->ok = hash_file(e->path, buf, io_block_size, e->digest);
+        }
+        if (atomic_fetch_sub(&dupes_pending, 1) == 1) {
+            pthread_mutex_lock(&dupes_lock);
+            pthread_cond_signal(&dupes_done);
+            pthread_mutex_unlock(&dupes_lock);
+        }
+    }
+    free(buf);
+}
+
+// Runs one stage over the given entries on the worker pool and waits for it.
+static void dupes_run_stage(DupeEntry **items, size_t n, int stage) {
+    if (n == 0) {
+        return;
+    }
+    atomic_store(&dupes_pending, (long)n);
+    FileTask batch[QUEUE_BATCH];
+    int nbatch = 0;
+    for (size_t i = 0; i < n; i++) {
+        items[i]->stage = stage;
+        batch[nbatch].path = items[i]->path;
+        batch[nbatch].block = NULL;
+        batch[nbatch].owner = items[i];
+        if (++nbatch == QUEUE_BATCH || i + 1 == n) {
+            queue_enqueue_tasks(queue, batch, nbatch);
+            nbatch = 0;
+        }
+    }
+    pthread_mutex_lock(&dupes_lock);
+    while (atomic_load(&dupes_pending) > 0) {
+        pthread_cond_wait(&dupes_done, &dupes_lock);
+    }
+    pthread_mutex_unlock(&dupes_lock);
+}
+
+static int cmp_dupe_size(const void *a, const void *b) {
+    const DupeEntry *x = *(DupeEntry *const *)a, *y = *(DupeEntry *const *)b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+static int cmp_dupe_partial(const void *a, const void *b) {
+    const DupeEntry *x = *(DupeEntry *const *)a, *y = *(DupeEntry *const *)b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    int c = memcmp(x->partial, y->partial, hash_engine->digest_len);
+    return c ? c : strcmp(x->path, y->path);
+}
+
+static int cmp_dupe_digest(const void *a, const void *b) {
+    const DupeEntry *x = *(DupeEntry *const *)a, *y = *(DupeEntry *const *)b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    int c = memcmp(x->digest, y->digest, hash_engine->digest_len);
+    return c ? c : strcmp(x->path, y->path);
+}
+
+// Keeps only entries that share their sort key with a neighbour; items must
+// be sorted by that key. Returns the new count.
+static size_t keep_colliding(DupeEntry **items, size_t n, int (*same)(const DupeEntry *, const DupeEntry *)) {
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((i > 0 && same(items[i - 1], items[i])) || (i + 1 < n && same(items[i], items[i + 1]))) {
+            items[out++] = items[i];
+        }
+    }
+    return out;
+}
+
+static int same_size(const DupeEntry *a, const DupeEntry *b) {
+    return a->size == b->size;
+}
+
+static int same_partial(const DupeEntry *a, const DupeEntry *b) {
+    return a->size == b->size && memcmp(a->partial, b->partial, hash_engine->digest_len) == 0;
+}
+
+static int same_digest(const DupeEntry *a, const DupeEntry *b) {
+    return a->size == b->size && memcmp(a->digest, b->digest, hash_engine->digest_len) == 0;
+}
+
+// Drops entries whose stage failed (unreadable or vanished files).
+static size_t keep_ok(DupeEntry **items, size_t n) {
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (items[i]->ok) items[out++] = items[i];
+    }
+    return out;
+}
+
+void dupes_report(void) {
+    size_t n = dupe_files.count;
+    DupeEntry **items = (DupeEntry **)malloc(sizeof(DupeEntry *) * (n ? n : 1));
+    long long total_bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        items[i] = &dupe_files.items[i];
+        total_bytes += dupe_files.items[i].size;
+    }
+
+    qsort(items, n, sizeof(*items), cmp_dupe_size);
+    n = keep_colliding(items, n, same_size);
+    long long read_bytes = 0;
+
+    // Empty files need no reading at all.
+    unsigned char empty_digest[HASH_MAX_DIGEST];
+    HashCtx empty_ctx;
+    hash_engine->init(&empty_ctx);
+    hash_engine->final(&empty_ctx, empty_digest);
+
+    DupeEntry **work = (DupeEntry **)malloc(sizeof(DupeEntry *) * (n ? n : 1));
+    size_t nwork = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (items[i]->size == 0) {
+            items[i]->ok = items[i]->full = 1;
+            memcpy(items[i]->partial, empty_digest, hash_engine->digest_len);
+            memcpy(items[i]->digest, empty_digest, hash_engine->digest_len);
+        } else {
+            work[nwork++] = items[i];
+        }
+    }
+    dupes_run_stage(work, nwork, 1);
+    for (size_t i = 0; i < nwork; i++) {
+        read_bytes += work[i]->full ? work[i]->size : 2 * DUPES_EDGE;
+    }
+    n = keep_ok(items, n);
+    qsort(items, n, sizeof(*items), cmp_dupe_partial);
+    n = keep_colliding(items, n, same_partial);
+
+    nwork = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!items[i]->full) work[nwork++] = items[i];
+    }
+    dupes_run_stage(work, nwork, 2);
+    for (size_t i = 0; i < nwork; i++) {
+        read_bytes += work[i]->size;
+    }
+    free(work);
+    n = keep_ok(items, n);
+    qsort(items, n, sizeof(*items), cmp_dupe_digest);
+    n = keep_colliding(items, n, same_digest);
+
+    long groups = 0, extra = 0;
+    long long reclaimable = 0;
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && same_digest(items[i], items[j])) j++;
+        char hex[2 * HASH_MAX_DIGEST + 1];
+        format_hex(items[i]->digest, hash_engine->digest_len, hex);
+        printf("%s %lld bytes, %zu files\n", hex, (long long)items[i]->size, j - i);
+        for (size_t k = i; k < j; k++) {
+            printf("  %s\n", items[k]->path);
+        }
+        printf("\n");
+        groups++;
+        extra += (long)(j - i - 1);
+        reclaimable += (long long)items[i]->size * (long long)(j - i - 1);
+        i = j;
+    }
+
+    fprintf(stderr, "%ld duplicate groups, %ld redundant files, %lld bytes reclaimable; hashed %lld bytes for a tree of %lld bytes\n",
+            groups, extra, reclaimable, read_bytes, total_bytes);
+
+    free(items);
+    for (size_t i = 0; i < dupe_files.count; i++) {
+        free(dupe_files.items[i].path);
+    }
+    free(dupe_files.items);
+}
+
+void* worker_thread(void *arg) {
+    FileTask tasks[QUEUE_BATCH];
+
+    stats_register("hash", (int)(intptr_t)arg);
+    if (pin_threads) {
+        pin_self((int)(intptr_t)arg);
+    }
+
+    if (dupes_mode) {
+        dupes_worker();
+        pthread_exit(NULL);
+    }
+
+    if (io_backend == IO_URING || io_backend == IO_THREADS) {
+        async_hash_worker();
+        pthread_exit(NULL);
+    }
+
+    if (md5_kernel->lanes > 1 && hash_engine == &hash_engines[0]) {
+        md5_mb_worker(md5_kernel);
+        pthread_exit(NULL);
+    }
+
+    unsigned char *buf = io_buffer_alloc(io_block_size);
+    
+    // Take a fair share of the backlog at once, leaving work for the others.
+    int n;
+    for (;;) {
+        size_t share = queue_backlog(queue) / (2 * (size_t)num_threads);
+        n = queue_dequeue_batch(queue, tasks, share >= QUEUE_BATCH ? QUEUE_BATCH : (int)share + 1);
+        if (n == 0) break;
+        for (int t = 0; t < n; t++) {
+            if (task_cancelled(&tasks[t])) continue;
+            if (task_owner_kind(&tasks[t]) == OWNER_TREE) {
+                tree_help(&tasks[t], buf, io_block_size);
+                continue;
+            }
+            if (task_owner_kind(&tasks[t]) == OWNER_BATCH) {
+                small_batch_hash(&tasks[t], buf, io_block_size);
+                continue;
+            }
+            unsigned char digest[HASH_MAX_DIGEST];
+            if (!hash_file(tasks[t].path, buf, io_block_size, digest)) {
+                memset(digest, 0, sizeof(digest));
+            }
+            deliver_digest(&tasks[t], digest);
+            task_release(&tasks[t]);
+        }
+    }
+    
+    free(buf);
+    pthread_exit(NULL);
+}
+
+// --autotune: hashes a sample of the tree with 1, 2, 4, ... threads up to
+// the allowed CPU count and keeps the smallest count within 10% of the best
+// throughput. The sample is hashed once beforehand so that every timed pass
+// reads from the page cache and measures hashing, not the disk.
+#define AUTOTUNE_FILES 512
+#define AUTOTUNE_BYTES (256ll << 20)
+
+typedef struct {
+    char **paths;
+    int count;
+    long long bytes;
+    atomic_int next;
+} AutotuneSample;
+
+static void autotune_collect(AutotuneSample *s, const char *path, int depth) {
+    struct stat st;
+    if (s->count >= AUTOTUNE_FILES || s->bytes >= AUTOTUNE_BYTES || stat(path, &st) == -1) {
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        s->paths[s->count++] = strdup(path);
+        s->bytes += st.st_size;
+        return;
+    }
+    if (!S_ISDIR(st.st_mode) || depth > 16) {
+        return;
+    }
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *e;
+    char child[MAX_PATH];
+    while ((e = readdir(d)) != NULL && s->count < AUTOTUNE_FILES && s->bytes < AUTOTUNE_BYTES) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        autotune_collect(s, child, depth + 1);
+    }
+    closedir(d);
+}
+
+static void *autotune_thread(void *arg) {
+    AutotuneSample *s = (AutotuneSample *)arg;
+    stats_register("autotune", 0);
+    unsigned char *buf = io_buffer_alloc(io_block_size);
+    unsigned char digest[HASH_MAX_DIGEST];
+    int i;
+    while ((i = atomic_fetch_add(&s->next, 1)) < s->count) {
+        hash_file(s->paths[i], buf, io_block_size, digest);
+    }
+    free(buf);
+    return NULL;
+}
+
+static double autotune_pass(AutotuneSample *s, int nthreads) {
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+    struct timespec t0, t1;
+    atomic_store(&s->next, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&tids[i], NULL, autotune_thread, s);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(tids);
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return secs > 0 ? (double)s->bytes / secs : 0.0;
+}
+
+// Returns the chosen worker count, or 0 if the paths hold nothing to time.
+static int autotune_threads(char **paths, int count) {
+    AutotuneSample s;
+    memset(&s, 0, sizeof(s));
+    s.paths = (char **)malloc(sizeof(char *) * AUTOTUNE_FILES);
+    for (int i = 0; i < count; i++) {
+        autotune_collect(&s, paths[i], 0);
+    }
+
+    int best_threads = 0;
+    if (s.bytes > 0) {
+        HashCache *saved_cache = cache;
+        off_t saved_chunk = tree_chunk;
+        cache = NULL;
+        tree_chunk = 0;
+        autotune_pass(&s, allowed_cpu_count);
+
+        double rates[64];
+        int counts[64], n = 0;
+        double best = 0;
+        for (int t = 1;; t = t * 2 < allowed_cpu_count ? t * 2 : allowed_cpu_count) {
+            counts[n] = t;
+            rates[n] = autotune_pass(&s, t);
+            fprintf(stderr, "autotune: %d threads: %.0f MB/s\n", t, rates[n] / (1 << 20));
+            if (rates[n] > best) best = rates[n];
+            n++;
+            if (t == allowed_cpu_count) break;
+        }
+        for (int i = 0; i < n && best_threads == 0; i++) {
+            if (rates[i] >= 0.9 * best) best_threads = counts[i];
+        }
+        fprintf(stderr, "autotune: using %d threads (%d files, %lld bytes sampled)\n",
+                best_threads, s.count, s.bytes);
+        cache = saved_cache;
+        tree_chunk = saved_chunk;
+    }
+
+    for (int i = 0; i < s.count; i++) {
+        free(s.paths[i]);
+    }
+    free(s.paths);
+    return best_threads;
+}
+
+// Benchmarks (--bench[=kernels|tree]). The kernel part times every hash
+// kernel on in-memory data. The tree part generates synthetic trees under
+// --bench-dir (kept and reused by later runs) and times this binary on each
+// of them: a --walk-only pass for traversal, then a cold run after dropping
+// the files from the page cache and a warm run straight after. Results go to
+// stdout as JSON; the other options given are passed on to every run.
+#define BENCH_KERNEL_BYTES (64u << 20)
+#define BENCH_MIN_SECONDS 0.5
+
+typedef struct {
+    const char *name;
+    int files;
+    int dirs;
+    int depth;
+    long long min_size;
+    long long max_size;
+} BenchShape;
+
+// Sizes are roughly log-uniform between min_size and max_size.
+static const BenchShape bench_shapes[] = {
+    {"tiny", 20000, 200, 1, 0, 4096},
+    {"huge", 4, 1, 1, 256ll << 20, 256ll << 20},
+    {"deep", 2000, 40, 24, 1024, 65536},
+    {"mixed", 1000, 50, 3, 1, 16ll << 20},
+};
+#define BENCH_SHAPE_COUNT ((int)(sizeof(bench_shapes) / sizeof(bench_shapes[0])))
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Digests are folded in here so the compiler cannot drop the hashing.
+static volatile unsigned char bench_sink;
+
+static void bench_consume(const unsigned char *digest, int len) {
+    for (int i = 0; i < len; i++) bench_sink ^= digest[i];
+}
+
+static void bench_kernel_result(int *first, const char *name, double bytes, double secs) {
+    printf("%s\n    {\"kernel\": \"%s\", \"gbps\": %.3f}", *first ? "" : ",", name,
+           secs > 0 ? bytes / secs / 1e9 : 0.0);
+    *first = 0;
+}
+
+static void bench_kernels(void) {
+    unsigned char *data = io_buffer_alloc(BENCH_KERNEL_BYTES);
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < BENCH_KERNEL_BYTES; i += 8) {
+        uint64_t v = bench_rand(&seed);
+        memcpy(data + i, &v, 8);
+    }
+
+    int first = 1;
+    printf("  \"kernels\": [");
+    for (int ki = 0; ki < MD5_KERNEL_COUNT; ki++) {
+        const MD5Kernel *k = &md5_kernels[ki];
+        if (!md5_kernel_supported(k)) continue;
+        double bytes = 0, start = now_seconds(), secs;
+        do {
+            if (k->lanes == 1) {
+                MD5_CTX ctx;
+                unsigned char digest[16];
+                md5_init(&ctx);
+                md5_update(&ctx, data, BENCH_KERNEL_BYTES);
+                md5_final(digest, &ctx);
+                bench_consume(digest, 16);
+            } else {
+                MD5_CTX ctxs[MB_MAX_LANES];
+                MD5_CTX *ctx[MB_MAX_LANES];
+                const unsigned char *lane_data[MB_MAX_LANES];
+                size_t lane_bytes = BENCH_KERNEL_BYTES / k->lanes;
+                for (int l = 0; l < k->lanes; l++) {
+                    md5_init(&ctxs[l]);
+                    ctx[l] = &ctxs[l];
+                    lane_data[l] = data + l * lane_bytes;
+                }
+                md5_mb_update(k, ctx, lane_data, k->lanes, lane_bytes / 64);
+                for (int l = 0; l < k->lanes; l++) {
+                    bench_consume((const unsigned char *)ctxs[l].state, 16);
+                }
+            }
+            bytes += BENCH_KERNEL_BYTES;
+        } while ((secs = now_seconds() - start) < BENCH_MIN_SECONDS);
+        char name[32];
+        snprintf(name, sizeof(name), "md5-%s", k->name);
+        bench_kernel_result(&first, name, bytes, secs);
+    }
+
+    sha256_blocks_fn chosen = sha256_blocks;
+    for (int variant = 0; variant < 2; variant++) {
+#if defined(__x86_64__) || defined(__i386__)
+        if (variant == 1 && !sha256_shani_supported()) continue;
+        sha256_blocks = variant ? sha256_blocks_shani : sha256_blocks_portable;
+#else
+        if (variant == 1) continue;
+#endif
+        double bytes = 0, start = now_seconds(), secs;
+        do {
+            SHA256_CTX ctx;
+            unsigned char digest[32];
+            sha256_init(&ctx);
+            sha256_update(&ctx, data, BENCH_KERNEL_BYTES);
+            sha256_final(digest, &ctx);
+            bench_consume(digest, 32);
+            bytes += BENCH_KERNEL_BYTES;
+        } while ((secs = now_seconds() - start) < BENCH_MIN_SECONDS);
+        bench_kernel_result(&first, variant ? "sha256-ni" : "sha256", bytes, secs);
+    }
+    sha256_blocks = chosen;
+
+    double bytes = 0, start = now_seconds(), secs;
+    do {
+        XXH64_CTX ctx;
+        unsigned char digest[8];
+        xxh64_init(&ctx);
+        xxh64_update(&ctx, data, BENCH_KERNEL_BYTES);
+        xxh64_final(digest, &ctx);
+        bench_consume(digest, 8);
+        bytes += BENCH_KERNEL_BYTES;
+    } while ((secs = now_seconds() - start) < BENCH_MIN_SECONDS);
+    bench_kernel_result(&first, "xxh64", bytes, secs);
+    printf("\n  ]");
+    free(data);
+}
+
+// Creates the tree for shape s under root unless a previous run finished it.
+// Returns the number of bytes in it, or -1.
+static long long bench_generate(const BenchShape *s, const char *root, double scale) {
+    char path[MAX_PATH], done[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", root, s->name);
+    snprintf(done, sizeof(done), "%s/%s.done", root, s->name);
+    // Trees shrink with --bench-scale below 1 and gain files above it.
+    int files = (int)(s->files * scale) > 0 ? (int)(s->files * scale) : 1;
+    long long min_size = (long long)(s->min_size * (scale < 1 ? scale : 1));
+    long long max_size = (long long)(s->max_size * (scale < 1 ? scale : 1));
+
+    FILE *marker = fopen(done, "r");
+    if (marker != NULL) {
+        long long bytes = -1, got_max = 0;
+        int got_files = 0;
+        if (fscanf(marker, "%d %lld %lld", &got_files, &got_max, &bytes) != 3 ||
+            got_files != files || got_max != max_size) {
+            bytes = -1;
+        }
+        fclose(marker);
+        if (bytes >= 0) return bytes;
+    }
+
+    mkdir(root, 0755);
+    mkdir(path, 0755);
+    uint64_t seed = 0x2545F4914F6CDD1Dull;
+    size_t chunk_size = 1u << 20;
+    unsigned char *chunk = (unsigned char *)malloc(chunk_size);
+    long long bytes = 0;
+    for (int f = 0; f < files; f++) {
+        char name[MAX_PATH];
+        size_t len = (size_t)snprintf(name, sizeof(name), "%s/d%04d", path, f % s->dirs);
+        mkdir(name, 0755);
+        for (int d = 1; d < s->depth; d++) {
+            len += (size_t)snprintf(name + len, sizeof(name) - len, "/n%02d", d);
+            mkdir(name, 0755);
+        }
+        snprintf(name + len, sizeof(name) - len, "/f%06d", f);
+
+        // Pick a power-of-two bucket uniformly, then a size within it.
+        long long size = min_size;
+        if (max_size > min_size) {
+            int lo = 0, hi = 0;
+            while ((2ll << lo) <= min_size) lo++;
+            while ((2ll << hi) <= max_size) hi++;
+            int bucket = lo + (int)(bench_rand(&seed) % (uint64_t)(hi - lo + 1));
+            size = (1ll << bucket) + (long long)(bench_rand(&seed) % (uint64_t)(1ll << bucket));
+            if (size < min_size) size = min_size;
+            if (size > max_size) size = max_size;
+        }
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(name);
+            free(chunk);
+            return -1;
+        }
+        for (long long left = size; left > 0;) {
+            size_t n = left < (long long)chunk_size ? (size_t)left : chunk_size;
+            for (size_t i = 0; i < n; i += 8) {
+                uint64_t v = bench_rand(&seed);
+                memcpy(chunk + i, &v, n - i < 8 ? n - i : 8);
+            }
+            if (write(fd, chunk, n) != (ssize_t)n) {
+                perror(name);
+                close(fd);
+                free(chunk);
+                return -1;
+            }
+            left -= (long long)n;
+        }
+        close(fd);
+        bytes += size;
+    }
+    free(chunk);
+
+    marker = fopen(done, "w");
+    if (marker != NULL) {
+        fprintf(marker, "%d %lld %lld\n", files, max_size, bytes);
+        fclose(marker);
+    }
+    return bytes;
+}
+
+static void bench_drop_tree(const char *path) {
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *e;
+    char child[MAX_PATH];
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        if (e->d_type == DT_DIR) {
+            bench_drop_tree(child);
+            continue;
+        }
+        int fd = open(child, O_RDONLY);
+        if (fd != -1) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    closedir(d);
+}
+
+// Runs this binary with args plus extra and path, output discarded, and
+// returns the wall time in seconds, or -1 if it failed.
+static double bench_run(char **args, int nargs, const char *extra, const char *path) {
+    char **argv = (char **)malloc(sizeof(char *) * (nargs + 5));
+    int n = 0;
+    argv[n++] = "md5hash";
+    argv[n++] = "--no-cache";
+    for (int i = 0; i < nargs; i++) argv[n++] = args[i];
+    if (extra != NULL) argv[n++] = (char *)extra;
+    argv[n++] = (char *)path;
+    argv[n] = NULL;
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execv("/proc/self/exe", argv);
+        _exit(127);
+    }
+    int status = 0;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        free(argv);
+        return -1;
+    }
+    free(argv);
+    return now_seconds() - start;
+}
+
+static void bench_trees(const char *root, double scale, char **args, int nargs) {
+    printf("  \"trees\": [");
+    for (int i = 0; i < BENCH_SHAPE_COUNT; i++) {
+        const BenchShape *s = &bench_shapes[i];
+        fprintf(stderr, "bench: preparing %s tree\n", s->name);
+        long long bytes = bench_generate(s, root, scale);
+        if (bytes < 0) continue;
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/%s", root, s->name);
+        int files = (int)(s->files * scale) > 0 ? (int)(s->files * scale) : 1;
+
+        double walk = bench_run(args, nargs, "--walk-only", path);
+        bench_drop_tree(path);
+        double cold = bench_run(args, nargs, NULL, path);
+        double warm = bench_run(args, nargs, NULL, path);
+        printf("%s\n    {\"shape\": \"%s\", \"files\": %d, \"bytes\": %lld, "
+               "\"walk_s\": %.4f, \"cold_s\": %.4f, \"warm_s\": %.4f, "
+               "\"cold_gbps\": %.3f, \"warm_gbps\": %.3f, \"files_per_s\": %.0f}",
+               i ? "," : "", s->name, files, bytes, walk, cold, warm,
+               cold > 0 ? (double)bytes / cold / 1e9 : 0.0,
+               warm > 0 ? (double)bytes / warm / 1e9 : 0.0,
+               warm > 0 ? files / warm : 0.0);
+        fflush(stdout);
+    }
+    printf("\n  ]");
+}
+
+// args holds the options to pass on to the tree runs.
+int bench_main(const char *what, const char *root, double scale, char **args, int nargs) {
+    int kernels = strcmp(what, "all") == 0 || strcmp(what, "kernels") == 0;
+    int trees = strcmp(what, "all") == 0 || strcmp(what, "tree") == 0;
+    if (!kernels && !trees) {
+        fprintf(stderr, "Unknown benchmark: %s\n", what);
+        return 1;
+    }
+
+    char default_root[MAX_PATH / 2];
+    if (root == NULL) {
+        const char *tmp = getenv("TMPDIR");
+        snprintf(default_root, sizeof(default_root), "%s/md5hash-bench", tmp ? tmp : "/tmp");
+        root = default_root;
+    }
+
+    printf("{\n  \"threads\": %d,\n  \"md5_kernel\": \"%s\",\n  \"algo\": \"%s\"",
+           num_threads, md5_kernel->name, hash_engine->name);
+    if (kernels) {
+        printf(",\n");
+        bench_kernels();
+    }
+    if (trees) {
+        printf(",\n");
+        bench_trees(root, scale, args, nargs);
+    }
+    printf("\n}\n");
+    return 0;
+}
+
+// Stats reporting: --progress prints a status line on stderr every second,
+// SIGUSR1 prints the current summary, --stats prints it at exit and
+// --stats-json=FILE writes it as JSON. SIGUSR1 is blocked in every thread
+// and taken synchronously by the stats thread, so nothing runs in signal
+// context.
+int stats_summary = 0;
+int stats_progress = 0;
+const char *stats_json_path = NULL;
+
+static pthread_t stats_thread;
+static atomic_int stats_stop;
+static uint64_t stats_started;
+
+typedef struct {
+    uint64_t files, bytes, dequeue_wait_ns, enqueue_wait_ns, reads, read_ns, hash_ns;
+    uint64_t read_hist[STATS_BUCKETS];
+    uint64_t wait_hist[STATS_BUCKETS];
+} StatsTotals;
+
+static void stats_add_to(StatsTotals *t, ThreadStats *s) {
+    t->files += counter_get(&s->files);
+    t->bytes += counter_get(&s->bytes);
+    t->dequeue_wait_ns += counter_get(&s->dequeue_wait_ns);
+    t->enqueue_wait_ns += counter_get(&s->enqueue_wait_ns);
+    t->reads += counter_get(&s->reads);
+    t->read_ns += counter_get(&s->read_ns);
+    t->hash_ns += counter_get(&s->hash_ns);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        t->read_hist[b] += counter_get(&s->read_hist[b]);
+        t->wait_hist[b] += counter_get(&s->wait_hist[b]);
+    }
+}
+
+// Drops every record; only call while no other thread is counting.
+void stats_reset(void) {
+    ThreadStats *s = atomic_exchange(&stats_threads, NULL);
+    while (s != NULL) {
+        ThreadStats *next = s->next;
+        free(s);
+        s = next;
+    }
+    stats_local = NULL;
+}
+
+static const char *format_ns(uint64_t ns, char *buf, size_t len) {
+    if (ns >= 1000000000ull) snprintf(buf, len, "%.2fs", (double)ns / 1e9);
+    else if (ns >= 1000000ull) snprintf(buf, len, "%.2fms", (double)ns / 1e6);
+    else if (ns >= 1000ull) snprintf(buf, len, "%.1fus", (double)ns / 1e3);
+    else snprintf(buf, len, "%lluns", (unsigned long long)ns);
+    return buf;
+}
+
+static void stats_print_histogram(FILE *out, const char *title, const uint64_t *hist) {
+    uint64_t max = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (hist[b] > max) max = hist[b];
+    }
+    if (max == 0) {
+        return;
+    }
+    fprintf(out, "%s:\n", title);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (hist[b] == 0) continue;
+        char lo[16], hi[16];
+        int bar = (int)(hist[b] * 40 / max);
+        fprintf(out, "  %9s - %-9s %10llu %.*s\n", format_ns(1ull << b, lo, sizeof(lo)),
+                format_ns(2ull << b, hi, sizeof(hi)), (unsigned long long)hist[b],
+                bar > 0 ? bar : 1, "########################################");
+    }
+}
+
+void stats_print(FILE *out) {
+    StatsTotals total;
+    memset(&total, 0, sizeof(total));
+    char a[16], b[16], c[16], d[16];
+    double secs = (double)(now_ns() - stats_started) / 1e9;
+
+    fprintf(out, "%-10s %10s %14s %10s %10s %10s %10s\n",
+            "thread", "files", "bytes", "deq-wait", "enq-wait", "read", "hash");
+    for (ThreadStats *s = atomic_load(&stats_threads); s != NULL; s = s->next) {
+        StatsTotals t;
+        memset(&t, 0, sizeof(t));
+        stats_add_to(&t, s);
+        stats_add_to(&total, s);
+        char name[32];
+        snprintf(name, sizeof(name), "%s %d", s->role, s->index);
+        fprintf(out, "%-10s %10llu %14llu %10s %10s %10s %10s\n", name,
+                (unsigned long long)t.files, (unsigned long long)t.bytes,
+                format_ns(t.dequeue_wait_ns, a, sizeof(a)), format_ns(t.enqueue_wait_ns, b, sizeof(b)),
+                format_ns(t.read_ns, c, sizeof(c)), format_ns(t.hash_ns, d, sizeof(d)));
+    }
+    fprintf(out, "%-10s %10llu %14llu %10s %10s %10s %10s\n", "total",
+            (unsigned long long)total.files, (unsigned long long)total.bytes,
+            format_ns(total.dequeue_wait_ns, a, sizeof(a)), format_ns(total.enqueue_wait_ns, b, sizeof(b)),
+            format_ns(total.read_ns, c, sizeof(c)), format_ns(total.hash_ns, d, sizeof(d)));
+    fprintf(out, "%.3f s elapsed, %.1f MB/s, %.0f files/s, queue backlog %zu",
+            secs, secs > 0 ? (double)total.bytes / secs / (1 << 20) : 0.0,
+            secs > 0 ? (double)total.files / secs : 0.0, queue ? queue_backlog(queue) : 0);
+    if (cache != NULL) {
+        fprintf(out, ", cache %ld hits / %ld misses", atomic_load(&cache->hits), atomic_load(&cache->misses));
+    }
+    fprintf(out, "\n");
+    stats_print_histogram(out, "read latency", total.read_hist);
+    stats_print_histogram(out, "queue wait", total.wait_hist);
+}
+
+static void stats_json_histogram(FILE *out, const uint64_t *hist) {
+    int first = 1;
+    fprintf(out, "[");
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (hist[b] == 0) continue;
+        fprintf(out, "%s{\"ge_ns\": %llu, \"count\": %llu}", first ? "" : ", ",
+                1ull << b, (unsigned long long)hist[b]);
+        first = 0;
+    }
+    fprintf(out, "]");
+}
+
+void stats_write_json(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return;
+    }
+    StatsTotals total;
+    memset(&total, 0, sizeof(total));
+    fprintf(out, "{\n  \"elapsed_s\": %.6f,\n  \"threads\": [", (double)(now_ns() - stats_started) / 1e9);
+    int first = 1;
+    for (ThreadStats *s = atomic_load(&stats_threads); s != NULL; s = s->next) {
+        StatsTotals t;
+        memset(&t, 0, sizeof(t));
+        stats_add_to(&t, s);
+        stats_add_to(&total, s);
+        fprintf(out, "%s\n    {\"role\": \"%s\", \"index\": %d, \"files\": %llu, \"bytes\": %llu, "
+                "\"dequeue_wait_ns\": %llu, \"enqueue_wait_ns\": %llu, \"reads\": %llu, "
+                "\"read_ns\": %llu, \"hash_ns\": %llu}",
+                first ? "" : ",", s->role, s->index, (unsigned long long)t.files,
+                (unsigned long long)t.bytes, (unsigned long long)t.dequeue_wait_ns,
+                (unsigned long long)t.enqueue_wait_ns, (unsigned long long)t.reads,
+                (unsigned long long)t.read_ns, (unsigned long long)t.hash_ns);
+        first = 0;
+    }
+    fprintf(out, "\n  ],\n  \"files\": %llu,\n  \"bytes\": %llu,\n",
+            (unsigned long long)total.files, (unsigned long long)total.bytes);
+    if (cache != NULL) {
+        fprintf(out, "  \"cache_hits\": %ld,\n  \"cache_misses\": %ld,\n",
+                atomic_load(&cache->hits), atomic_load(&cache->misses));
+    }
+    fprintf(out, "  \"read_latency\": ");
+    stats_json_histogram(out, total.read_hist);
+    fprintf(out, ",\n  \"queue_wait\": ");
+    stats_json_histogram(out, total.wait_hist);
+    fprintf(out, "\n}\n");
+    fclose(out);
+}
+
+static void stats_progress_line(void) {
+    StatsTotals t;
+    memset(&t, 0, sizeof(t));
+    for (ThreadStats *s = atomic_load(&stats_threads); s != NULL; s = s->next) {
+        stats_add_to(&t, s);
+    }
+    double secs = (double)(now_ns() - stats_started) / 1e9;
+    fprintf(stderr, "\r%7.1fs %10llu files %10.1f MB %8.1f MB/s  queue %-6zu",
+            secs, (unsigned long long)t.files, (double)t.bytes / (1 << 20),
+            secs > 0 ? (double)t.bytes / secs / (1 << 20) : 0.0, queue_backlog(queue));
+}
+
+static void *stats_thread_main(__attribute__((unused)) void *arg) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    struct timespec tick = {1, 0};
+    while (!atomic_load(&stats_stop)) {
+        int sig = sigtimedwait(&set, NULL, &tick);
+        if (atomic_load(&stats_stop)) break;
+        if (sig == SIGUSR1) {
+            if (stats_progress) fprintf(stderr, "\n");
+            stats_print(stderr);
+        } else if (stats_progress) {
+            stats_progress_line();
+        }
+    }
+    return NULL;
+}
+
+// Blocks SIGUSR1 for the calling thread and every thread it creates later,
+// then starts the stats thread. Call before any other thread exists.
+void stats_start(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    stats_started = now_ns();
+    pthread_create(&stats_thread, NULL, stats_thread_main, NULL);
+}
+
+void stats_finish(void) {
+    atomic_store(&stats_stop, 1);
+    pthread_kill(stats_thread, SIGUSR1);
+    pthread_join(stats_thread, NULL);
+    if (stats_progress) {
+        stats_progress_line();
+        fprintf(stderr, "\n");
+    }
+    if (stats_summary) {
+        stats_print(stderr);
+    }
+    if (stats_json_path != NULL) {
+        stats_write_json(stats_json_path);
+    }
+    stats_reset();
+}
+
+// Verify mode (-c MANIFEST...). Manifests may be in this program's own
+// "path HEX" format or in md5sum's "hex  path", "hex *path" and
+// "MD5 (path) = hex" formats. Every listed file is a task on the pool and
+// reported as OK, FAILED or MISSING as soon as it is hashed.
+typedef struct {
+    TaskOwner base;
+    char *path;
+    unsigned char digest[HASH_MAX_DIGEST];
+    int digest_len;
+    const HashEngine *engine;
+} CheckEntry;
+
+int check_mode = 0;
+int check_fail_fast = 0;
+static CheckEntry *check_entries = NULL;
+static size_t check_count = 0;
+static size_t check_bad_lines = 0;
+static atomic_size_t check_ok;
+static atomic_size_t check_failed;
+static atomic_size_t check_missing;
+
+static int parse_hex(const char *s, size_t len, unsigned char *out) {
+    if (len == 0 || len % 2 != 0 || len > 2 * HASH_MAX_DIGEST) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (v < 0) return 0;
+        if (i % 2 == 0) out[i / 2] = (unsigned char)(v << 4);
+        else out[i / 2] |= (unsigned char)v;
+    }
+    return 1;
+}
+
+// md5sum starts a line with '\' when the name has "\\" or "\n" escapes.
+static void unescape_name(char *s) {
+    char *w = s;
+    for (char *r = s; *r; r++) {
+        if (*r == '\\' && r[1] == 'n') {
+            *w++ = '\n';
+            r++;
+        } else if (*r == '\\' && r[1] == '\\') {
+            *w++ = '\\';
+            r++;
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+}
+
+static int check_parse_line(char *line, CheckEntry *e) {
+    int escaped = line[0] == '\\';
+    if (escaped) line++;
+    char *path = NULL;
+    const char *hex = NULL;
+    size_t hex_len = 0;
+    const char *tag = NULL;
+    char *sp = strchr(line, ' ');
+    char *last = strrchr(line, ' ');
+
+    // "MD5 (path) = hex"; the name itself may contain ") = ". Only a known
+    // tag with the full ") = hex" tail counts, so "a (1).txt HEX" is a path.
+    int tagged = 0;
+    if (sp != NULL && sp[1] == '(' && last - sp >= 4 && memcmp(last - 3, ") =", 3) == 0 &&
+        parse_hex(last + 1, strlen(last + 1), e->digest)) {
+        for (int i = 0; i < HASH_ENGINE_COUNT; i++) {
+            size_t n = strlen(hash_engines[i].name);
+            if (n == (size_t)(sp - line) && strncasecmp(line, hash_engines[i].name, n) == 0) tagged = 1;
+        }
+    }
+
+    if (tagged) {
+        *sp = '\0';
+        tag = line;
+        last[-3] = '\0';
+        path = sp + 2;
+        hex = last + 1;
+        hex_len = strlen(hex);
+    } else if (sp != NULL && (sp[1] == ' ' || sp[1] == '*') && sp[2] != '\0' &&
+               parse_hex(line, (size_t)(sp - line), e->digest)) {
+        // "hex  path" or "hex *path"
+        hex = line;
+        hex_len = (size_t)(sp - line);
+        path = sp + 2;
+    } else {
+        // "path HEX"
+        if (last == NULL || last == line) return 0;
+        *last = '\0';
+        path = line;
+        hex = last + 1;
+        hex_len = strlen(hex);
+    }
+    if (!parse_hex(hex, hex_len, e->digest)) {
+        return 0;
+    }
+    e->digest_len = (int)(hex_len / 2);
+
+    // The tag names the algorithm, else the digest length picks it, with
+    // --algo breaking the tie.
+    e->engine = NULL;
+    for (int i = 0; i < HASH_ENGINE_COUNT; i++) {
+        const HashEngine *h = &hash_engines[i];
+        if (tag != NULL ? strcasecmp(tag, h->name) == 0 : h->digest_len == e->digest_len) {
+            if (e->engine == NULL || h == hash_engine) e->engine = h;
+        }
+    }
+    if (e->engine == NULL || e->engine->digest_len != e->digest_len) {
+        return 0;
+    }
+    if (escaped) unescape_name(path);
+    e->base.kind = OWNER_CHECK;
+    e->path = strdup(path);
+    return 1;
+}
+
+// Reads every manifest ("-" is standard input) and settles the algorithm
+// before any worker starts. Returns 0 if nothing could be read.
+int check_load(char **manifests, int count, int algo_given) {
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int read_any = 0;
+    for (int m = 0; m < count; m++) {
+        FILE *f = strcmp(manifests[m], "-") == 0 ? stdin : fopen(manifests[m], "r");
+        if (f == NULL) {
+            fprintf(stderr, "Cannot open manifest: %s\n", manifests[m]);
+            continue;
+        }
+        read_any = 1;
+        ssize_t len;
+        while ((len = getline(&line, &line_cap, f)) > 0) {
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+            if (len == 0) continue;
+            if (check_count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                check_entries = (CheckEntry *)realloc(check_entries, sizeof(CheckEntry) * cap);
+            }
+            if (check_parse_line(line, &check_entries[check_count])) check_count++;
+            else check_bad_lines++;
+        }
+        if (f != stdin) fclose(f);
+    }
+    free(line);
+
+    // One engine hashes the whole run: the one named by --algo, or else the
+    // one the first entry needs. Entries for another one cannot be checked.
+    if (!algo_given && check_count > 0) {
+        hash_engine = check_entries[0].engine;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < check_count; i++) {
+        if (check_entries[i].engine == hash_engine) {
+            check_entries[kept++] = check_entries[i];
+        } else {
+            free(check_entries[i].path);
+            check_bad_lines++;
+        }
+    }
+    check_count = kept;
+    return read_any;
+}
+
+void check_enqueue(void) {
+    FileTask batch[QUEUE_BATCH];
+    int n = 0;
+    for (size_t i = 0; i < check_count && !atomic_load(&check_stop); i++) {
+        FileTask task = {check_entries[i].path, NULL, &check_entries[i]};
+        batch[n++] = task;
+        if (n == QUEUE_BATCH) {
+            queue_enqueue_tasks(queue, batch, n);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        queue_enqueue_tasks(queue, batch, n);
+    }
+}
+
+static void check_result(const FileTask *task, const unsigned char *digest) {
+    CheckEntry *e = (CheckEntry *)task->owner;
+    if (atomic_load(&check_stop)) {
+        return;
+    }
+    const char *verdict = "OK";
+    if (memcmp(digest, e->digest, e->digest_len) != 0) {
+        // Unreadable files come back with a zero digest; only those need a
+        // second look to tell a missing file from a changed one.
+        struct stat st;
+        verdict = stat(e->path, &st) == -1 ? "MISSING" : "FAILED";
+        // Only the first failure is reported; results still in flight on
+        // other workers are dropped.
+        if (check_fail_fast && atomic_exchange(&check_stop, 1)) {
+            return;
+        }
+    }
+    atomic_fetch_add(verdict[0] == 'O' ? &check_ok : verdict[0] == 'M' ? &check_missing : &check_failed, 1);
+    char line[MAX_PATH + 16];
+    int len = snprintf(line, sizeof(line), "%s: %s\n", e->path, verdict);
+    print_line(line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+// Prints md5sum's warnings and returns the exit status.
+int check_report(void) {
+    size_t failed = atomic_load(&check_failed), missing = atomic_load(&check_missing);
+    if (check_bad_lines > 0) {
+        fprintf(stderr, "WARNING: %zu line%s improperly formatted\n", check_bad_lines,
+                check_bad_lines == 1 ? " is" : "s are");
+    }
+    if (missing > 0) {
+        fprintf(stderr, "WARNING: %zu listed file%s could not be read\n", missing, missing == 1 ? "" : "s");
+    }
+    if (failed > 0) {
+        fprintf(stderr, "WARNING: %zu computed checksum%s did NOT match\n", failed, failed == 1 ? "" : "s");
+    }
+    for (size_t i = 0; i < check_count; i++) {
+        free(check_entries[i].path);
+    }
+    free(check_entries);
+    if (check_count == 0) {
+        fprintf(stderr, "No properly formatted checksum lines found\n");
+        return 1;
+    }
+    return failed > 0 || missing > 0;
+}
+
+// Watch mode (--watch). After the first pass the tree stays subscribed to
+// change events and every file closed after writing is hashed again on the
+// same pool and printed like the rest, as is every file renamed into the
+// tree (an editor's write-temp-then-rename save). fanotify watches a whole
+// filesystem with one mark per root and reports each event as directory
+// handle plus name, so renames are seen too; it needs CAP_SYS_ADMIN and
+// Linux 5.9. Otherwise every directory gets an inotify watch as the walkers
+// list it. Events are coalesced per file: a
+// file is queued once it has been quiet for --watch-delay milliseconds.
+#define WATCH_BUCKETS 4096
+
+int watch_mode = 0;
+int watch_delay_ms = 200;
+
+typedef struct WatchPending {
+    char *path;
+    uint64_t due;
+    struct WatchPending *next;
+} WatchPending;
+
+static WatchPending *watch_pending[WATCH_BUCKETS];
+static size_t watch_pending_count = 0;
+
+// inotify watch descriptors are small integers, so the path of each one is
+// kept in an array indexed by it. Walkers add to it concurrently.
+static char **watch_paths = NULL;
+static int watch_paths_cap = 0;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int watch_fanotify = -1;
+static char **watch_roots = NULL;
+static char **watch_real_roots = NULL;
+static int *watch_root_fds = NULL;
+static fsid_t *watch_root_fsids = NULL;
+static int watch_root_count = 0;
+
+static void watch_add(const char *path, int is_dir) {
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO;
+    if (is_dir) mask |= IN_CREATE | IN_ONLYDIR;
+    int wd = inotify_add_watch(watch_inotify, path, mask);
+    if (wd == -1) {
+        static atomic_int warned;
+        if (errno == ENOSPC && !atomic_exchange(&warned, 1)) {
+            fprintf(stderr, "Out of inotify watches; raise fs.inotify.max_user_watches\n");
+        }
+        return;
+    }
+    pthread_mutex_lock(&watch_lock);
+    if (wd >= watch_paths_cap) {
+        int cap = watch_paths_cap ? watch_paths_cap : 1024;
+        while (cap <= wd) cap *= 2;
+        watch_paths = (char **)realloc(watch_paths, sizeof(char *) * cap);
+        memset(watch_paths + watch_paths_cap, 0, sizeof(char *) * (cap - watch_paths_cap));
+        watch_paths_cap = cap;
+    }
+    free(watch_paths[wd]);
+    watch_paths[wd] = strdup(path);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static uint32_t watch_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) h = (h ^ (unsigned char)*path) * 16777619u;
+    return h;
+}
+
+// Records an event for path; repeated events push its deadline back.
+static void watch_touch(const char *path) {
+    uint32_t b = watch_hash(path) % WATCH_BUCKETS;
+    uint64_t due = now_ns() + (uint64_t)watch_delay_ms * 1000000ull;
+    for (WatchPending *p = watch_pending[b]; p != NULL; p = p->next) {
+        if (strcmp(p->path, path) == 0) {
+            p->due = due;
+            return;
+        }
+    }
+    WatchPending *p = (WatchPending *)malloc(sizeof(WatchPending));
+    p->path = strdup(path);
+    p->due = due;
+    p->next = watch_pending[b];
+    watch_pending[b] = p;
+    watch_pending_count++;
+}
+
+// Queues every file whose deadline has passed (every file, with all set)
+// and returns the milliseconds until the next one is due, or -1.
+static int watch_flush(int all) {
+    if (watch_pending_count == 0) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+    uint64_t next = UINT64_MAX;
+    for (int b = 0; b < WATCH_BUCKETS; b++) {
+        WatchPending **link = &watch_pending[b];
+        while (*link != NULL) {
+            WatchPending *p = *link;
+            if (p->due > now && !all) {
+                if (p->due < next) next = p->due;
+                link = &p->next;
+                continue;
+            }
+            struct stat st;
+            if (stat(p->path, &st) == 0 && S_ISREG(st.st_mode)) {
+                queue_enqueue(queue, p->path);
+            }
+            *link = p->next;
+            free(p->path);
+            free(p);
+            watch_pending_count--;
+        }
+    }
+    return next == UINT64_MAX ? -1 : (int)((next - now) / 1000000 + 1);
+}
+
+// Lists dirs (and everything below them) with the walkers, which queues its
+// files and, with inotify, watches its directories.
+static void watch_rescan(char **dirs, int count) {
+    long dirs_seen = 0, files_seen = 0;
+    walk_directories(dirs, count, &dirs_seen, &files_seen);
+}
+
+static void watch_inotify_events(char *buf, ssize_t len) {
+    for (char *p = buf; p < buf + len;) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            fprintf(stderr, "Watch events were lost; rescanning\n");
+            watch_rescan(watch_roots, watch_root_count);
+            continue;
+        }
+        char path[MAX_PATH];
+        pthread_mutex_lock(&watch_lock);
+        const char *dir = ev->wd < watch_paths_cap ? watch_paths[ev->wd] : NULL;
+        int ok = dir != NULL &&
+                 snprintf(path, sizeof(path), "%s%s%s", dir, ev->len ? "/" : "", ev->len ? ev->name : "") < (int)sizeof(path);
+        if (ev->mask & IN_IGNORED && ev->wd < watch_paths_cap) {
+            free(watch_paths[ev->wd]);
+            watch_paths[ev->wd] = NULL;
+        }
+        pthread_mutex_unlock(&watch_lock);
+        if (!ok || ev->mask & IN_IGNORED) {
+            continue;
+        }
+
+        if (ev->mask & IN_ISDIR) {
+            // A new or moved-in directory may already hold files.
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                char *dirs[1] = {path};
+                watch_rescan(dirs, 1);
+            }
+        } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            watch_touch(path);
+        }
+    }
+}
+
+// Resolves the directory handle of a DFID_NAME record to "dir/name" through
+// a root on the same filesystem.
+static int watch_fid_path(struct fanotify_event_info_fid *fid, char *real, size_t size) {
+    struct file_handle *fh = (struct file_handle *)fid->handle;
+    const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+    for (int i = 0; i < watch_root_count; i++) {
+        if (watch_root_fds[i] == -1 || memcmp(&fid->fsid, &watch_root_fsids[i], sizeof(fsid_t)) != 0) continue;
+        int dfd = open_by_handle_at(watch_root_fds[i], fh, O_PATH | O_CLOEXEC);
+        if (dfd == -1) return 0;
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", dfd);
+        ssize_t n = readlink(link, real, size - 1);
+        close(dfd);
+        if (n <= 0) return 0;
+        real[n] = '\0';
+        size_t used = (size_t)n;
+        return snprintf(real + used, size - used, "%s%s", strcmp(real, "/") == 0 ? "" : "/", name) <
+               (int)(size - used);
+    }
+    return 0;
+}
+
+static void watch_fanotify_events(char *buf, ssize_t len) {
+    struct fanotify_event_metadata *ev = (struct fanotify_event_metadata *)buf;
+    for (; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+        if (ev->mask & FAN_Q_OVERFLOW) {
+            fprintf(stderr, "Watch events were lost; rescanning\n");
+            watch_rescan(watch_roots, watch_root_count);
+            continue;
+        }
+        struct fanotify_event_info_fid *fid = NULL;
+        for (char *p = (char *)ev + ev->metadata_len; p < (char *)ev + ev->event_len;) {
+            struct fanotify_event_info_header *hdr = (struct fanotify_event_info_header *)p;
+            if (hdr->len == 0) break;
+            if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                fid = (struct fanotify_event_info_fid *)hdr;
+                break;
+            }
+            p += hdr->len;
+        }
+        char real[MAX_PATH];
+        if (fid == NULL || !watch_fid_path(fid, real, sizeof(real))) {
+            continue;
+        }
+
+        // The mark covers the whole filesystem; keep events below a root and
+        // report them under the root as it was given.
+        for (int i = 0; i < watch_root_count; i++) {
+            size_t rlen = strcmp(watch_real_roots[i], "/") == 0 ? 0 : strlen(watch_real_roots[i]);
+            if (strncmp(real, watch_real_roots[i], rlen) != 0 || (real[rlen] != '\0' && real[rlen] != '/')) continue;
+            char path[MAX_PATH];
+            if (snprintf(path, sizeof(path), "%s%s", watch_roots[i], real + rlen) >= (int)sizeof(path)) break;
+            if (ev->mask & FAN_ONDIR) {
+                // A new or moved-in directory may already hold files.
+                char *dirs[1] = {path};
+                watch_rescan(dirs, 1);
+            } else if (ev->mask & (FAN_CLOSE_WRITE | FAN_MOVED_TO)) {
+                watch_touch(path);
+            }
+            break;
+        }
+    }
+}
+
+// Sets up fanotify, or inotify, for the roots. Must run before the first
+// pass so that nothing changed during it is missed.
+int watch_start(char **roots, int count) {
+    watch_roots = roots;
+    watch_root_count = count;
+    watch_real_roots = (char **)malloc(sizeof(char *) * (count > 0 ? count : 1));
+    watch_root_fds = (int *)malloc(sizeof(int) * (count > 0 ? count : 1));
+    watch_root_fsids = (fsid_t *)calloc(count > 0 ? count : 1, sizeof(fsid_t));
+    for (int i = 0; i < count; i++) {
+        char *real = realpath(roots[i], NULL);
+        watch_real_roots[i] = real ? real : strdup(roots[i]);
+        // Any fd on the root's filesystem lets open_by_handle_at resolve the
+        // directory handles in its events.
+        struct statfs sfs;
+        watch_root_fds[i] = open(roots[i], O_RDONLY | O_CLOEXEC);
+        if (watch_root_fds[i] != -1 && fstatfs(watch_root_fds[i], &sfs) == 0) {
+            watch_root_fsids[i] = sfs.f_fsid;
+        }
+    }
+
+    // Events without a name could not tell a rename into the tree from any
+    // other, so there is no fanotify fallback without FAN_REPORT_DFID_NAME.
+    watch_fanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                                   O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    uint64_t mask = FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_CREATE | FAN_ONDIR;
+    for (int i = 0; i < count && watch_fanotify != -1; i++) {
+        if (fanotify_mark(watch_fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, roots[i]) == -1 &&
+            errno != ENOENT) {
+            close(watch_fanotify);
+            watch_fanotify = -1;
+        }
+    }
+    if (watch_fanotify != -1) {
+        return 1;
+    }
+
+    watch_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_inotify == -1) {
+        perror("inotify_init1");
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        if (stat(roots[i], &st) == 0 && S_ISREG(st.st_mode)) {
+            watch_add(roots[i], 0);
+        }
+    }
+    return 1;
+}
+
+// Runs after the first pass until SIGINT or SIGTERM, which the caller has
+// blocked.
+void watch_main(void) {
+    int efd = watch_fanotify != -1 ? watch_fanotify : watch_inotify;
+    fprintf(stderr, "Watching for changes (%s)\n", watch_fanotify != -1 ? "fanotify" : "inotify");
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    int sfd = signalfd(-1, &set, SFD_CLOEXEC);
+
+    char buf[64 * 1024] __attribute__((aligned(8)));
+    int timeout = -1;
+    for (;;) {
+        struct pollfd fds[2] = {{efd, POLLIN, 0}, {sfd, POLLIN, 0}};
+        int n = poll(fds, sfd != -1 ? 2 : 1, timeout);
+        if (n == -1 && errno != EINTR) break;
+        if (n > 0 && (fds[1].revents & POLLIN)) break;
+        if (n > 0 && (fds[0].revents & POLLIN)) {
+            ssize_t len;
+            while ((len = read(efd, buf, sizeof(buf))) > 0) {
+                if (efd == watch_fanotify) watch_fanotify_events(buf, len);
+                else watch_inotify_events(buf, len);
+            }
+        }
+        timeout = watch_flush(0);
+    }
+
+    watch_flush(1);
+    if (sfd != -1) close(sfd);
+    close(efd);
+    watch_inotify = watch_fanotify = -1;
+    for (int i = 0; i < watch_paths_cap; i++) free(watch_paths[i]);
+    free(watch_paths);
+    for (int i = 0; i < watch_root_count; i++) {
+        free(watch_real_roots[i]);
+        if (watch_root_fds[i] != -1) close(watch_root_fds[i]);
+    }
+    free(watch_real_roots);
+    free(watch_root_fds);
+    free(watch_root_fsids);
+}
+
+// Server mode (--serve=SOCKET). The worker pool and the digest cache stay
+// resident and each connection gets a thread that reads requests:
+//
+//   request  = line* "\n"            one path per line, ended by an empty line
+//   line     = PATH "\n"             a file, or a directory to hash recursively
+//            | ":data " LEN "\n" BYTES   raw bytes, answered as "-"
+//
+// Every request is answered with "PATH HEX" lines in completion order and
+// an empty line. Errors come back as "!message" lines. Clients may pipeline
+// any number of requests; the answers come back in request order, and the
+// oldest unanswered request streams its results as they finish while later
+// ones are held back. Paths are taken relative to the server's working
+// directory and cannot contain newlines.
+//
+// Hash workers never write to a client: answers are appended to the
+// connection's output buffer and a writer thread per connection sends them
+// with non-blocking sends. A client that lets more than SERVE_OUT_MAX of
+// answers pile up is disconnected.
+#define SERVE_BATCH 64
+#define SERVE_OUT_MAX (16u << 20)
+#define SERVE_DRAIN_SEC 5
+
+typedef struct ServeConn ServeConn;
+
+typedef struct ServeRequest {
+    TaskOwner base;
+    ServeConn *conn;
+    atomic_int pending;
+    int complete;
+    char *held;
+    size_t held_len;
+    size_t held_cap;
+    struct ServeRequest *next;
+} ServeRequest;
+
+struct ServeConn {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t out_cond;
+    ServeRequest *head;
+    ServeRequest *tail;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int reading;
+    int dropped;
+    atomic_int refs;
+    ServeConn *next_live;
+    ServeConn *next_writer;
+};
+
+// Connections whose reader thread is still running, so that shutdown can
+// stop them reading and wait until every request they took is queued, and
+// connections whose writer thread still has answers to send.
+static ServeConn *serve_live = NULL;
+static ServeConn *serve_writers = NULL;
+static pthread_mutex_t serve_live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serve_live_cond = PTHREAD_COND_INITIALIZER;
+
+static void serve_conn_release(ServeConn *c) {
+    if (atomic_fetch_sub(&c->refs, 1) == 1) {
+        close(c->fd);
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->out_cond);
+        free(c->out);
+        free(c);
+    }
+}
+
+// Queues data for the writer thread; the caller holds c->lock. A client that
+// went away, or stopped reading, only loses its answers.
+static void serve_send(ServeConn *c, const char *data, size_t len) {
+    if (c->dropped) return;
+    if (c->out_len + len > SERVE_OUT_MAX) {
+        c->dropped = 1;
+        c->out_len = 0;
+        shutdown(c->fd, SHUT_RDWR);
+        pthread_cond_signal(&c->out_cond);
+        return;
+    }
+    if (c->out_len + len > c->out_cap) {
+        c->out_cap = (c->out_len + len) * 2;
+        c->out = (char *)realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    pthread_cond_signal(&c->out_cond);
+}
+
+static int serve_flush(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR) return 0;
+            continue;
+        }
+        if (n <= 0) return 0;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Sends the connection's output until the reader has stopped and every
+// request is answered. Buffers are swapped so workers can keep appending
+// while a send is in progress.
+static void *serve_conn_writer(void *arg) {
+    ServeConn *c = (ServeConn *)arg;
+    char *buf = NULL;
+    size_t cap = 0;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (c->out_len == 0 && !c->dropped && (c->reading || c->head != NULL)) {
+            pthread_cond_wait(&c->out_cond, &c->lock);
+        }
+        if (c->out_len == 0 || c->dropped) break;
+        char *data = c->out;
+        size_t len = c->out_len, data_cap = c->out_cap;
+        c->out = buf;
+        c->out_cap = cap;
+        c->out_len = 0;
+        buf = data;
+        cap = data_cap;
+        pthread_mutex_unlock(&c->lock);
+        int ok = serve_flush(c->fd, buf, len);
+        pthread_mutex_lock(&c->lock);
+        if (!ok) break;
+    }
+    c->dropped = 1;
+    c->out_len = 0;
+    pthread_mutex_unlock(&c->lock);
+    free(buf);
+
+    pthread_mutex_lock(&serve_live_lock);
+    ServeConn **p = &serve_writers;
+    while (*p != c) p = &(*p)->next_writer;
+    *p = c->next_writer;
+    pthread_cond_broadcast(&serve_live_cond);
+    pthread_mutex_unlock(&serve_live_lock);
+    serve_conn_release(c);
+    return NULL;
+}
+
+// Writes line for req now if it is the oldest unanswered request on its
+// connection, or holds it until the requests before it are answered.
+static void serve_emit(ServeRequest *req, const char *line, size_t len) {
+    ServeConn *c = req->conn;
+    pthread_mutex_lock(&c->lock);
+    if (c->head == req) {
+        serve_send(c, line, len);
+    } else {
+        if (req->held_len + len > req->held_cap) {
+            req->held_cap = (req->held_len + len) * 2;
+            req->held = (char *)realloc(req->held, req->held_cap);
+        }
+        memcpy(req->held + req->held_len, line, len);
+        req->held_len += len;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Drops one hold on req. When the last one goes, every finished request at
+// the front of the connection is terminated and the next one's held lines
+// are sent.
+static void serve_request_done(ServeRequest *req) {
+    if (atomic_fetch_sub(&req->pending, 1) != 1) {
+        return;
+    }
+    ServeConn *c = req->conn;
+    int finished = 0;
+    pthread_mutex_lock(&c->lock);
+    req->complete = 1;
+    while (c->head != NULL && c->head->complete) {
+        ServeRequest *done = c->head;
+        serve_send(c, "\n", 1);
+        c->head = done->next;
+        if (c->head == NULL) c->tail = NULL;
+        free(done->held);
+        free(done);
+        finished++;
+        if (c->head != NULL && c->head->held_len > 0) {
+            serve_send(c, c->head->held, c->head->held_len);
+            c->head->held_len = 0;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    while (finished-- > 0) {
+        serve_conn_release(c);
+    }
+}
+
+static void serve_result(const FileTask *task, const unsigned char *digest) {
+    ServeRequest *req = (ServeRequest *)task->owner;
+    size_t plen = strlen(task->path);
+    char *line = (char *)malloc(plen + 3 + 2 * HASH_MAX_DIGEST);
+    memcpy(line, task->path, plen);
+    line[plen] = ' ';
+    format_hex(digest, hash_engine->digest_len, line + plen + 1);
+    size_t len = plen + 1 + 2 * (size_t)hash_engine->digest_len;
+    line[len++] = '\n';
+    serve_emit(req, line, len);
+    free(line);
+    serve_request_done(req);
+}
+
+typedef struct {
+    ServeRequest *req;
+    FileTask tasks[SERVE_BATCH];
+    int count;
+} ServeBatch;
+
+static void serve_batch_flush(ServeBatch *b) {
+    if (b->count > 0) {
+        queue_enqueue_tasks(queue, b->tasks, b->count);
+        b->count = 0;
+    }
+}
+
+static void serve_add_file(ServeBatch *b, const char *path) {
+    FileTask task = path_store(path);
+    task.owner = b->req;
+    atomic_fetch_add(&b->req->pending, 1);
+    b->tasks[b->count++] = task;
+    if (b->count == SERVE_BATCH) {
+        serve_batch_flush(b);
+    }
+}
+
+static void serve_add_path(ServeBatch *b, const char *path, int depth) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        char line[MAX_PATH + 32];
+        int len = snprintf(line, sizeof(line), "!Cannot access: %s\n", path);
+        serve_emit(b->req, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        serve_add_file(b, path);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode) || depth > 64) {
+        return;
+    }
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *e;
+    char child[MAX_PATH];
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, e->d_name) >= (int)sizeof(child)) continue;
+        serve_add_path(b, child, depth + 1);
+    }
+    closedir(d);
+}
+
+// Hashes LEN raw bytes from the connection inline and answers them as "-".
+static int serve_add_data(ServeBatch *b, FILE *in, size_t len) {
+    unsigned char chunk[64 * 1024];
+    HashCtx ctx;
+    hash_engine->init(&ctx);
+    while (len > 0) {
+        size_t n = fread(chunk, 1, len < sizeof(chunk) ? len : sizeof(chunk), in);
+        if (n == 0) return 0;
+        hash_update(&ctx, chunk, n);
+        len -= n;
+    }
+    unsigned char digest[HASH_MAX_DIGEST];
+    hash_engine->final(&ctx, digest);
+    char line[2 * HASH_MAX_DIGEST + 4] = "- ";
+    format_hex(digest, hash_engine->digest_len, line + 2);
+    size_t llen = 2 + 2 * (size_t)hash_engine->digest_len;
+    line[llen++] = '\n';
+    serve_emit(b->req, line, llen);
+    return 1;
+}
+
+static ServeRequest *serve_request_begin(ServeConn *c) {
+    ServeRequest *req = (ServeRequest *)calloc(1, sizeof(ServeRequest));
+    req->base.kind = OWNER_REQUEST;
+    req->conn = c;
+    atomic_init(&req->pending, 1);
+    atomic_fetch_add(&c->refs, 1);
+    pthread_mutex_lock(&c->lock);
+    if (c->tail) c->tail->next = req;
+    else c->head = req;
+    c->tail = req;
+    pthread_mutex_unlock(&c->lock);
+    return req;
+}
+
+static void *serve_conn_thread(void *arg) {
+    ServeConn *c = (ServeConn *)arg;
+    stats_register("conn", c->fd);
+    FILE *in = fdopen(dup(c->fd), "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    ServeBatch b;
+    b.req = NULL;
+    b.count = 0;
+
+    while (in != NULL && (len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0) {
+            if (b.req == NULL) b.req = serve_request_begin(c);
+            serve_batch_flush(&b);
+            serve_request_done(b.req);
+            b.req = NULL;
+            continue;
+        }
+        if (b.req == NULL) b.req = serve_request_begin(c);
+        if (strncmp(line, ":data ", 6) == 0) {
+            if (!serve_add_data(&b, in, (size_t)strtoull(line + 6, NULL, 10))) break;
+        } else {
+            serve_add_path(&b, line, 0);
+        }
+    }
+    if (b.req != NULL) {
+        serve_batch_flush(&b);
+        serve_request_done(b.req);
+    }
+    free(line);
+    if (in != NULL) fclose(in);
+    path_store_flush();
+
+    pthread_mutex_lock(&c->lock);
+    c->reading = 0;
+    pthread_cond_signal(&c->out_cond);
+    pthread_mutex_unlock(&c->lock);
+
+    pthread_mutex_lock(&serve_live_lock);
+    ServeConn **p = &serve_live;
+    while (*p != c) p = &(*p)->next_live;
+    *p = c->next_live;
+    pthread_cond_broadcast(&serve_live_cond);
+    pthread_mutex_unlock(&serve_live_lock);
+    serve_conn_release(c);
+    return NULL;
+}
+
+// Accepts connections until SIGINT or SIGTERM, which the caller has blocked.
+int serve_main(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 64) == -1) {
+        perror(socket_path);
+        if (lfd != -1) close(lfd);
+        return 1;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    int sfd = signalfd(-1, &set, SFD_CLOEXEC);
+
+    for (;;) {
+        struct pollfd fds[2] = {{lfd, POLLIN, 0}, {sfd, POLLIN, 0}};
+        if (poll(fds, sfd != -1 ? 2 : 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) continue;
+        ServeConn *c = (ServeConn *)calloc(1, sizeof(ServeConn));
+        c->fd = fd;
+        c->reading = 1;
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->out_cond, NULL);
+        atomic_init(&c->refs, 2);
+        pthread_mutex_lock(&serve_live_lock);
+        pthread_t tid, wtid;
+        if (pthread_create(&wtid, NULL, serve_conn_writer, c) != 0) {
+            pthread_mutex_unlock(&serve_live_lock);
+            atomic_store(&c->refs, 1);
+            serve_conn_release(c);
+            continue;
+        }
+        pthread_detach(wtid);
+        c->next_writer = serve_writers;
+        serve_writers = c;
+        c->next_live = serve_live;
+        serve_live = c;
+        if (pthread_create(&tid, NULL, serve_conn_thread, c) != 0) {
+            serve_live = c->next_live;
+            pthread_mutex_unlock(&serve_live_lock);
+            pthread_mutex_lock(&c->lock);
+            c->reading = 0;
+            pthread_cond_signal(&c->out_cond);
+            pthread_mutex_unlock(&c->lock);
+            serve_conn_release(c);
+            continue;
+        }
+        pthread_mutex_unlock(&serve_live_lock);
+        pthread_detach(tid);
+    }
+
+    if (sfd != -1) close(sfd);
+    close(lfd);
+    unlink(socket_path);
+
+    // Requests already read are still answered once the workers drain.
+    pthread_mutex_lock(&serve_live_lock);
+    for (ServeConn *c = serve_live; c != NULL; c = c->next_live) {
+        shutdown(c->fd, SHUT_RD);
+    }
+    while (serve_live != NULL) {
+        pthread_cond_wait(&serve_live_cond, &serve_live_lock);
+    }
+    pthread_mutex_unlock(&serve_live_lock);
+    return 0;
+}
+
+// Called once the workers are joined: gives the writers SERVE_DRAIN_SEC to
+// deliver the last answers, then cuts off clients that are not reading.
+void serve_finish(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SERVE_DRAIN_SEC;
+    int cut = 0;
+    pthread_mutex_lock(&serve_live_lock);
+    while (serve_writers != NULL) {
+        if (cut) {
+            pthread_cond_wait(&serve_live_cond, &serve_live_lock);
+        } else if (pthread_cond_timedwait(&serve_live_cond, &serve_live_lock, &deadline) == ETIMEDOUT) {
+            for (ServeConn *c = serve_writers; c != NULL; c = c->next_writer) {
+                shutdown(c->fd, SHUT_RDWR);
+            }
+            cut = 1;
+        }
+    }
+    pthread_mutex_unlock(&serve_live_lock);
+}
+
+// Client mode (--client=SOCKET): sends every argument as its own pipelined
+// request and prints the answers as md5hash would. Arguments are sent as
+// absolute paths and printed as given; "-" sends standard input as data.
+typedef struct {
+    int fd;
+    char **paths;
+    int count;
+} ClientSend;
+
+static void client_send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static void *client_sender(void *arg) {
+    ClientSend *cs = (ClientSend *)arg;
+    for (int i = 0; i < cs->count; i++) {
+        if (strcmp(cs->paths[i], "-") == 0) {
+            size_t cap = 1 << 16, len = 0;
+            char *data = (char *)malloc(cap);
+            size_t n;
+            while ((n = fread(data + len, 1, cap - len, stdin)) > 0) {
+                len += n;
+                if (len == cap) data = (char *)realloc(data, cap *= 2);
+            }
+            char head[64];
+            int hlen = snprintf(head, sizeof(head), ":data %zu\n", len);
+            client_send_all(cs->fd, head, (size_t)hlen);
+            client_send_all(cs->fd, data, len);
+            client_send_all(cs->fd, "\n", 1);
+            free(data);
+        } else {
+            client_send_all(cs->fd, cs->paths[i], strlen(cs->paths[i]));
+            client_send_all(cs->fd, "\n\n", 2);
+        }
+    }
+    shutdown(cs->fd, SHUT_WR);
+    return NULL;
+}
+
+int client_main(const char *socket_path, char **args, int count) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(socket_path);
+        return 1;
+    }
+
+    ClientSend cs = {fd, (char **)malloc(sizeof(char *) * count), count};
+    for (int i = 0; i < count; i++) {
+        char *abs = strcmp(args[i], "-") == 0 ? NULL : realpath(args[i], NULL);
+        cs.paths[i] = abs ? abs : strdup(args[i]);
+    }
+    pthread_t sender;
+    pthread_create(&sender, NULL, client_sender, &cs);
+
+    FILE *in = fdopen(fd, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int current = 0, status = 0;
+    while (current < count && (len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0) {
+            current++;
+        } else if (line[0] == '!') {
+            fprintf(stderr, "%s\n", line + 1);
+            status = 1;
+        } else {
+            // Print the path as the user wrote it, not as it was sent.
+            size_t plen = strlen(cs.paths[current]);
+            if (strncmp(line, cs.paths[current], plen) == 0 && strcmp(args[current], "-") != 0) {
+                fputs(args[current], stdout);
+                fputs(line + plen, stdout);
+            } else {
+                fputs(line, stdout);
+            }
+            fputc('\n', stdout);
+        }
+    }
+    if (current < count) {
+        fprintf(stderr, "Connection to %s closed early\n", socket_path);
+        status = 1;
+    }
+
+    pthread_join(sender, NULL);
+    fclose(in);
+    free(line);
+    for (int i = 0; i < count; i++) free(cs.paths[i]);
+    free(cs.paths);
+    return status;
+}
+
+static void print_usage(const char *argv0) {
+    char prog_buf[MAX_PATH];
+    strncpy(prog_buf, argv0 ? argv0 : "md5hash", sizeof(prog_buf)-1);
+    prog_buf[sizeof(prog_buf)-1] = '\0';
+    char *prog = basename(prog_buf);
+    fprintf(stderr, "USAGE: %s [options] <directory/file> [more directories/files]\n", prog);
+    fprintf(stderr, "  --algo=md5|sha256|xxh64           digest algorithm (default: md5)\n");
+    fprintf(stderr, "  --kernel=scalar|sse2|avx2|avx512  MD5 kernel (default: widest supported); scalar\n");
+    fprintf(stderr, "                                    also keeps SHA-256 off the SHA extensions\n");
+    fprintf(stderr, "  --io=stdio|read|mmap|direct|auto  file reading backend (default: auto)\n");
+    fprintf(stderr, "  --io=uring|threads                asynchronous read pipeline feeding the hash workers\n");
+    fprintf(stderr, "  --small-max=SIZE                  batch files up to SIZE per directory into one task and\n");
+    fprintf(stderr, "                                    read each with one read() (default: 16K, 0: off)\n");
+    fprintf(stderr, "  --io-depth=N                      reads kept in flight by the pipeline (default: 32)\n");
+    fprintf(stderr, "  --block-size=SIZE                 read buffer size, multiple of 4K (default: 256K)\n");
+    fprintf(stderr, "  --direct-above=SIZE               auto: use O_DIRECT for files of at least SIZE\n");
+    fprintf(stderr, "  --threads=N                       hash worker threads (default: CPUs in the affinity mask)\n");
+    fprintf(stderr, "  --io-threads=N                    reader threads for --io=threads (default: --io-depth)\n");
+    fprintf(stderr, "  --pin                             pin hash workers to CPUs; their buffers stay node-local\n");
+    fprintf(stderr, "  --autotune                        pick the worker count by timing a sample of the tree\n");
+    fprintf(stderr, "  --walk-threads=N                  directory traversal threads (default: --threads)\n");
+    fprintf(stderr, "  --getdents                        list directories with batched getdents64\n");
+    fprintf(stderr, "  --tree=CHUNK                      split files over CHUNK (a multiple of 1M) across all\n");
+    fprintf(stderr, "                                    workers; their digest is the hash of the chunk digests\n");
+    fprintf(stderr, "  --sorted                          print results sorted by path once hashing is done\n");
+    fprintf(stderr, "  --format=text|nul|bin             \"path HASH\" lines, NUL-terminated records, or binary\n");
+    fprintf(stderr, "  --dupes                           report groups of identical files instead of hashes\n");
+    fprintf(stderr, "  --walk-only                       traverse and report discovery rate without hashing\n");
+    fprintf(stderr, "  --cache=PATH                      digest cache file (default: ~/.cache/md5hash/cache.db)\n");
+    fprintf(stderr, "  --no-cache                        hash every file, neither reading nor updating the cache\n");
+    fprintf(stderr, "  --rebuild-cache                   discard the cache and record fresh digests\n");
+    fprintf(stderr, "  --drop-cache                      drop read pages from the page cache after hashing\n");
+    fprintf(stderr, "  --progress                        print a progress line on stderr every second\n");
+    fprintf(stderr, "  --stats                           print per-thread counters and latency histograms at exit\n");
+    fprintf(stderr, "  --stats-json=FILE                 write the same counters to FILE as JSON\n");
+    fprintf(stderr, "  -c, --check                       verify the manifests given instead of paths (\"-\" or none:\n");
+    fprintf(stderr, "                                    stdin), in this program's or md5sum's format\n");
+    fprintf(stderr, "  --fail-fast                       with -c, stop at the first FAILED or MISSING file\n");
+    fprintf(stderr, "  --watch                           after the first pass, rehash files as they are written\n");
+    fprintf(stderr, "                                    (fanotify if permitted, else inotify) until SIGINT\n");
+    fprintf(stderr, "  --watch-delay=MS                  quiet time before a changed file is rehashed (default: 200)\n");
+    fprintf(stderr, "  (SIGUSR1 prints the current counters at any time)\n");
+    fprintf(stderr, "       %s --selftest\n", prog);
+    fprintf(stderr, "       %s --bench[=kernels|tree] [--bench-dir=DIR] [--bench-scale=X] [options]\n", prog);
+    fprintf(stderr, "       %s --serve=SOCKET [options]       keep the workers and cache resident and answer\n", prog);
+    fprintf(stderr, "                                    requests on a Unix socket until SIGINT or SIGTERM\n");
+    fprintf(stderr, "       %s --client=SOCKET <paths|->      hash paths (or standard input) through a server\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int first_path = 1;
+    const MD5Kernel *forced = NULL;
+    const char *cache_path = NULL;
+    int use_cache = 1;
+    int rebuild_cache = 0;
+    int autotune = 0;
+    const char *bench_what = NULL;
+    const char *bench_dir = NULL;
+    double bench_scale = 1.0;
+    const char *serve_path = NULL;
+    const char *client_path = NULL;
+    int algo_given = 0;
+
+    for (; first_path < argc && (strncmp(argv[first_path], "--", 2) == 0 || strcmp(argv[first_path], "-c") == 0);
+         first_path++) {
+        const char *arg = argv[first_path];
+        if (strcmp(arg, "--") == 0) {
+            first_path++;
+            break;
+        } else if (strcmp(arg, "--bench") == 0) {
+            bench_what = "all";
+        } else if (strncmp(arg, "--bench=", 8) == 0) {
+            bench_what = arg + 8;
+        } else if (strncmp(arg, "--bench-dir=", 12) == 0) {
+            bench_dir = arg + 12;
+        } else if (strncmp(arg, "--bench-scale=", 14) == 0) {
+            bench_scale = atof(arg + 14);
+            if (bench_scale <= 0) {
+                fprintf(stderr, "Benchmark scale must be positive\n");
+                return 1;
+            }
+        } else if (strncmp(arg, "--serve=", 8) == 0) {
+            serve_path = arg + 8;
+        } else if (strncmp(arg, "--client=", 9) == 0) {
+            client_path = arg + 9;
+        } else if (strcmp(arg, "--selftest") == 0) {
+            return hash_selftest();
+        } else if (strncmp(arg, "--kernel=", 9) == 0) {
+            forced = md5_kernel_find(arg + 9);
+            if (forced == NULL || !md5_kernel_supported(forced)) {
+                fprintf(stderr, "Unsupported kernel: %s\n", arg + 9);
+                return 1;
+            }
+        } else if (strncmp(arg, "--algo=", 7) == 0) {
+            hash_engine = hash_engine_find(arg + 7);
+            if (hash_engine == NULL) {
+                fprintf(stderr, "Unknown algorithm: %s\n", arg + 7);
+                return 1;
+            }
+            algo_given = 1;
+        } else if (strncmp(arg, "--io=", 5) == 0) {
+            io_backend = -1;
+            for (int b = IO_STDIO; b <= IO_THREADS; b++) {
+                if (strcmp(arg + 5, io_backend_names[b]) == 0) io_backend = b;
+            }
+            if (io_backend == -1) {
+                fprintf(stderr, "Unknown I/O backend: %s\n", arg + 5);
+                return 1;
+            }
+        } else if (strncmp(arg, "--block-size=", 13) == 0) {
+            long long v = parse_size(arg + 13);
+            if (v < IO_ALIGN || v % IO_ALIGN != 0) {
+                fprintf(stderr, "Block size must be a positive multiple of %d\n", IO_ALIGN);
+                return 1;
+            }
+            io_block_size = (size_t)v;
+        } else if (strncmp(arg, "--direct-above=", 15) == 0) {
+            long long v = parse_size(arg + 15);
+            if (v < 0) {
+                fprintf(stderr, "Invalid size: %s\n", arg + 15);
+                return 1;
+            }
+            io_direct_above = (off_t)v;
+        } else if (strncmp(arg, "--small-max=", 12) == 0) {
+            long long v = parse_size(arg + 12);
+            if (v < 0) {
+                fprintf(stderr, "Invalid size: %s\n", arg + 12);
+                return 1;
+            }
+            small_max = (size_t)v;
+        } else if (strncmp(arg, "--io-depth=", 11) == 0) {
+            io_depth = atoi(arg + 11);
+            if (io_depth <= 0) {
+                fprintf(stderr, "I/O depth must be positive\n");
+                return 1;
+            }
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            num_threads = atoi(arg + 10);
+            if (num_threads <= 0) {
+                fprintf(stderr, "Thread count must be positive\n");
+                return 1;
+            }
+        } else if (strncmp(arg, "--io-threads=", 13) == 0) {
+            io_threads = atoi(arg + 13);
+            if (io_threads <= 0) {
+                fprintf(stderr, "I/O thread count must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--pin") == 0) {
+            pin_threads = 1;
+        } else if (strcmp(arg, "--autotune") == 0) {
+            autotune = 1;
+        } else if (strncmp(arg, "--walk-threads=", 15) == 0) {
+            walk_threads = atoi(arg + 15);
+            if (walk_threads <= 0) {
+                fprintf(stderr, "Walker thread count must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--getdents") == 0) {
+            walk_use_getdents = 1;
+        } else if (strncmp(arg, "--tree=", 7) == 0) {
+            long long v = parse_size(arg + 7);
+            if (v < (1 << 20) || v % (1 << 20) != 0) {
+                fprintf(stderr, "Invalid tree chunk size: %s\n", arg + 7);
+                return 1;
+            }
+            tree_chunk = (off_t)v;
+        } else if (strcmp(arg, "--sorted") == 0) {
+            out_sorted = 1;
+        } else if (strncmp(arg, "--format=", 9) == 0) {
+            if (strcmp(arg + 9, "text") == 0) out_format = OUT_TEXT;
+            else if (strcmp(arg + 9, "nul") == 0) out_format = OUT_NUL;
+            else if (strcmp(arg + 9, "bin") == 0) out_format = OUT_BIN;
+            else {
+                fprintf(stderr, "Unknown output format: %s\n", arg + 9);
+                return 1;
+            }
+        } else if (strcmp(arg, "--dupes") == 0) {
+            dupes_mode = 1;
+        } else if (strcmp(arg, "--walk-only") == 0) {
+            walk_only = 1;
+        } else if (strncmp(arg, "--cache=", 8) == 0) {
+            cache_path = arg + 8;
+        } else if (strcmp(arg, "--no-cache") == 0) {
+            use_cache = 0;
+        } else if (strcmp(arg, "--rebuild-cache") == 0) {
+            rebuild_cache = 1;
+        } else if (strcmp(arg, "--drop-cache") == 0) {
+            io_drop_cache = 1;
+        } else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--check") == 0) {
+            check_mode = 1;
+        } else if (strcmp(arg, "--fail-fast") == 0) {
+            check_fail_fast = 1;
+        } else if (strcmp(arg, "--watch") == 0) {
+            watch_mode = 1;
+        } else if (strncmp(arg, "--watch-delay=", 14) == 0) {
+            watch_delay_ms = atoi(arg + 14);
+            if (watch_delay_ms < 0) {
+                fprintf(stderr, "Watch delay must not be negative\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--progress") == 0) {
+            stats_progress = 1;
+        } else if (strcmp(arg, "--stats") == 0) {
+            stats_summary = 1;
+        } else if (strncmp(arg, "--stats-json=", 13) == 0) {
+            stats_json_path = arg + 13;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (client_path != NULL) {
+        if (first_path >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return client_main(client_path, argv + first_path, argc - first_path);
+    }
+    if (first_path >= argc && bench_what == NULL && serve_path == NULL && !check_mode) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (check_mode && (serve_path != NULL || watch_mode || dupes_mode || walk_only || out_sorted ||
+                       out_format != OUT_TEXT)) {
+        fprintf(stderr, "-c cannot be combined with --serve, --watch, --dupes, --walk-only, --sorted or --format\n");
+        return 1;
+    }
+    if (check_mode) {
+        static char *stdin_manifest[] = {"-"};
+        int ok = first_path < argc ? check_load(argv + first_path, argc - first_path, algo_given)
+                                   : check_load(stdin_manifest, 1, algo_given);
+        if (!ok) {
+            return 1;
+        }
+        // A cached digest would hide corruption that left the inode alone.
+        use_cache = 0;
+    }
+    if (watch_mode && (serve_path != NULL || dupes_mode || walk_only || out_sorted)) {
+        fprintf(stderr, "--watch cannot be combined with --serve, --dupes, --walk-only or --sorted\n");
+        return 1;
+    }
+    if (serve_path != NULL && (dupes_mode || walk_only || out_sorted || out_format != OUT_TEXT)) {
+        fprintf(stderr, "--serve answers in text and cannot be combined with --dupes, --walk-only, --sorted or --format\n");
+        return 1;
+    }
+
+    md5_kernel = forced ? forced : md5_kernel_detect();
+    if (tree_chunk > 0 && (io_backend == IO_URING || io_backend == IO_THREADS)) {
+        fprintf(stderr, "--tree needs a synchronous --io backend\n");
+        return 1;
+    }
+    if (dupes_mode && (io_backend == IO_URING || io_backend == IO_THREADS)) {
+        fprintf(stderr, "--dupes needs a synchronous --io backend\n");
+        return 1;
+    }
+    if (dupes_mode) {
+        // --dupes routes its results through the task owner field.
+        tree_chunk = 0;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if ((forced == NULL || forced->lanes > 1) && sha256_shani_supported()) {
+        sha256_blocks = sha256_blocks_shani;
+    }
+#endif
+    cpus_detect();
+    if (autotune && num_threads == 0 && !walk_only) {
+        num_threads = autotune_threads(argv + first_path, argc - first_path);
+        stats_reset();
+    }
+    if (num_threads == 0) num_threads = allowed_cpu_count;
+    if (small_max > io_block_size) small_max = io_block_size;
+    walk_batch_small = small_max > 0 && !dupes_mode && !walk_only &&
+                       (io_backend == IO_AUTO || io_backend == IO_READ);
+    if (walk_threads == 0) walk_threads = num_threads;
+
+    if (bench_what != NULL) {
+        char **pass = (char **)malloc(sizeof(char *) * argc);
+        int npass = 0;
+        for (int i = 1; i < first_path; i++) {
+            if (strncmp(argv[i], "--bench", 7) != 0 && strcmp(argv[i], "--") != 0) pass[npass++] = argv[i];
+        }
+        int rc = bench_main(bench_what, bench_dir, bench_scale, pass, npass);
+        free(pass);
+        return rc;
+    }
+    if (serve_path != NULL || watch_mode) {
+        // Blocked before any thread exists so that only the main thread's
+        // signalfd sees them.
+        sigset_t stop;
+        sigemptyset(&stop);
+        sigaddset(&stop, SIGINT);
+        sigaddset(&stop, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    }
+    stats_start();
+    queue = queue_init(1000);
+
+    if (use_cache && !walk_only) {
+        char *default_path = cache_path ? NULL : cache_default_path();
+        if (cache_path || default_path) {
+            cache = cache_open(cache_path ? cache_path : default_path, rebuild_cache);
+        }
+        free(default_path);
+    }
+
+    if (!walk_only && !dupes_mode) {
+        output_start();
+    }
+
+    int async_io = (io_backend == IO_URING || io_backend == IO_THREADS);
+    if (async_io && !async_io_start()) {
+        return 1;
+    }
+
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+    for (int i = 0; i < num_threads && !walk_only; i++) {
+        if (pthread_create(&threads[i], NULL, worker_thread, (void *)(intptr_t)i) != 0) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+
+    struct timespec walk_start, walk_end;
+    clock_gettime(CLOCK_MONOTONIC, &walk_start);
+    long dirs = 0, files = 0;
+    char **roots = (char **)malloc(sizeof(char *) * argc);
+    int root_count = 0;
+    int status = 0;
+
+    if (serve_path != NULL) {
+        status = serve_main(serve_path);
+        first_path = argc;
+    }
+    if (check_mode) {
+        check_enqueue();
+        first_path = argc;
+    }
+    if (watch_mode) {
+        queue_idle_hook = out_flush_local;
+        if (!watch_start(argv + first_path, argc - first_path)) {
+            return 1;
+        }
+    }
+    for (int i = first_path; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == -1) {
+            fprintf(stderr, "Cannot access: %s\n", argv[i]);
+            continue;
+        }
+        
+        if (S_ISREG(st.st_mode)) {
+            files++;
+            if (dupes_mode) dupe_list_add(&dupe_files, argv[i], st.st_size);
+            else if (!walk_only) queue_enqueue(queue, argv[i]);
+        } else if (S_ISDIR(st.st_mode)) {
+            roots[root_count++] = argv[i];
+        }
+    }
+    if (root_count > 0) {
+        walk_directories(roots, root_count, &dirs, &files);
+    }
+    free(roots);
+
+    if (walk_only) {
+        clock_gettime(CLOCK_MONOTONIC, &walk_end);
+        double secs = (double)(walk_end.tv_sec - walk_start.tv_sec) +
+                      (double)(walk_end.tv_nsec - walk_start.tv_nsec) / 1e9;
+        printf("Walked %ld directories, %ld files in %.3f s (%.0f entries/s, %d threads, %s)\n",
+               dirs, files, secs, secs > 0 ? (double)(dirs + files) / secs : 0.0,
+               walk_threads, walk_use_getdents ? "getdents64" : "readdir");
+    }
+
+    if (dupes_mode) {
+        dupes_report();
+    }
+    if (watch_mode) {
+        watch_main();
+    }
+
+    path_store_flush();
+    queue_close(queue);
+    
+    for (int i = 0; i < num_threads && !walk_only; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "Failed to join thread %d\n", i);
+            return 1;
+        }
+    }
+
+    if (async_io) {
+        async_io_stop();
+    }
+    if (serve_path != NULL) {
+        serve_finish();
+    }
+    
+    output_finish();
+    if (check_mode) {
+        status = check_report();
+    }
+    stats_finish();
+    if (cache != NULL) {
+        cache_close(cache);
+    }
+    queue_free(queue);
+    free(threads);
+    free(allowed_cpus);
+    pthread_mutex_destroy(&output_lock);
+    
+    return status;
 }
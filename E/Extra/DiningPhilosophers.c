@@ -1,24 +1,62 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <pthread.h>
+#include <linux/futex.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
 #define PHIL_COUNT 5
-
+#define CACHE_LINE 64
+#define TABLE_MAX_ROWS 32
+#define THREAD_STACK_SIZE (128 * 1024)
+#define STARVING_REPORT_MAX 10
+// Hungry-to-eating waits in microseconds: four sub-buckets per power of two,
+// so a percentile read from a bucket bound is within 25% of the real value.
+#define WAIT_SUB_BUCKETS 4
+#define WAIT_BUCKETS (WAIT_SUB_BUCKETS * 40)
+
+typedef enum { PH_THINKING, PH_HUNGRY, PH_EATING } PhilState;
+static const char *const state_names[] = {"thinking", "hungry", "eating"};
+
+typedef enum { DINE_THINKING, DINE_HUNGRY, DINE_EATING } DineState;
+
+// Each philosopher and each chopstick gets its own cache line(s), so a thread
+// updating its own slot does not invalidate its neighbours' lines. The
+// counters have a single writer, the philosopher's own thread, and are read
+// with relaxed loads by the monitor and main.
 typedef struct Philosopher {
     int id;
-    char state[16];
-    int meals;
-    double last_meal_at;
-} Philosopher;
+    atomic_int state;
+    atomic_int meals;
+    _Atomic double last_meal_at;
+    _Atomic double wait_total;
+    _Atomic double wait_max;
+    atomic_uint wait_hist[WAIT_BUCKETS];
+    DineState dine;        // monitor: guarded by monitor_lock
+    pthread_cond_t cond;   // monitor: signalled when both neighbours let us eat
+    atomic_uint wake;      // futex: bumped by a neighbour putting down a fork we wait on
+} __attribute__((aligned(CACHE_LINE))) Philosopher;
+
+typedef struct Chopstick {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;   // chandy-misra: broadcast when the fork becomes dirty
+    atomic_int held;       // futex: 0 free, 1 held, 2 held and the neighbour is waiting
+    int owner;             // chandy-misra
+    int requester;         // chandy-misra: neighbour holding the request token, or -1
+    int dirty;
+    int in_use;
+} __attribute__((aligned(CACHE_LINE))) Chopstick;
+
+struct Strategy;
 
 typedef struct Config {
     double run_time_sec;
@@ -26,9 +64,12 @@ typedef struct Config {
     double max_eat_sec;
     double timeout_sec;
     double starvation_limit_sec;
+    double sample_sec;
+    int count;
+    const struct Strategy *strategy;
 } Config;
 
-static volatile int running = 1;
+static atomic_int running = 1;
 
 static double now_monotonic_sec(void) {
     struct timespec ts;
@@ -64,156 +105,565 @@ static int mutex_timedlock_sec(pthread_mutex_t *mtx, double timeout_sec) {
     return pthread_mutex_timedlock(mtx, &abstime);
 }
 
+// Plain load and store rather than a locked read-modify-write: only the owner
+// thread writes, so the update costs no more than a non-atomic increment.
+static inline void relaxed_add_int(atomic_int *c, int d) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + d, memory_order_relaxed);
+}
+
+static inline void relaxed_add_uint(atomic_uint *c, unsigned int d) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + d, memory_order_relaxed);
+}
+
+static inline void relaxed_add_double(_Atomic double *c, double d) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + d, memory_order_relaxed);
+}
+
+static inline int wait_bucket(uint64_t us) {
+    if (us < WAIT_SUB_BUCKETS) return (int)us;
+    int e = 63 - __builtin_clzll(us);
+    int b = (e - 1) * WAIT_SUB_BUCKETS + (int)((us >> (e - 2)) & (WAIT_SUB_BUCKETS - 1));
+    return b < WAIT_BUCKETS ? b : WAIT_BUCKETS - 1;
+}
+
+// Largest wait in microseconds that lands in bucket b.
+static uint64_t wait_bucket_upper(int b) {
+    if (b < WAIT_SUB_BUCKETS) return (uint64_t)b;
+    int e = b / WAIT_SUB_BUCKETS + 1;
+    uint64_t sub = (uint64_t)(b % WAIT_SUB_BUCKETS);
+    return ((WAIT_SUB_BUCKETS + sub + 1) << (e - 2)) - 1;
+}
+
+// Wait in seconds at quantile q, capped by the exact maximum.
+static double wait_percentile(const unsigned int *hist, double q, double max) {
+    uint64_t total = 0;
+    for (int b = 0; b < WAIT_BUCKETS; ++b) total += hist[b];
+    if (total == 0) return 0.0;
+    uint64_t rank = (uint64_t)(q * (double)total + 0.999999), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int b = 0; b < WAIT_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen >= rank) {
+            double v = (double)wait_bucket_upper(b) / 1e6;
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+static void snapshot_hist(Philosopher *ph, unsigned int *out) {
+    for (int b = 0; b < WAIT_BUCKETS; ++b) {
+        out[b] = atomic_load_explicit(&ph->wait_hist[b], memory_order_relaxed);
+    }
+}
+
+static inline void set_state(Philosopher *ph, PhilState st) {
+    atomic_store_explicit(&ph->state, st, memory_order_relaxed);
+}
+
 static inline int left_idx(int i) { return i; }
-static inline int right_idx(int i) { return (i + 1) % PHIL_COUNT; }
+static inline int right_idx(int i, int n) { return (i + 1) % n; }
 
 typedef struct ThreadArgs {
     Philosopher *ph;
-    pthread_mutex_t *chopsticks;
+    Philosopher *philosophers;
+    Chopstick *chopsticks;
     Config *cfg;
 } ThreadArgs;
 
+// acquire returns 1 once both chopsticks are held and 0 if the philosopher
+// gave up and should back off; release puts both chopsticks down again.
+typedef struct Strategy {
+    const char *name;
+    const char *summary;
+    int (*acquire)(ThreadArgs *ta);
+    void (*release)(ThreadArgs *ta);
+} Strategy;
+
+static int timed_acquire(ThreadArgs *ta) {
+    Philosopher *ph = ta->ph;
+    Chopstick *chop = ta->chopsticks;
+    Config *cfg = ta->cfg;
+
+    double start_wait = now_monotonic_sec();
+    int first_is_left = (ph->id % 2 == 0);
+    int first = first_is_left ? left_idx(ph->id) : right_idx(ph->id, cfg->count);
+    int second = first_is_left ? right_idx(ph->id, cfg->count) : left_idx(ph->id);
+
+    // Acquire first with timeout
+    if (mutex_timedlock_sec(&chop[first].mutex, cfg->timeout_sec) != 0) return 0;
+    double elapsed = now_monotonic_sec() - start_wait;
+    double remaining = cfg->timeout_sec - elapsed;
+    if (remaining < 0) remaining = 0;
+    if (mutex_timedlock_sec(&chop[second].mutex, remaining) != 0) {
+        pthread_mutex_unlock(&chop[first].mutex);
+        return 0;
+    }
+    return 1;
+}
+
+static void timed_release(ThreadArgs *ta) {
+    pthread_mutex_unlock(&ta->chopsticks[left_idx(ta->ph->id)].mutex);
+    pthread_mutex_unlock(&ta->chopsticks[right_idx(ta->ph->id, ta->cfg->count)].mutex);
+}
+
+// Classic monitor: one lock over every philosopher's dine state, and a
+// philosopher may only start eating while neither neighbour is eating.
+static pthread_mutex_t monitor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void monitor_test(ThreadArgs *ta, int i) {
+    Philosopher *all = ta->philosophers;
+    int n = ta->cfg->count;
+    if (all[i].dine == DINE_HUNGRY && all[(i + n - 1) % n].dine != DINE_EATING &&
+        all[(i + 1) % n].dine != DINE_EATING) {
+        all[i].dine = DINE_EATING;
+        pthread_cond_signal(&all[i].cond);
+    }
+}
+
+static int monitor_acquire(ThreadArgs *ta) {
+    pthread_mutex_lock(&monitor_lock);
+    ta->ph->dine = DINE_HUNGRY;
+    monitor_test(ta, ta->ph->id);
+    while (ta->ph->dine != DINE_EATING) pthread_cond_wait(&ta->ph->cond, &monitor_lock);
+    pthread_mutex_unlock(&monitor_lock);
+    return 1;
+}
+
+static void monitor_release(ThreadArgs *ta) {
+    int n = ta->cfg->count;
+    pthread_mutex_lock(&monitor_lock);
+    ta->ph->dine = DINE_THINKING;
+    monitor_test(ta, (ta->ph->id + n - 1) % n);
+    monitor_test(ta, (ta->ph->id + 1) % n);
+    pthread_mutex_unlock(&monitor_lock);
+}
+
+static void futex_wait(atomic_uint *addr, unsigned int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// A chopstick is shared by exactly two philosophers, so a waiter only has to
+// flag the chopstick and sleep on its own word; the holder wakes just that
+// neighbour when it puts the chopstick down.
+static void futex_take(Chopstick *c, Philosopher *ph) {
+    int expected = 0;
+    while (!atomic_compare_exchange_strong(&c->held, &expected, 1)) {
+        unsigned int seq = atomic_load(&ph->wake);
+        if (expected == 1 && !atomic_compare_exchange_strong(&c->held, &expected, 2)) {
+            expected = 0;
+            continue;
+        }
+        futex_wait(&ph->wake, seq);
+        expected = 0;
+    }
+}
+
+static void futex_put(ThreadArgs *ta, int idx) {
+    if (atomic_exchange(&ta->chopsticks[idx].held, 0) != 2) return;
+    int n = ta->cfg->count;
+    Philosopher *other = &ta->philosophers[ta->ph->id == idx ? (idx + n - 1) % n : idx];
+    atomic_fetch_add(&other->wake, 1);
+    futex_wake(&other->wake);
+}
+
+static int futex_acquire(ThreadArgs *ta) {
+    int l = left_idx(ta->ph->id), r = right_idx(ta->ph->id, ta->cfg->count);
+    // Lower index first: a global order on the chopsticks rules out a cycle.
+    futex_take(&ta->chopsticks[l < r ? l : r], ta->ph);
+    futex_take(&ta->chopsticks[l < r ? r : l], ta->ph);
+    return 1;
+}
+
+static void futex_release(ThreadArgs *ta) {
+    futex_put(ta, left_idx(ta->ph->id));
+    futex_put(ta, right_idx(ta->ph->id, ta->cfg->count));
+}
+
+// Chandy-Misra: a hungry philosopher that does not own a chopstick sends the
+// request token for it. The owner keeps a clean chopstick until it has eaten,
+// but must hand a dirty, requested one over, cleaned, before using it again.
+// An owner that is thinking cannot answer, so the requester may make the
+// hand-over itself under the chopstick's lock.
+static void cm_hand_over(Chopstick *c) {
+    c->owner = c->requester;
+    c->requester = -1;
+    c->dirty = 0;
+    pthread_cond_broadcast(&c->cond);
+}
+
+static void cm_fetch(Chopstick *c, int id) {
+    pthread_mutex_lock(&c->mutex);
+    while (c->owner != id || (c->dirty && c->requester != -1)) {
+        if (c->owner == id) {
+            cm_hand_over(c);
+        } else {
+            c->requester = id;
+            if (c->dirty && !c->in_use) cm_hand_over(c);
+            else pthread_cond_wait(&c->cond, &c->mutex);
+        }
+    }
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static int cm_acquire(ThreadArgs *ta) {
+    int id = ta->ph->id;
+    int l = left_idx(id), r = right_idx(id, ta->cfg->count);
+    Chopstick *lo = &ta->chopsticks[l < r ? l : r], *hi = &ta->chopsticks[l < r ? r : l];
+    // A dirty chopstick we own can be requested while we fetch the other one,
+    // so check both under their locks before starting to eat.
+    for (;;) {
+        cm_fetch(lo, id);
+        cm_fetch(hi, id);
+        pthread_mutex_lock(&lo->mutex);
+        pthread_mutex_lock(&hi->mutex);
+        int ok = lo->owner == id && hi->owner == id && !(lo->dirty && lo->requester != -1) &&
+                 !(hi->dirty && hi->requester != -1);
+        if (ok) lo->in_use = hi->in_use = 1;
+        pthread_mutex_unlock(&hi->mutex);
+        pthread_mutex_unlock(&lo->mutex);
+        if (ok) return 1;
+    }
+}
+
+static void cm_release(ThreadArgs *ta) {
+    int idx[2] = {left_idx(ta->ph->id), right_idx(ta->ph->id, ta->cfg->count)};
+    for (int k = 0; k < 2; ++k) {
+        Chopstick *c = &ta->chopsticks[idx[k]];
+        pthread_mutex_lock(&c->mutex);
+        c->dirty = 1;
+        c->in_use = 0;
+        // A request that arrived while we ate is answered now.
+        if (c->requester != -1) cm_hand_over(c);
+        pthread_mutex_unlock(&c->mutex);
+    }
+}
+
+static const Strategy strategies[] = {
+    {"timed", "Asymmetric pickup with timeout-based release to avoid deadlock.", timed_acquire, timed_release},
+    {"monitor", "Monitor: eat only when both neighbours are not eating, wait on a condition variable.",
+     monitor_acquire, monitor_release},
+    {"futex", "Ordered pickup, blocked philosophers sleep on a futex woken by the neighbour.", futex_acquire,
+     futex_release},
+    {"chandy-misra", "Chandy-Misra dirty/clean chopsticks, handed over only when dirty.", cm_acquire,
+     cm_release},
+};
+#define STRATEGY_COUNT (int)(sizeof(strategies) / sizeof(strategies[0]))
+
 static void *philosopher_thread(void *arg) {
     ThreadArgs *ta = (ThreadArgs *)arg;
     Philosopher *ph = ta->ph;
-    pthread_mutex_t *chop = ta->chopsticks;
     Config *cfg = ta->cfg;
 
     unsigned int seed = (unsigned int)(time(NULL) ^ (ph->id * 2654435761u));
 
-    while (running) {
-        strncpy(ph->state, "thinking", sizeof(ph->state) - 1);
-        ph->state[sizeof(ph->state) - 1] = '\0';
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        set_state(ph, PH_THINKING);
         sleep_sec(rand_range(&seed, 0.1, cfg->max_think_sec));
 
-        strncpy(ph->state, "hungry", sizeof(ph->state) - 1);
-        ph->state[sizeof(ph->state) - 1] = '\0';
-
-        double start_wait = now_monotonic_sec();
-        int first_is_left = (ph->id % 2 == 0);
-        int first = first_is_left ? left_idx(ph->id) : right_idx(ph->id);
-        int second = first_is_left ? right_idx(ph->id) : left_idx(ph->id);
-
-        int got_first = 0, got_second = 0;
-        // Acquire first with timeout
-        if (mutex_timedlock_sec(&chop[first], cfg->timeout_sec) == 0) {
-            got_first = 1;
-            double elapsed = now_monotonic_sec() - start_wait;
-            double remaining = cfg->timeout_sec - elapsed;
-            if (remaining < 0) remaining = 0;
-            if (mutex_timedlock_sec(&chop[second], remaining) == 0) {
-                got_second = 1;
-            } else {
-                pthread_mutex_unlock(&chop[first]);
-                got_first = 0;
-            }
-        }
+        set_state(ph, PH_HUNGRY);
+        double hungry_since = now_monotonic_sec();
 
-        if (!(got_first && got_second)) {
+        // A timed-out attempt backs off and retries while still hungry, so the
+        // wait covers every attempt but no thinking.
+        int got;
+        while (!(got = cfg->strategy->acquire(ta)) && atomic_load_explicit(&running, memory_order_relaxed)) {
             sleep_sec(rand_range(&seed, 0.01, 0.05));
-            continue;
         }
+        if (!got) break;
 
-        strncpy(ph->state, "eating", sizeof(ph->state) - 1);
-        ph->state[sizeof(ph->state) - 1] = '\0';
-        ph->meals += 1;
-        ph->last_meal_at = now_monotonic_sec();
+        set_state(ph, PH_EATING);
+        double ate_at = now_monotonic_sec();
+        relaxed_add_int(&ph->meals, 1);
+        atomic_store_explicit(&ph->last_meal_at, ate_at, memory_order_relaxed);
         sleep_sec(rand_range(&seed, 0.1, cfg->max_eat_sec));
 
-        pthread_mutex_unlock(&chop[left_idx(ph->id)]);
-        pthread_mutex_unlock(&chop[right_idx(ph->id)]);
-        strncpy(ph->state, "thinking", sizeof(ph->state) - 1);
-        ph->state[sizeof(ph->state) - 1] = '\0';
+        cfg->strategy->release(ta);
+        set_state(ph, PH_THINKING);
+
+        // Recorded once the chopsticks are down, so it never lengthens the
+        // time they are held.
+        double waited = ate_at - hungry_since;
+        relaxed_add_uint(&ph->wait_hist[wait_bucket((uint64_t)(waited * 1e6))], 1);
+        relaxed_add_double(&ph->wait_total, waited);
+        if (waited > atomic_load_explicit(&ph->wait_max, memory_order_relaxed)) {
+            atomic_store_explicit(&ph->wait_max, waited, memory_order_relaxed);
+        }
     }
 
     return NULL;
 }
 
+typedef struct MonitorArgs {
+    Philosopher *philosophers;
+    Config *cfg;
+    double start;
+    char *starving;           // per philosopher: currently over the starvation limit
+    int starvation_events;
+    double worst_stall;
+} MonitorArgs;
+
+// Samples the philosophers' relaxed counters without taking any lock, prints
+// live throughput and flags a philosopher as soon as its last meal is older
+// than the starvation limit.
+static void *monitor_thread(void *arg) {
+    MonitorArgs *ma = (MonitorArgs *)arg;
+    Config *cfg = ma->cfg;
+    int n = cfg->count;
+    long prev_meals = 0;
+    double prev_at = ma->start, next_at = ma->start + cfg->sample_sec;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        double now = now_monotonic_sec();
+        if (now < next_at) {
+            sleep_sec(next_at - now < 0.05 ? next_at - now : 0.05);
+            continue;
+        }
+        next_at += cfg->sample_sec;
+
+        long meals = 0;
+        int by_state[3] = {0, 0, 0}, starving = 0;
+        for (int i = 0; i < n; ++i) {
+            Philosopher *ph = &ma->philosophers[i];
+            meals += atomic_load_explicit(&ph->meals, memory_order_relaxed);
+            by_state[atomic_load_explicit(&ph->state, memory_order_relaxed)]++;
+            double since = now - atomic_load_explicit(&ph->last_meal_at, memory_order_relaxed);
+            if (since > ma->worst_stall) ma->worst_stall = since;
+            if (since <= cfg->starvation_limit_sec) {
+                ma->starving[i] = 0;
+                continue;
+            }
+            starving++;
+            if (ma->starving[i]) continue;
+            ma->starving[i] = 1;
+            if (++ma->starvation_events <= STARVING_REPORT_MAX) {
+                printf("[%7.2fs] philosopher %d starving: %.2fs since last meal\n", now - ma->start, i, since);
+            }
+        }
+        printf("[%7.2fs] %8.1f meals/s | thinking %d, hungry %d, eating %d | starving %d\n", now - ma->start,
+               (meals - prev_meals) / (now - prev_at), by_state[PH_THINKING], by_state[PH_HUNGRY],
+               by_state[PH_EATING], starving);
+        fflush(stdout);
+        prev_meals = meals;
+        prev_at = now;
+    }
+    return NULL;
+}
+
 static void print_usage(void) {
-    fprintf(stderr, "Usage: ./dining_philosophers_c [--run-time=SEC] [--max-think=SEC] [--max-eat=SEC] [--timeout=SEC] [--starvation-limit=SEC]\n");
+    fprintf(stderr, "Usage: ./dining_philosophers_c [--count=N] [--run-time=SEC] [--max-think=SEC] [--max-eat=SEC] [--timeout=SEC] [--starvation-limit=SEC]\n"
+                    "       [--strategy=timed|monitor|futex|chandy-misra] [--sample=SEC]\n");
+}
+
+static const Strategy *find_strategy(const char *name) {
+    for (int i = 0; i < STRATEGY_COUNT; ++i) {
+        if (strcmp(strategies[i].name, name) == 0) return &strategies[i];
+    }
+    return NULL;
 }
 
 static Config parse_args(int argc, char **argv) {
-    Config cfg = {10.0, 1.5, 1.0, 1.0, 5.0};
+    Config cfg = {10.0, 1.5, 1.0, 1.0, 5.0, 1.0, PHIL_COUNT, &strategies[0]};
     for (int i = 1; i < argc; ++i) {
         const char *arg = argv[i];
         if (strncmp(arg, "--run-time=", 11) == 0) cfg.run_time_sec = atof(arg + 11);
         else if (strncmp(arg, "--max-think=", 12) == 0) cfg.max_think_sec = atof(arg + 12);
-        else if (strncmp(arg, "--max-eat=", 11) == 0) cfg.max_eat_sec = atof(arg + 11);
+        else if (strncmp(arg, "--max-eat=", 10) == 0) cfg.max_eat_sec = atof(arg + 10);
         else if (strncmp(arg, "--timeout=", 10) == 0) cfg.timeout_sec = atof(arg + 10);
-        else if (strncmp(arg, "--starvation-limit=", 20) == 0) cfg.starvation_limit_sec = atof(arg + 20);
+        else if (strncmp(arg, "--starvation-limit=", 19) == 0) cfg.starvation_limit_sec = atof(arg + 19);
+        else if (strncmp(arg, "--count=", 8) == 0) cfg.count = atoi(arg + 8);
+        else if (strncmp(arg, "--sample=", 9) == 0) cfg.sample_sec = atof(arg + 9);
+        else if (strncmp(arg, "--strategy=", 11) == 0) {
+            cfg.strategy = find_strategy(arg + 11);
+            if (!cfg.strategy) { fprintf(stderr, "Unknown strategy: %s\n", arg + 11); print_usage(); exit(1); }
+        }
         else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) { print_usage(); exit(0); }
         else { fprintf(stderr, "Unknown arg: %s\n", arg); print_usage(); exit(1); }
     }
-    if (cfg.run_time_sec <= 0 || cfg.max_think_sec <= 0 || cfg.max_eat_sec <= 0 || cfg.timeout_sec <= 0 || cfg.starvation_limit_sec <= 0) {
+    if (cfg.run_time_sec <= 0 || cfg.max_think_sec <= 0 || cfg.max_eat_sec <= 0 || cfg.timeout_sec <= 0 || cfg.starvation_limit_sec <= 0 ||
+        cfg.sample_sec <= 0) {
         fprintf(stderr, "All time parameters must be positive.\n");
         exit(1);
     }
+    if (cfg.count < 2) {
+        fprintf(stderr, "--count must be at least 2.\n");
+        exit(1);
+    }
     return cfg;
 }
 
+// Jain's index: (sum x)^2 / (n * sum x^2), 1.0 when every philosopher ate
+// equally often and 1/n when one of them got every meal.
+static double jain_index(Philosopher *ph, int n) {
+    double sum = 0, sum_sq = 0;
+    for (int i = 0; i < n; ++i) {
+        double m = atomic_load_explicit(&ph[i].meals, memory_order_relaxed);
+        sum += m;
+        sum_sq += m * m;
+    }
+    return sum_sq > 0 ? sum * sum / (n * sum_sq) : 1.0;
+}
+
 int main(int argc, char **argv) {
     Config cfg = parse_args(argc, argv);
+    int n = cfg.count;
+
+    Chopstick *chopsticks = (Chopstick *)aligned_alloc(CACHE_LINE, sizeof(Chopstick) * n);
+    Philosopher *philosophers = (Philosopher *)aligned_alloc(CACHE_LINE, sizeof(Philosopher) * n);
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * n);
+    ThreadArgs *args = (ThreadArgs *)malloc(sizeof(ThreadArgs) * n);
+    char *starving = (char *)calloc(n, 1);
+    if (!chopsticks || !philosophers || !threads || !args || !starving) {
+        fprintf(stderr, "Out of memory for %d philosophers.\n", n);
+        return 1;
+    }
 
-    pthread_mutex_t chopsticks[PHIL_COUNT];
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
 #ifdef __linux__
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
 #endif
-    for (int i = 0; i < PHIL_COUNT; ++i) {
-        pthread_mutex_init(&chopsticks[i], &attr);
+    for (int i = 0; i < n; ++i) {
+        pthread_mutex_init(&chopsticks[i].mutex, &attr);
+        pthread_cond_init(&chopsticks[i].cond, NULL);
+        atomic_init(&chopsticks[i].held, 0);
+        // Chandy-Misra starts with every chopstick dirty at the lower-numbered
+        // of its two philosophers, which keeps the precedence graph acyclic.
+        chopsticks[i].owner = i == 0 ? 0 : i - 1;
+        chopsticks[i].requester = -1;
+        chopsticks[i].dirty = 1;
+        chopsticks[i].in_use = 0;
     }
     pthread_mutexattr_destroy(&attr);
 
-    Philosopher philosophers[PHIL_COUNT];
-    pthread_t threads[PHIL_COUNT];
+    // Thousands of threads with the default 8 MiB stacks would exhaust the
+    // address space on small machines; the philosophers need very little.
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setstacksize(&thread_attr, THREAD_STACK_SIZE);
 
     double now = now_monotonic_sec();
-    for (int i = 0; i < PHIL_COUNT; ++i) {
+    int started = 0;
+    for (int i = 0; i < n; ++i) {
+        memset(&philosophers[i], 0, sizeof(philosophers[i]));
         philosophers[i].id = i;
-        strncpy(philosophers[i].state, "thinking", sizeof(philosophers[i].state) - 1);
-        philosophers[i].state[sizeof(philosophers[i].state) - 1] = '\0';
-        philosophers[i].meals = 0;
-        philosophers[i].last_meal_at = now;
-        ThreadArgs *ta = (ThreadArgs *)malloc(sizeof(ThreadArgs));
-        ta->ph = &philosophers[i];
-        ta->chopsticks = chopsticks;
-        ta->cfg = &cfg;
-        pthread_create(&threads[i], NULL, philosopher_thread, ta);
+        atomic_init(&philosophers[i].state, PH_THINKING);
+        atomic_init(&philosophers[i].last_meal_at, now);
+        philosophers[i].dine = DINE_THINKING;
+        pthread_cond_init(&philosophers[i].cond, NULL);
+        atomic_init(&philosophers[i].wake, 0);
+        args[i].ph = &philosophers[i];
+        args[i].philosophers = philosophers;
+        args[i].chopsticks = chopsticks;
+        args[i].cfg = &cfg;
+    }
+    for (int i = 0; i < n; ++i) {
+        int rc = pthread_create(&threads[i], &thread_attr, philosopher_thread, &args[i]);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create failed for philosopher %d: %s\n", i, strerror(rc));
+            atomic_store(&running, 0);
+            break;
+        }
+        started++;
+    }
+    MonitorArgs monitor = {philosophers, &cfg, now, starving, 0, 0.0};
+    pthread_t monitor_tid;
+    int monitor_started = 0;
+    if (atomic_load(&running) && pthread_create(&monitor_tid, &thread_attr, monitor_thread, &monitor) == 0) {
+        monitor_started = 1;
     }
+    pthread_attr_destroy(&thread_attr);
 
-    sleep_sec(cfg.run_time_sec);
-    running = 0;
+    if (atomic_load(&running)) sleep_sec(cfg.run_time_sec);
+    atomic_store(&running, 0);
 
-    for (int i = 0; i < PHIL_COUNT; ++i) {
+    if (monitor_started) pthread_join(monitor_tid, NULL);
+    for (int i = 0; i < started; ++i) {
         pthread_join(threads[i], NULL);
     }
+    double elapsed = now_monotonic_sec() - now;
+    if (started < n) return 1;
+
+    printf("\nDining Philosophers (C)\n");
+    printf("Philosophers: %d | Run: %.2fs | Max think: %.2fs | Max eat: %.2fs | Timeout: %.2fs\n",
+           n, cfg.run_time_sec, cfg.max_think_sec, cfg.max_eat_sec, cfg.timeout_sec);
+    printf("Strategy: %s. %s\n\n", cfg.strategy->name, cfg.strategy->summary);
+
+    // The threads are joined, so relaxed loads here see every final value.
+    long total_meals = 0;
+    double wait_total = 0, wait_max = 0;
+    unsigned int all_hist[WAIT_BUCKETS] = {0}, hist[WAIT_BUCKETS];
+    int min_meals = atomic_load_explicit(&philosophers[0].meals, memory_order_relaxed), max_meals = min_meals;
+    for (int i = 0; i < n; ++i) {
+        int meals = atomic_load_explicit(&philosophers[i].meals, memory_order_relaxed);
+        double ph_max = atomic_load_explicit(&philosophers[i].wait_max, memory_order_relaxed);
+        total_meals += meals;
+        wait_total += atomic_load_explicit(&philosophers[i].wait_total, memory_order_relaxed);
+        if (ph_max > wait_max) wait_max = ph_max;
+        if (meals < min_meals) min_meals = meals;
+        if (meals > max_meals) max_meals = meals;
+        snapshot_hist(&philosophers[i], hist);
+        for (int b = 0; b < WAIT_BUCKETS; ++b) all_hist[b] += hist[b];
+    }
+    double mean = (double)total_meals / n;
 
-    printf("Dining Philosophers (C)\n");
-    printf("Run: %.2fs | Max think: %.2fs | Max eat: %.2fs | Timeout: %.2fs\n",
-           cfg.run_time_sec, cfg.max_think_sec, cfg.max_eat_sec, cfg.timeout_sec);
-    printf("Asymmetric pickup with timeout-based release to avoid deadlock.\n\n");
-
-    printf("%-6s %-8s %-18s %-10s %-10s\n", "Phil", "Meals", "Since Last (s)", "State", "Starving?");
+    if (n <= TABLE_MAX_ROWS) {
+        printf("%-6s %-8s %-8s %-10s %-10s %-10s %-16s %-10s %-10s\n", "Phil", "Meals", "Share", "p50 (ms)", "p99 (ms)",
+               "Max (ms)", "Since Last (s)", "State", "Starving?");
+    }
     int deadlock = 1;
-    int starvation = 0;
+    int starvation = 0, starving_at_exit = 0;
     double end_now = now_monotonic_sec();
-    for (int i = 0; i < PHIL_COUNT; ++i) {
-        double since = end_now - philosophers[i].last_meal_at;
-        deadlock = deadlock && (philosophers[i].meals == 0);
+    for (int i = 0; i < n; ++i) {
+        int meals = atomic_load_explicit(&philosophers[i].meals, memory_order_relaxed);
+        double since = end_now - atomic_load_explicit(&philosophers[i].last_meal_at, memory_order_relaxed);
+        deadlock = deadlock && (meals == 0);
         int starv = since > cfg.starvation_limit_sec;
-        if (starv) starvation = 1;
-        printf("%-6d %-8d %-18.2f %-10s %-10s\n", philosophers[i].id, philosophers[i].meals,
-               since, philosophers[i].state, starv ? "YES" : "NO");
+        if (starv) {
+            starvation = 1;
+            starving_at_exit++;
+        }
+        if (n <= TABLE_MAX_ROWS) {
+            double ph_max = atomic_load_explicit(&philosophers[i].wait_max, memory_order_relaxed);
+            snapshot_hist(&philosophers[i], hist);
+            printf("%-6d %-8d %-8.2f %-10.1f %-10.1f %-10.1f %-16.2f %-10s %-10s\n", philosophers[i].id, meals,
+                   mean > 0 ? meals / mean : 0.0, wait_percentile(hist, 0.50, ph_max) * 1e3,
+                   wait_percentile(hist, 0.99, ph_max) * 1e3, ph_max * 1e3, since,
+                   state_names[atomic_load_explicit(&philosophers[i].state, memory_order_relaxed)],
+                   starv ? "YES" : "NO");
+        }
     }
-
+    if (monitor.starvation_events > 0) starvation = 1;
+    if (n > TABLE_MAX_ROWS) printf("(per-philosopher table omitted for more than %d philosophers)\n", TABLE_MAX_ROWS);
+
+    printf("\nMeals: %ld total, %.1f meals/s\n", total_meals, elapsed > 0 ? total_meals / elapsed : 0.0);
+    printf("Fairness: min %d, mean %.2f, max %d meals per philosopher, Jain index %.4f\n", min_meals, mean,
+           max_meals, jain_index(philosophers, n));
+    printf("Hungry wait: mean %.1f ms, p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           total_meals > 0 ? wait_total / total_meals * 1e3 : 0.0, wait_percentile(all_hist, 0.50, wait_max) * 1e3,
+           wait_percentile(all_hist, 0.99, wait_max) * 1e3, wait_max * 1e3);
+    if (monitor.starvation_events > 0) {
+        printf("Starvation during run: %d event(s), longest stall %.2fs\n", monitor.starvation_events,
+               monitor.worst_stall);
+    }
+    if (starving_at_exit > 0) printf("Starving at exit: %d of %d\n", starving_at_exit, n);
     printf("\n%s\n", deadlock ? "Deadlock detected." : "No deadlock observed.");
     printf("%s\n", starvation ? "Starvation detected." : "No starvation detected.");
 
-    for (int i = 0; i < PHIL_COUNT; ++i) {
-        pthread_mutex_destroy(&chopsticks[i]);
+    for (int i = 0; i < n; ++i) {
+        pthread_mutex_destroy(&chopsticks[i].mutex);
+        pthread_cond_destroy(&chopsticks[i].cond);
+        pthread_cond_destroy(&philosophers[i].cond);
     }
+    free(starving);
+    free(args);
+    free(threads);
+    free(philosophers);
+    free(chopsticks);
 
     return 0;
 }